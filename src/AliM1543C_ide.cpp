@@ -2000,11 +2000,8 @@ void CAliM1543C_ide::execute(int index) {
 
         SEL_DISK(index)->seek_block(lba);
 
-        SEL_DISK(index)->read_blocks(&(CONTROLLER(index).data[0]),
-                                     SEL_REGISTERS(index).sector_count);
-
-        u8 *ptr = (u8 *)(&CONTROLLER(index).data[0]);
-        do_dma_transfer(index, ptr, SEL_REGISTERS(index).sector_count * 512,
+        // read straight from the disk into memory
+        do_dma_transfer(index, NULL, SEL_REGISTERS(index).sector_count * 512,
                         false);
         SEL_COMMAND(index).command_in_progress = false;
         SEL_STATUS(index).drive_ready = true;
@@ -2036,16 +2033,15 @@ void CAliM1543C_ide::execute(int index) {
                  SEL_REGISTERS(index).sector_count * 512);
 #endif
 
-          u8 *ptr = (u8 *)(&CONTROLLER(index).data[0]);
-          do_dma_transfer(index, ptr, SEL_REGISTERS(index).sector_count * 512,
-                          true);
           u32 lba = (SEL_REGISTERS(index).head_no << 24) |
                     (SEL_REGISTERS(index).cylinder_no << 8) |
                     SEL_REGISTERS(index).sector_no;
 
           SEL_DISK(index)->seek_block(lba);
-          SEL_DISK(index)->write_blocks(&(CONTROLLER(index).data[0]),
-                                        SEL_REGISTERS(index).sector_count);
+
+          // write straight from memory to the disk
+          do_dma_transfer(index, NULL, SEL_REGISTERS(index).sector_count * 512,
+                          true);
           SEL_COMMAND(index).command_in_progress = false;
           SEL_STATUS(index).drive_ready = true;
           SEL_STATUS(index).seek_complete = true;
@@ -2184,8 +2180,15 @@ void CAliM1543C_ide::execute(int index) {
   SEL_COMMAND(index).command_cycle++;
 }
 
+/**
+ * Run a bus master transfer of buffersize bytes through the PRD table.
+ * direction is false for transfers to memory. If buffer is NULL, the data
+ * moves straight between memory and the selected disk, at its current
+ * position; otherwise it is copied to or from buffer.
+ **/
 int CAliM1543C_ide::do_dma_transfer(int index, u8 *buffer, u32 buffersize,
                                     bool direction) {
+  SPCI_dma_map map;
   u8 xfer;
   size_t xfersize = 0;
   u8 status = 0;
@@ -2220,13 +2223,17 @@ int CAliM1543C_ide::do_dma_transfer(int index, u8 *buffer, u32 buffersize,
     }
 
     // copy it to/from ram.
-    if (!direction) {
-      do_pci_write(base, buffer, 1, size);
+    pci_dma_map(base, size, &map);
+    if (!buffer) {
+      dma_disk(index, &map, direction);
+    } else if (!direction) {
+      pci_dma_write(&map, 0, buffer, size);
       buffer += size;
     } else {
-      do_pci_read(base, buffer, 1, size);
+      pci_dma_read(&map, 0, buffer, size);
       buffer += size;
     }
+    pci_dma_unmap(&map);
 
     xfersize += size;
     prd += 8; // go to next entry.
@@ -2275,6 +2282,36 @@ int CAliM1543C_ide::do_dma_transfer(int index, u8 *buffer, u32 buffersize,
   return status;
 }
 
+/**
+ * Move the data of a mapped PRD between memory and the selected disk. The
+ * disk reads and writes main memory in place; only the parts of the
+ * mapping that aren't main memory go through a bounce buffer.
+ **/
+void CAliM1543C_ide::dma_disk(int index, SPCI_dma_map *map, bool direction) {
+  size_t offset = 0;
+
+  for (size_t i = 0; i < map->iov.size(); i++) {
+    SPCI_iovec *v = &map->iov[i];
+
+    if (v->base && !direction) {
+      SEL_DISK(index)->read_bytes(v->base, v->len);
+      pci_dma_dirty(map, offset, v->len);
+    } else if (v->base) {
+      SEL_DISK(index)->write_bytes(v->base, v->len);
+    } else {
+      std::vector<u8> bounce(v->len);
+      if (!direction) {
+        SEL_DISK(index)->read_bytes(bounce.data(), v->len);
+        pci_dma_write(map, offset, bounce.data(), v->len);
+      } else {
+        pci_dma_read(map, offset, bounce.data(), v->len);
+        SEL_DISK(index)->write_bytes(bounce.data(), v->len);
+      }
+    }
+    offset += v->len;
+  }
+}
+
 /**
  * Thread entry point.
  **/
@@ -98,6 +98,7 @@ private:
   u32 ide_busmaster_read(int channel, u32 address, int dsize);
   void ide_busmaster_write(int channel, u32 address, u32 data, int dsize);
   int do_dma_transfer(int index, u8 *buffer, u32 size, bool direction);
+  void dma_disk(int index, SPCI_dma_map *map, bool direction);
 
   void raise_interrupt(int channel);
   void set_signature(int channel, int id);
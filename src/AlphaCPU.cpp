@@ -45,6 +45,9 @@
 #include "cpu_vax.hpp"
 #include "lockstep.hpp"
 
+#include <algorithm>
+#include <vector>
+
 #if !defined(HAVE_NEW_FP)
 #include "es40_float.hpp"
 #endif
@@ -72,11 +75,97 @@ void CAlphaCPU::run() {
   }
 }
 
+/**
+ * \brief Run the CPUs that share this host thread.
+ *
+ * Each CPU in thread_cpus runs CPU_QUANTUM calls to execute() in turn. CPUs
+ * that haven't been started yet, or that are idle, are skipped; when all of
+ * them are, the thread waits in thread_wait(). With a single host thread,
+ * the CPUs are interleaved the same way on every run.
+ **/
+void CAlphaCPU::run_shared() {
+  try {
+    mySemaphore.wait();
+    for (;;) {
+      bool ran = false;
+      std::chrono::steady_clock::time_point now =
+          std::chrono::steady_clock::now();
+
+      if (StopThread)
+        return;
+      for (CAlphaCPU *c : thread_cpus) {
+        if (c->state.wait_for_start || !c->idle_unpark(now))
+          continue;
+        if (!c->thread_started) {
+          c->thread_started = true;
+          printf("*** CPU%d *** STARTING ***\n", c->get_cpuid());
+        }
+        ran = true;
+        for (int i = 0; i < CPU_QUANTUM && !c->idle_parked; i++)
+          c->execute();
+      }
+      if (!ran)
+        thread_wait();
+    }
+  } catch (CException &e) {
+    printf("Exception in CPU thread: %s.\n", e.displayText().c_str());
+    for (CAlphaCPU *c : thread_cpus)
+      c->myThreadDead.store(true);
+    // Let the thread die...
+  }
+}
+
+/**
+ * \brief Wait until one of the CPUs sharing this host thread can run.
+ *
+ * Called by run_shared() when all of them are idle or not started yet. Waits
+ * until the first idle one is due to run again, until irq_h() wakes us up,
+ * or, for CPUs that aren't started yet, for 1 ms.
+ **/
+void CAlphaCPU::thread_wait() {
+  std::chrono::steady_clock::time_point until =
+      std::chrono::steady_clock::now() + std::chrono::milliseconds(1);
+  bool pending = false;
+
+  for (CAlphaCPU *c : thread_cpus)
+    if (c->idle_parked && c->idle_until < until)
+      until = c->idle_until;
+
+  std::unique_lock<std::mutex> lock(idle_mutex);
+  idle_wake = false;
+  for (CAlphaCPU *c : thread_cpus)
+    c->idle_sleeping.store(true, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  for (CAlphaCPU *c : thread_cpus)
+    if (c->irq_mail.load(std::memory_order_relaxed) != c->irq_seen ||
+        c->idle_poked.load(std::memory_order_relaxed))
+      pending = true;
+  if (!pending)
+    idle_cond.wait_until(lock, until,
+                         [this] { return idle_wake || StopThread; });
+  for (CAlphaCPU *c : thread_cpus)
+    c->idle_sleeping.store(false, std::memory_order_relaxed);
+}
+
+/**
+ * \brief Set the CPU whose host thread runs this CPU.
+ *
+ * Called by CSystem::start_threads() for all CPUs in order, before their
+ * threads are started. The leader of a group is always set up first.
+ **/
+void CAlphaCPU::set_thread(CAlphaCPU *leader) {
+  thread_leader = leader;
+  thread_cpus.clear();
+  leader->thread_cpus.push_back(this);
+}
+
 /**
  * Constructor.
  **/
 CAlphaCPU::CAlphaCPU(CConfigurator *cfg, CSystem *system)
-    : CSystemComponent(cfg, system), mySemaphore(0, 1) {}
+    : CSystemComponent(cfg, system), mySemaphore(0, 1) {
+  jit_buffer = nullptr;
+}
 
 /**
  * Initialize the CPU.
@@ -89,12 +178,56 @@ void CAlphaCPU::init() {
   state.iProcNum = cSystem->RegisterCPU(this);
 
   state.wait_for_start = (state.iProcNum == 0) ? false : true;
+  thread_leader = this;
+  thread_shared = false;
+  thread_started = false;
+  idle_parked = false;
+  icache_hits = 0;
+  icache_misses = 0;
+  icache_snoops = 0;
+  icache_stale_count = 0;
   icache_enabled = true;
   flush_icache();
-  icache_enabled = myCfg->get_bool_value("icache", false);
+  icache_enabled = myCfg->get_bool_value("icache", true);
+  bcache_enabled = myCfg->get_bool_value("block_cache", true);
+  memset(icache_gen, 0, sizeof(icache_gen));
+  if (bcache_enabled) {
+    bcache.reset(new SBlock[BCACHE_ENTRIES]);
+    bcache_flush();
+  }
+  memloop_enabled = bcache_enabled && myCfg->get_bool_value("copy_loops", true);
+  if (memloop_enabled)
+    memloops.reset(new SMemLoop[BCACHE_ENTRIES]());
+  jit_enabled = bcache_enabled && myCfg->get_bool_value("jit", false);
+  if (jit_enabled)
+    jit_init();
+  tb_fill_enabled = myCfg->get_bool_value("native_tb_fill", false);
+  tb_fill_pal = 1; // not a PAL base
+  host_fp_enabled = myCfg->get_bool_value("host_fp", true);
+  idle_enabled = myCfg->get_bool_value("idle_sleep", false);
+  idle_pc = 1; // never a branch target outside PALmode
+  idle_count = 0;
+  idle_ok = false;
+  idle_nwatch = 0;
+  idle_watching = false;
+  for (int i = 0; i < IDLE_WATCH_MAX; i++)
+    idle_watch_pa[i] = 1;
   skip_memtest_hack = myCfg->get_bool_value("skip_memtest_hack", false);
   skip_memtest_counter = 0;
-
+  unalign_enabled = myCfg->get_bool_value("unaligned_fixup", false);
+  osfpal_check = myCfg->get_bool_value("osf_pal_check", false);
+  osfpal_enabled =
+      myCfg->get_bool_value("osf_pal_native", false) || osfpal_check;
+  osfpal_active = false;
+  osfpal_pcbb = 1;
+  osfpal_base = 1;
+  osfpal_sum = 0;
+  memset(osfpal_trust, 0, sizeof(osfpal_trust));
+  osfpal_pending = -1;
+  select_execute();
+
+  memset(stlb, 0, sizeof(stlb));
+  stlb_ctx = 0;
   tbia(ACCESS_READ);
   tbia(ACCESS_EXEC);
 
@@ -125,6 +258,12 @@ void CAlphaCPU::init() {
   ins_per_timer_int = cpu_hz / 1024;
   next_timer_int = state.iProcNum ? U64(0xFFFFFFFFFFFFFFFF)
                                   : ins_per_timer_int; /* only on CPU 0 */
+  next_event.store(0, std::memory_order_relaxed);
+  clock_synced = 0;
+  irq_mail.store(0);
+  irq_seen = 0;
+  for (int i = 0; i < 6; i++)
+    irq_delay[i].store(0, std::memory_order_relaxed);
 
   state.r[22] = state.r[22 + 32] = state.iProcNum;
 
@@ -136,17 +275,33 @@ void CAlphaCPU::init() {
 void CAlphaCPU::start_threads() {
   char buffer[5];
   mySemaphore.tryWait(1);
+  thread_shared = thread_leader->thread_cpus.size() > 1;
+  if (thread_leader != this)
+    return; // runs on the thread of thread_leader
   if (!myThread) {
-    sprintf(buffer, "cpu%d", state.iProcNum);
-    myThread = std::make_unique<std::thread>([this](){ this->run(); });
-    printf(" %s", buffer);
     StopThread = false;
+    if (thread_shared) {
+      myThread = std::make_unique<std::thread>([this]() { this->run_shared(); });
+      for (size_t i = 0; i < thread_cpus.size(); i++) {
+        sprintf(buffer, "cpu%d", thread_cpus[i]->state.iProcNum);
+        printf("%s%s", i ? "+" : " ", buffer);
+      }
+    } else {
+      myThread = std::make_unique<std::thread>([this]() { this->run(); });
+      sprintf(buffer, "cpu%d", state.iProcNum);
+      printf(" %s", buffer);
+    }
   }
 }
 
 void CAlphaCPU::stop_threads() {
   char buffer[5];
   StopThread = true;
+  {
+    std::lock_guard<std::mutex> lock(idle_mutex);
+    idle_wake = true;
+    idle_cond.notify_one();
+  }
   if (myThread) {
     sprintf(buffer, "cpu%d", state.iProcNum);
     mySemaphore.set();
@@ -161,7 +316,15 @@ void CAlphaCPU::stop_threads() {
 /**
  * Destructor.
  **/
-CAlphaCPU::~CAlphaCPU() { stop_threads(); }
+CAlphaCPU::~CAlphaCPU() {
+  stop_threads();
+  jit_free();
+  dump_unalign();
+  if (icache_enabled)
+    printf("%s: icache %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+           " lines dropped after stores.\n",
+           devid_string, icache_hits, icache_misses, icache_snoops);
+}
 
 #if defined(IDB)
 char dbg_string[1000];
@@ -324,15 +487,509 @@ inline void CAlphaCPU::skip_memtest() {
 }
 
 /**
- * \brief Called each clock-cycle.
+ * \brief Account for one clock tick.
+ *
+ * Counts the instruction. Everything else that needs to be done on a clock
+ * tick is only done by clock_event(), once the instruction count reaches
+ * next_event.
+ *
+ * \return true if control was transferred to the PALcode interrupt handler.
+ **/
+inline bool CAlphaCPU::clock_tick() {
+  if (++state.instruction_count < next_event.load(std::memory_order_relaxed))
+    return false;
+  return clock_event();
+}
+
+/**
+ * \brief Do the clock tick bookkeeping that is due.
+ *
+ * Updates the cycle counters, delivers the interval timer interrupt, runs the
+ * delayed irq_h timers, and checks whether an interrupt needs to be serviced
+ * before the next instruction is executed. Then works out how many
+ * instructions can be executed before any of this needs to be done again,
+ * and sets next_event accordingly: the next instruction if an interrupt
+ * check or irq_h timer is pending, otherwise the instruction on which the
+ * interval timer expires, but no more than CLOCK_EVENT_MAX instructions
+ * ahead. Anything that sets check_int or check_timers resets next_event, so
+ * this is run again on the next instruction.
+ *
+ * \return true if control was transferred to the PALcode interrupt handler.
+ **/
+bool CAlphaCPU::clock_event() {
+  bool taken = false;
+  u64 ticks = CLOCK_EVENT_MAX;
+
+  sync_clock();
+
+  if (icache_stale)
+    icache_sync();
+
+  if (cc_large > next_timer_int) {
+    next_timer_int += ins_per_timer_int;
+    cSystem->interrupt(-1, true);
+  }
+
+  if (irq_mail.load(std::memory_order_acquire) != irq_seen)
+    irq_drain();
+
+  if (state.check_timers) {
+
+    // There are one or more active delayed irq_h interrupts. Go through the 6
+    // irq_h timers, and set the interrupt if the deadline has been reached.
+    state.check_timers = false;
+    for (int i = 0; i < 6; i++) {
+      if (state.irq_h_timer[i]) {
+        if (state.instruction_count >= irq_deadline[i]) {
+
+          // The timer has expired. Set the interrupt status, and set the
+          // flag that we need to check the interrupt status
+          state.irq_h_timer[i] = 0;
+          state.eir |= (U64(0x1) << i);
+          state.check_int = true;
+        } else {
+
+          // The timer hasn't expired yet; come back when it does.
+          state.irq_h_timer[i] =
+              (int)(irq_deadline[i] - state.instruction_count);
+          if ((u64)state.irq_h_timer[i] < ticks)
+            ticks = state.irq_h_timer[i];
+          state.check_timers = true;
+        }
+      }
+    }
+  }
+
+  if (state.check_int && !(state.pc & 1)) {
+
+    // One or more of the variables that affect interrupt status have changed,
+    // and we are not currently inside PALmode. It is not certain that this
+    // means we hava an interrupt to service, but we might have. This needs to
+    // be checked.
+
+    /*
+    if (state.pal_vms) {
+      // PALcode base is set to 0x8000; meaning OpenVMS PALcode is currently
+    active. In this
+      // case, our VMS PALcode replacement routines are valid, and should be
+    used as it is
+      // faster than using the original PALcode.
+
+      if (state.eir & state.eien & 6)
+        if (vmspal_ent_ext_int(state.eir&state.eien & 6))
+          return;
+
+      if (state.sir & state.sien & 0xfffc)
+        if (vmspal_ent_sw_int(state.sir&state.sien))
+          return;
+
+      if (state.asten && (state.aster & state.astrr & ((1<<(state.cm+1))-1) ))
+        if (vmspal_ent_ast_int(state.aster & state.astrr &
+    ((1<<(state.cm+1))-1) )) return;
+
+      if (state.sir & state.sien)
+        if (vmspal_ent_sw_int(state.sir&state.sien))
+          return;
+    } else
+*/
+    {
+
+      // PALcode base is set to an unsupported value. We have no choice but to
+      // transfer control to PALmode at the PALcode interrupt entry point.
+      //        if (state.eir & 8)
+      //        {
+      //          printf("%s: IP interrupt received%s...\n",devid_string,
+      //          (state.eien&8)?"(enabled)":"(masked)");
+      //        }
+      if ((state.eien & state.eir) || (state.sien & state.sir) ||
+          (state.asten &&
+           (state.aster & state.astrr & ((1 << (state.cm + 1)) - 1)))) {
+        GO_PAL(INTERRUPT);
+        taken = true;
+      } else {
+
+        // There are no active interrupts. We can safely set check_int to
+        // false now to save time on the next CPU clock ticks.
+        state.check_int = false;
+      }
+    }
+  }
+
+  if (cc_large > next_timer_int)
+    ticks = 1;
+  else if (cc_per_instruction &&
+           (next_timer_int - cc_large) / cc_per_instruction < ticks)
+    ticks = (next_timer_int - cc_large) / cc_per_instruction + 1;
+
+  next_event.store(state.instruction_count + ticks, std::memory_order_relaxed);
+
+  // Checked after setting next_event, so that an interrupt posted by another
+  // thread in the meantime isn't left waiting for CLOCK_EVENT_MAX
+  // instructions. The fence pairs with the read-modify-write on irq_mail in
+  // irq_h().
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (state.check_int || icache_stale ||
+      irq_mail.load(std::memory_order_relaxed) != irq_seen)
+    next_event.store(0, std::memory_order_relaxed);
+  return taken;
+}
+
+/**
+ * \brief Take over the interrupt lines posted by irq_h().
+ *
+ * Called from clock_event() when irq_mail has changed. Lines that are now
+ * asserted are set in eir, or get an irq_h timer if they were posted with a
+ * delay; lines that are now released are cleared, and their timers stopped.
+ **/
+void CAlphaCPU::irq_drain() {
+  u32 m = irq_mail.load(std::memory_order_acquire);
+
+  irq_seen = m;
+  state.check_timers = false;
+  for (int i = 0; i < 6; i++) {
+    u32 bit = 1U << i;
+    bool active = (state.eir & bit) || state.irq_h_timer[i];
+
+    if ((m & bit) && !active) {
+      if (m & (bit << 8)) {
+        state.irq_h_timer[i] = irq_delay[i].load(std::memory_order_relaxed);
+        irq_deadline[i] = state.instruction_count + state.irq_h_timer[i];
+      } else {
+        state.eir |= bit;
+        state.check_int = true;
+      }
+    } else if (!(m & bit) && active) {
+      state.eir &= ~bit;
+      state.irq_h_timer[i] = 0;
+    }
+
+    if (state.irq_h_timer[i])
+      state.check_timers = true;
+  }
+}
+
+/**
+ * \brief Watch for a guest idle loop.
+ *
+ * Called when a backward branch is taken. An idle loop is recognized as a
+ * short loop, outside PALmode, whose iterations leave the integer registers
+ * unchanged, and that idle_scan() finds doesn't do anything else: it can
+ * only be waiting for something outside the CPU to change, like an
+ * interrupt or another CPU writing to memory. After IDLE_ITERATIONS such
+ * iterations, idle_sleep() is called on every iteration.
+ **/
+void CAlphaCPU::idle_check() {
+  if (state.pc & 1)
+    return;
+
+  if (state.pc != idle_pc || state.current_pc != idle_branch ||
+      state.instruction_count - idle_icount > IDLE_LOOP_MAX) {
+
+    // Not the loop we were watching, or not a short loop; start watching
+    // this one.
+    idle_pc = state.pc;
+    idle_branch = state.current_pc;
+    idle_count = 0;
+    memcpy(idle_r, state.r, sizeof(idle_r));
+  } else if (memcmp(idle_r, state.r, sizeof(idle_r))) {
+    idle_count = 0;
+    memcpy(idle_r, state.r, sizeof(idle_r));
+  } else if (idle_count < IDLE_ITERATIONS) {
+    if (++idle_count == IDLE_ITERATIONS)
+      idle_ok = idle_scan();
+  } else if (idle_ok) {
+    idle_sleep(idle_nwatch);
+  }
+
+  idle_icount = state.instruction_count;
+}
+
+/**
+ * \brief Check that the loop being watched does nothing but wait.
+ *
+ * The instructions from idle_pc to idle_branch may not store, call the
+ * PALcode, jump or branch out of the loop, or use the floating-point
+ * registers. They may load from main memory, at addresses that don't depend
+ * on the registers the loop writes; those quadwords are what another CPU or
+ * a device would write to end the wait, and are left in idle_host for
+ * idle_sleep() to watch. Loads from anywhere else, like a device register,
+ * can change without a store and rule the loop out.
+ *
+ * \return true if the loop can be slept in.
+ **/
+bool CAlphaCPU::idle_scan() {
+  int n = (int)((idle_branch - idle_pc) >> 2) + 1;
+  u32 written = 0;
+  u64 pa;
+  bool asm_bit;
+
+  idle_nwatch = 0;
+  if (n > IDLE_LOOP_MAX || ((idle_pc ^ idle_branch) >> 13) ||
+      virt2phys(idle_pc, &pa, ACCESS_EXEC | FAKE, &asm_bit, 0) ||
+      ((pa + 4 * n - 1) >> cSystem->get_memory_bits()))
+    return false;
+
+  const u32 *code = (const u32 *)cSystem->PtrToMem(pa);
+
+  // The first pass finds the registers the loop writes, the second one the
+  // memory it reads.
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 0; i < n; i++) {
+      u32 ins = endian_32(code[i]);
+      int opcode = ins >> 26;
+      int ra = (ins >> 21) & 31;
+      int rb = (ins >> 16) & 31;
+      bool load = opcode == 0x28 || opcode == 0x29 ||
+                  (opcode >= 0x0a && opcode <= 0x0c);
+
+      if (opcode == 0x08 || opcode == 0x09 || load) {
+        written |= 1U << ra;
+      } else if ((opcode >= 0x10 && opcode <= 0x13) || opcode == 0x1c) {
+        written |= 1U << (ins & 31);
+      } else if (opcode == 0x18) {
+        u32 function = ins & 0xffff;
+        if (function != 0x0000 && function != 0x0400 && function != 0x4000 &&
+            function != 0x4400) // TRAPB, EXCB, MB, WMB
+          return false;
+      } else if (opcode >= 0x30 && opcode != 0x31 && opcode != 0x32 &&
+                 opcode != 0x33 && opcode != 0x35 && opcode != 0x36 &&
+                 opcode != 0x37) {
+        u64 target = idle_pc + 4 * i + 4 + (sext_u64_21(ins) << 2);
+        if (target < idle_pc || target > idle_branch)
+          return false;
+        if (opcode == 0x30 || opcode == 0x34) // BR, BSR
+          written |= 1U << ra;
+      } else {
+        return false;
+      }
+
+      if (pass == 0 || !load)
+        continue;
+
+      if (written & (1U << rb))
+        return false;
+
+      u64 va = state.r[rb] + sext_u64_16(ins);
+      if (opcode == 0x0b)
+        va &= ~U64(0x7);
+      if (virt2phys(va, &pa, ACCESS_READ | NO_CHECK | FAKE, &asm_bit, 0) ||
+          (pa >> cSystem->get_memory_bits()))
+        return false;
+
+      std::atomic<u64> *host =
+          (std::atomic<u64> *)cSystem->PtrToMem(pa & ~U64(0x7));
+      int w;
+      for (w = 0; w < idle_nwatch && idle_host[w] != host; w++)
+        ;
+      if (w == idle_nwatch) {
+        if (w == IDLE_WATCH_MAX)
+          return false;
+        idle_host[w] = host;
+        idle_value[w] = host->load(std::memory_order_relaxed);
+        idle_nwatch++;
+      }
+    }
+    written &= ~(1U << 31);
+  }
+  return true;
+}
+
+/**
+ * \brief Sleep while the guest is idle.
+ *
+ * Puts the CPU thread to sleep until irq_h() asserts an interrupt line, or
+ * until the interval timer expires. This is only done when the timer
+ * interrupt is enabled, so the guest is waiting at a low IPL and the sleep
+ * can't last longer than one timer period.
+ *
+ * The first \a nwatch quadwords in idle_host are watched while sleeping:
+ * a store to one of them by another CPU or a device wakes the thread up too
+ * (see idle_watch()).
+ *
+ * The time slept is accounted for as instructions executed in the idle loop,
+ * which keeps the cycle counter, the interval timer and the calibration in
+ * check_state() in step with the host clock.
+ **/
+void CAlphaCPU::idle_sleep(int nwatch) {
+  u64 us = IDLE_SLEEP_MAX;
+
+  if (!(state.eien & 4) || state.check_int || state.check_timers ||
+      !cc_per_instruction)
+    return;
+
+  sync_clock();
+  if (cc_large >= next_timer_int)
+    return;
+  if (next_timer_int - cc_large < us * cpu_hz / 1000000)
+    us = (next_timer_int - cc_large) * 1000000 / cpu_hz;
+  if (us < IDLE_SLEEP_MIN)
+    return;
+
+  idle_poked.store(false, std::memory_order_relaxed);
+  if (nwatch && !idle_watch(nwatch))
+    return;
+
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+
+  // On a shared thread, don't hold up the other CPUs: run_shared() skips
+  // this one until the time is up, or until there is an interrupt or a
+  // store to the memory it watches.
+  if (thread_shared) {
+    idle_parked = true;
+    idle_start = start;
+    idle_until = start + std::chrono::microseconds(us);
+    return;
+  }
+
+  {
+    std::unique_lock<std::mutex> lock(idle_mutex);
+    idle_wake = false;
+    idle_sleeping.store(true, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!state.check_int && !state.check_timers &&
+        irq_mail.load(std::memory_order_relaxed) == irq_seen &&
+        !idle_poked.load(std::memory_order_relaxed))
+      idle_cond.wait_for(lock, std::chrono::microseconds(us),
+                         [this] { return idle_wake || StopThread; });
+    idle_sleeping.store(false, std::memory_order_relaxed);
+  }
+
+  idle_unwatch();
+  idle_account(start);
+}
+
+/**
+ * \brief Have stores to the memory the idle loop reads wake the CPU up.
+ *
+ * Publishes the physical addresses of the first \a nwatch quadwords in
+ * idle_host for CSystem::idle_stored(), then checks that they still hold
+ * what the loop last saw; a store that came before that is caught here, one
+ * that comes after calls idle_stored(). A store racing with this can still
+ * be missed on a weakly ordered host, as the storing side doesn't fence;
+ * that only delays the wakeup until the timer interrupt.
+ *
+ * \return false, without watching anything, if the memory has changed.
+ **/
+bool CAlphaCPU::idle_watch(int nwatch) {
+  for (int i = 0; i < nwatch; i++)
+    idle_watch_pa[i].store(cSystem->MemToPhys(idle_host[i]),
+                           std::memory_order_relaxed);
+  idle_watching = true;
+  cSystem->idle_watchers.fetch_add(1);
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  bool changed = false;
+  for (int i = 0; i < nwatch; i++) {
+    u64 v = idle_host[i]->load(std::memory_order_relaxed);
+    if (v != idle_value[i]) {
+      idle_value[i] = v;
+      changed = true;
+    }
+  }
+  if (changed)
+    idle_unwatch();
+  return !changed;
+}
+
+/**
+ * \brief Stop watching the memory the idle loop reads.
+ **/
+void CAlphaCPU::idle_unwatch() {
+  if (!idle_watching)
+    return;
+  for (int i = 0; i < IDLE_WATCH_MAX; i++)
+    idle_watch_pa[i].store(1, std::memory_order_relaxed);
+  cSystem->idle_watchers.fetch_sub(1);
+  idle_watching = false;
+}
+
+/**
+ * \brief Wake the CPU up if its idle loop reads memory that was stored to.
+ *
+ * Called by CSystem::idle_stored(), on the thread of the CPU or device that
+ * did the store.
+ **/
+void CAlphaCPU::idle_stored(u64 address, size_t len) {
+  for (int i = 0; i < IDLE_WATCH_MAX; i++) {
+    u64 w = idle_watch_pa[i].load(std::memory_order_relaxed);
+    if (!(w & 1) && w < address + len && address < w + 8) {
+      idle_poked.store(true);
+      std::lock_guard<std::mutex> lock(thread_leader->idle_mutex);
+      thread_leader->idle_wake = true;
+      thread_leader->idle_cond.notify_one();
+      return;
+    }
+  }
+}
+
+/**
+ * \brief Account for the time spent idle since start.
+ *
+ * The time is counted as instructions executed in the idle loop.
+ **/
+void CAlphaCPU::idle_account(std::chrono::steady_clock::time_point start) {
+  u64 ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - start)
+               .count();
+  state.instruction_count +=
+      ns * (cpu_hz / 1000) / 1000000 / cc_per_instruction;
+  next_event.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * \brief Check whether an idle CPU on a shared thread should run again.
+ *
+ * \return true if the CPU isn't idle, or if its time is up or an interrupt
+ *         is pending; the time it was idle is then accounted for.
+ **/
+bool CAlphaCPU::idle_unpark(std::chrono::steady_clock::time_point now) {
+  if (!idle_parked)
+    return true;
+  if (now < idle_until && !state.check_int && !state.check_timers &&
+      irq_mail.load(std::memory_order_relaxed) == irq_seen &&
+      !idle_poked.load(std::memory_order_relaxed))
+    return false;
+  idle_parked = false;
+  idle_unwatch();
+  idle_account(idle_start);
+  return true;
+}
+
+/**
+ * \brief Select the variant of the execution loop to use.
+ *
+ * Called whenever the settings the variants are specialized on change. The
+ * block cache can only be used with the instruction cache enabled.
+ *
+ * The loops are not specialized on PALmode. The block cache translates the
+ * register numbers once, when a block is decoded, so it would gain nothing,
+ * and the plain interpreter is only used with the block cache disabled.
+ **/
+void CAlphaCPU::select_execute() {
+#if !defined(IDB)
+  if (bcache_enabled && icache_enabled) {
+    execute_fn = skip_memtest_hack ? &CAlphaCPU::execute_block<true>
+                                   : &CAlphaCPU::execute_block<false>;
+    return;
+  }
+#endif
+  execute_fn = skip_memtest_hack ? &CAlphaCPU::execute_ins<true>
+                                 : &CAlphaCPU::execute_ins<false>;
+}
+
+/**
+ * \brief Process a single instruction.
  *
  * This is where the actual CPU emulation takes place. Each clocktick, one
  *instruction is processed by the processor. The instruction pipeline is not
  *emulated, things are complicated enough as it is. The one exception is the
  *instruction cache, which is implemented, to accomodate self-modifying code.
  *The instruction cache can be disabled if self-modifying code is not expected.
+ *
+ * MemtestHack tells whether skip_memtest_hack is set.
  **/
-void CAlphaCPU::execute() {
+template <bool MemtestHack> void CAlphaCPU::execute_ins() {
   u32 ins;
   int i;
   u64 phys_address;
@@ -376,109 +1033,17 @@ void CAlphaCPU::execute() {
 #endif
   state.current_pc = state.pc;
 
-  if (skip_memtest_hack)
+  if (MemtestHack)
     skip_memtest();
 
   // Service interrupts
   if (DO_ACTION) {
 
-    // We're actually executing code. Cycle counter should be updated, interrupt
-    // and interrupt timer status needs to be checked, and the next instruction
-    // should be fetched from the instruction cache. Increase the cycle counter
-    // if it is currently enabled.
-    state.instruction_count++;
-    cc_large += cc_per_instruction;
-
-    if (cc_large > next_timer_int) {
-      next_timer_int += ins_per_timer_int;
-      cSystem->interrupt(-1, true);
-    }
-
-    if (state.cc_ena) {
-      state.cc += cc_per_instruction;
-    }
-
-    if (state.check_timers) {
-
-      // There are one or more active delayed irq_h interrupts. Go through the 6
-      // irq_h timers, decrease them as needed, and set the interrupt if the
-      // timer reaches 0.
-      state.check_timers = false;
-      for (int i = 0; i < 6; i++) {
-        if (state.irq_h_timer[i]) {
-
-          // This timer is active. Decrease it, and check if it reached 0.
-          state.irq_h_timer[i]--;
-          if (state.irq_h_timer[i]) {
-
-            // The timer hasn't reached 0 yet; check on the timers again next
-            // clock tick.
-            state.check_timers = true;
-          } else {
-
-            // The timer has reached 0. Set the interrupt status, and set the
-            // flag that we need to check the interrupt status
-            state.eir |= (U64(0x1) << i);
-            state.check_int = true;
-          }
-        }
-      }
-    }
-
-    if (state.check_int && !(state.pc & 1)) {
-
-      // One or more of the variables that affect interrupt status have changed,
-      // and we are not currently inside PALmode. It is not certain that this
-      // means we hava an interrupt to service, but we might have. This needs to
-      // be checked.
-
-      /*
-      if (state.pal_vms) {
-        // PALcode base is set to 0x8000; meaning OpenVMS PALcode is currently
-      active. In this
-        // case, our VMS PALcode replacement routines are valid, and should be
-      used as it is
-        // faster than using the original PALcode.
-
-        if (state.eir & state.eien & 6)
-          if (vmspal_ent_ext_int(state.eir&state.eien & 6))
-            return;
-
-        if (state.sir & state.sien & 0xfffc)
-          if (vmspal_ent_sw_int(state.sir&state.sien))
-            return;
-
-        if (state.asten && (state.aster & state.astrr & ((1<<(state.cm+1))-1) ))
-          if (vmspal_ent_ast_int(state.aster & state.astrr &
-      ((1<<(state.cm+1))-1) )) return;
-
-        if (state.sir & state.sien)
-          if (vmspal_ent_sw_int(state.sir&state.sien))
-            return;
-      } else
-*/
-      {
-
-        // PALcode base is set to an unsupported value. We have no choice but to
-        // transfer control to PALmode at the PALcode interrupt entry point.
-        //        if (state.eir & 8)
-        //        {
-        //          printf("%s: IP interrupt received%s...\n",devid_string,
-        //          (state.eien&8)?"(enabled)":"(masked)");
-        //        }
-        if ((state.eien & state.eir) || (state.sien & state.sir) ||
-            (state.asten &&
-             (state.aster & state.astrr & ((1 << (state.cm + 1)) - 1)))) {
-          GO_PAL(INTERRUPT);
-          return;
-        }
-      }
-
-      // This point is reached only if there are no more active interrupts. We
-      // can safely set check_int to false now to save time on the next CPU
-      // clock ticks.
-      state.check_int = false;
-    }
+    // We're actually executing code. Update the cycle counter and check the
+    // interrupt status, and fetch the next instruction from the instruction
+    // cache.
+    if (clock_tick())
+      return;
 
     // If profiling is enabled, increase the profiling counter for the current
     // block of addresses.
@@ -521,672 +1086,122 @@ void CAlphaCPU::execute() {
   last_instruction = ins;
 #endif
   opcode = ins >> 26;
-  switch (opcode) {
-  case 0x00: // CALL_PAL
-    function = ins & 0x1fffffff;
-    OP(CALL_PAL, PAL);
-
-  //    switch (function)
-  //    {
-  //      case 0x123401: OP_FNC(vmspal_int_read_ide, NOP);
-  //      default: OP(CALL_PAL,PAL);
-  //    }
-  case 0x08:
-    OP(LDA, MEM);
-
-  case 0x09:
-    OP(LDAH, MEM);
-
-  case 0x0a:
-    OP(LDBU, MEM);
-
-  case 0x0b:
-    OP(LDQ_U, MEM);
-
-  case 0x0c:
-    OP(LDWU, MEM);
-
-  case 0x0d:
-    OP(STW, MEM);
-
-  case 0x0e:
-    OP(STB, MEM);
-
-  case 0x0f:
-    OP(STQ_U, MEM);
-
-  case 0x10: // INTA* instructions
-    function = (ins >> 5) & 0x7f;
-    switch (function) {
-    case 0x40:
-      OP(ADDL_V, R12_R3);
-    case 0x00:
-      OP(ADDL, R12_R3);
-    case 0x02:
-      OP(S4ADDL, R12_R3);
-    case 0x49:
-      OP(SUBL_V, R12_R3);
-    case 0x09:
-      OP(SUBL, R12_R3);
-    case 0x0b:
-      OP(S4SUBL, R12_R3);
-    case 0x0f:
-      OP(CMPBGE, R12_R3);
-    case 0x12:
-      OP(S8ADDL, R12_R3);
-    case 0x1b:
-      OP(S8SUBL, R12_R3);
-    case 0x1d:
-      OP(CMPULT, R12_R3);
-    case 0x60:
-      OP(ADDQ_V, R12_R3);
-    case 0x20:
-      OP(ADDQ, R12_R3);
-    case 0x22:
-      OP(S4ADDQ, R12_R3);
-    case 0x69:
-      OP(SUBQ_V, R12_R3);
-    case 0x29:
-      OP(SUBQ, R12_R3);
-    case 0x2b:
-      OP(S4SUBQ, R12_R3);
-    case 0x2d:
-      OP(CMPEQ, R12_R3);
-    case 0x32:
-      OP(S8ADDQ, R12_R3);
-    case 0x3b:
-      OP(S8SUBQ, R12_R3);
-    case 0x3d:
-      OP(CMPULE, R12_R3);
-    case 0x4d:
-      OP(CMPLT, R12_R3);
-    case 0x6d:
-      OP(CMPLE, R12_R3);
-    default:
-      UNKNOWN2;
-    }
-    break;
-
-  case 0x11: // INTL* instructions
-    function = (ins >> 5) & 0x7f;
-    switch (function) {
-    case 0x00:
-      OP(AND, R12_R3);
-    case 0x08:
-      OP(BIC, R12_R3);
-    case 0x14:
-      OP(CMOVLBS, R12_R3);
-    case 0x16:
-      OP(CMOVLBC, R12_R3);
-    case 0x20:
-      OP(BIS, R12_R3);
-    case 0x24:
-      OP(CMOVEQ, R12_R3);
-    case 0x26:
-      OP(CMOVNE, R12_R3);
-    case 0x28:
-      OP(ORNOT, R12_R3);
-    case 0x40:
-      OP(XOR, R12_R3);
-    case 0x44:
-      OP(CMOVLT, R12_R3);
-    case 0x46:
-      OP(CMOVGE, R12_R3);
-    case 0x48:
-      OP(EQV, R12_R3);
-    case 0x61:
-      OP(AMASK, R2_R3);
-    case 0x64:
-      OP(CMOVLE, R12_R3);
-    case 0x66:
-      OP(CMOVGT, R12_R3);
-    case 0x6c:
-      OP(IMPLVER, X_R3);
-    default:
-      UNKNOWN2;
-    }
-    break;
-
-  case 0x12: // INTS* instructions
-    function = (ins >> 5) & 0x7f;
-    switch (function) {
-    case 0x02:
-      OP(MSKBL, R12_R3);
-    case 0x06:
-      OP(EXTBL, R12_R3);
-    case 0x0b:
-      OP(INSBL, R12_R3);
-    case 0x12:
-      OP(MSKWL, R12_R3);
-    case 0x16:
-      OP(EXTWL, R12_R3);
-    case 0x1b:
-      OP(INSWL, R12_R3);
-    case 0x22:
-      OP(MSKLL, R12_R3);
-    case 0x26:
-      OP(EXTLL, R12_R3);
-    case 0x2b:
-      OP(INSLL, R12_R3);
-    case 0x30:
-      OP(ZAP, R12_R3);
-    case 0x31:
-      OP(ZAPNOT, R12_R3);
-    case 0x32:
-      OP(MSKQL, R12_R3);
-    case 0x34:
-      OP(SRL, R12_R3);
-    case 0x36:
-      OP(EXTQL, R12_R3);
-    case 0x39:
-      OP(SLL, R12_R3);
-    case 0x3b:
-      OP(INSQL, R12_R3);
-    case 0x3c:
-      OP(SRA, R12_R3);
-    case 0x52:
-      OP(MSKWH, R12_R3);
-    case 0x57:
-      OP(INSWH, R12_R3);
-    case 0x5a:
-      OP(EXTWH, R12_R3);
-    case 0x62:
-      OP(MSKLH, R12_R3);
-    case 0x67:
-      OP(INSLH, R12_R3);
-    case 0x6a:
-      OP(EXTLH, R12_R3);
-    case 0x72:
-      OP(MSKQH, R12_R3);
-    case 0x77:
-      OP(INSQH, R12_R3);
-    case 0x7a:
-      OP(EXTQH, R12_R3);
-    default:
-      UNKNOWN2;
-    }
-    break;
-
-  case 0x13: // INTM* instructions
-    function = (ins >> 5) & 0x7f;
-    switch (function) // ignore /V for now
-    {
-    case 0x40:
-      OP(MULL_V, R12_R3);
-    case 0x00:
-      OP(MULL, R12_R3);
-    case 0x60:
-      OP(MULQ_V, R12_R3);
-    case 0x20:
-      OP(MULQ, R12_R3);
-    case 0x30:
-      OP(UMULH, R12_R3);
-    default:
-      UNKNOWN2;
-    }
-    break;
-
-  case 0x14: // ITFP* instructions
-    function = (ins >> 5) & 0x7ff;
-    switch (function) {
-    case 0x004:
-      OP(ITOFS, R1_F3);
-
-    case 0x00a:
-    case 0x08a:
-    case 0x10a:
-    case 0x18a:
-    case 0x40a:
-    case 0x48a:
-    case 0x50a:
-    case 0x58a:
-      OP(SQRTF, F2_F3);
-
-    case 0x00b:
-    case 0x04b:
-    case 0x08b:
-    case 0x0cb:
-    case 0x10b:
-    case 0x14b:
-    case 0x18b:
-    case 0x1cb:
-    case 0x50b:
-    case 0x54b:
-    case 0x58b:
-    case 0x5cb:
-    case 0x70b:
-    case 0x74b:
-    case 0x78b:
-    case 0x7cb:
-      OP(SQRTS, F2_F3);
-
-    case 0x014:
-      OP(ITOFF, R1_F3);
-
-    case 0x024:
-      OP(ITOFT, R1_F3);
-
-    case 0x02a:
-    case 0x0aa:
-    case 0x12a:
-    case 0x1aa:
-    case 0x42a:
-    case 0x4aa:
-    case 0x52a:
-    case 0x5aa:
-      OP(SQRTG, F2_F3);
-
-    case 0x02b:
-    case 0x06b:
-    case 0x0ab:
-    case 0x0eb:
-    case 0x12b:
-    case 0x16b:
-    case 0x1ab:
-    case 0x1eb:
-    case 0x52b:
-    case 0x56b:
-    case 0x5ab:
-    case 0x5eb:
-    case 0x72b:
-    case 0x76b:
-    case 0x7ab:
-    case 0x7eb:
-      OP(SQRTT, F2_F3);
-
-    default:
-      UNKNOWN2;
-    }
-    break;
-
-  case 0x15: // FLTV* instructions
-    function = (ins >> 5) & 0x7ff;
-    switch (function) {
-    case 0x0a5:
-    case 0x4a5:
-      OP(CMPGEQ, F12_F3);
-
-    case 0x0a6:
-    case 0x4a6:
-      OP(CMPGLT, F12_F3);
-
-    case 0x0a7:
-    case 0x4a7:
-      OP(CMPGLE, F12_F3);
-
-    case 0x03c:
-    case 0x0bc:
-      OP(CVTQF, F2_F3);
-
-    case 0x03e:
-    case 0x0be:
-      OP(CVTQG, F2_F3);
-
-    default:
-      if (function & 0x200) {
-        UNKNOWN2;
-      }
-
-      switch (function & 0x7f) {
-      case 0x000:
-        OP(ADDF, F12_F3);
-      case 0x001:
-        OP(SUBF, F12_F3);
-      case 0x002:
-        OP(MULF, F12_F3);
-      case 0x003:
-        OP(DIVF, F12_F3);
-      case 0x01e:
-        OP(CVTDG, F2_F3);
-      case 0x020:
-        OP(ADDG, F12_F3);
-      case 0x021:
-        OP(SUBG, F12_F3);
-      case 0x022:
-        OP(MULG, F12_F3);
-      case 0x023:
-        OP(DIVG, F12_F3);
-      case 0x02c:
-        OP(CVTGF, F12_F3);
-      case 0x02d:
-        OP(CVTGD, F2_F3);
-      case 0x02f:
-        OP(CVTGQ, F2_F3);
-      default:
-        UNKNOWN2;
-      }
-      break;
-    }
-    break;
-
-  case 0x16: // FLTI* instructions
-    function = (ins >> 5) & 0x7ff;
-    switch (function) {
-    case 0x0a4:
-    case 0x5a4:
-      OP(CMPTUN, F12_F3);
-
-    case 0x0a5:
-    case 0x5a5:
-      OP(CMPTEQ, F12_F3);
-
-    case 0x0a6:
-    case 0x5a6:
-      OP(CMPTLT, F12_F3);
-
-    case 0x0a7:
-    case 0x5a7:
-      OP(CMPTLE, F12_F3);
-
-    case 0x2ac:
-    case 0x6ac:
-      OP(CVTST, F2_F3);
-
-    default:
-      if (((function & 0x600) == 0x200) || ((function & 0x500) == 0x400)) {
-        UNKNOWN2;
-      }
-
-      switch (function & 0x3f) {
-      case 0x00:
-        OP(ADDS, F12_F3);
-      case 0x01:
-        OP(SUBS, F12_F3);
-      case 0x02:
-        OP(MULS, F12_F3);
-      case 0x03:
-        OP(DIVS, F12_F3);
-      case 0x20:
-        OP(ADDT, F12_F3);
-      case 0x21:
-        OP(SUBT, F12_F3);
-      case 0x22:
-        OP(MULT, F12_F3);
-      case 0x23:
-        OP(DIVT, F12_F3);
-      case 0x2c:
-        OP(CVTTS, F2_F3);
-      case 0x2f:
-        OP(CVTTQ, F2_F3);
-      case 0x3c:
-        if ((function & 0x300) == 0x100) {
-          UNKNOWN2;
-        }
-        OP(CVTQS, F2_F3);
-      case 0x3e:
-        if ((function & 0x300) == 0x100) {
-          UNKNOWN2;
-        }
-        OP(CVTQT, F2_F3);
-      default:
-        UNKNOWN2;
-      }
-      break;
-    }
-    break;
-
-  case 0x17: // FLTL* instructions
-    function = (ins >> 5) & 0x7ff;
-    switch (function) {
-    case 0x010:
-      OP(CVTLQ, F2_F3);
-
-    case 0x020:
-      OP(CPYS, F12_F3);
-
-    case 0x021:
-      OP(CPYSN, F12_F3);
-
-    case 0x022:
-      OP(CPYSE, F12_F3);
-
-    case 0x024:
-      OP(MT_FPCR, X_F1);
-
-    case 0x025:
-      OP(MF_FPCR, X_F1);
-
-    case 0x02a:
-      OP(FCMOVEQ, F12_F3);
-
-    case 0x02b:
-      OP(FCMOVNE, F12_F3);
-
-    case 0x02c:
-      OP(FCMOVLT, F12_F3);
-
-    case 0x02d:
-      OP(FCMOVGE, F12_F3);
-
-    case 0x02e:
-      OP(FCMOVLE, F12_F3);
-
-    case 0x02f:
-      OP(FCMOVGT, F12_F3);
-
-    case 0x030:
-    case 0x130:
-    case 0x530:
-      OP(CVTQL, F12_F3);
-
-    default:
-      UNKNOWN2;
-    }
-    break;
-
-  case 0x18: // MISC* instructions
-    function = (ins & 0xffff);
-    switch (function) {
-    case 0x0000:
-      OP(TRAPB, NOP);
-    case 0x0400:
-      OP(EXCB, NOP);
-    case 0x4000:
-      OP(MB, NOP);
-    case 0x4400:
-      OP(WMB, NOP);
-    case 0x8000:
-      OP(FETCH, NOP);
-    case 0xA000:
-      OP(FETCH_M, NOP);
-    case 0xC000:
-      OP(RPCC, X_R1);
-    case 0xE000:
-      OP(RC, X_R1);
-    case 0xE800:
-      OP(ECB, NOP);
-    case 0xF000:
-      OP(RS, X_R1);
-    case 0xF800:
-      OP(WH64, NOP);
-    case 0xFC00:
-      OP(WH64EN, NOP);
-    default:
-      UNKNOWN2;
-    }
-    break;
-
-  case 0x19: // HW_MFPR
-    function = (ins >> 8) & 0xff;
-    OP(HW_MFPR, MFPR);
-
-  case 0x1a: // JSR* instructions
-    OP(JMP, JMP);
-
-  case 0x1b: // PAL reserved - HW_LD
-    function = (ins >> 12) & 0xf;
-    if (function & 1) {
-      OP(HW_LDQ, HW_LD);
-    } else {
-      OP(HW_LDL, HW_LD);
-    }
-
-  case 0x1c: // FPTI* instructions
-    function = (ins >> 5) & 0x7f;
-    switch (function) {
-    case 0x00:
-      OP(SEXTB, R2_R3);
-    case 0x01:
-      OP(SEXTW, R2_R3);
-    case 0x30:
-      OP(CTPOP, R2_R3);
-    case 0x31:
-      OP(PERR, R2_R3);
-    case 0x32:
-      OP(CTLZ, R2_R3);
-    case 0x33:
-      OP(CTTZ, R2_R3);
-    case 0x34:
-      OP(UNPKBW, R2_R3);
-    case 0x35:
-      OP(UNPKBL, R2_R3);
-    case 0x36:
-      OP(PKWB, R2_R3);
-    case 0x37:
-      OP(PKLB, R2_R3);
-    case 0x38:
-      OP(MINSB8, R12_R3);
-    case 0x39:
-      OP(MINSW4, R12_R3);
-    case 0x3a:
-      OP(MINUB8, R12_R3);
-    case 0x3b:
-      OP(MINUW4, R12_R3);
-    case 0x3c:
-      OP(MAXUB8, R12_R3);
-    case 0x3d:
-      OP(MAXUW4, R12_R3);
-    case 0x3e:
-      OP(MAXSB8, R12_R3);
-    case 0x3f:
-      OP(MAXSW4, R12_R3);
-    case 0x70:
-      OP(FTOIT, F1_R3);
-    case 0x78:
-      OP(FTOIS, F1_R3);
-    default:
-      UNKNOWN2;
-    }
-    break;
-
-  case 0x1d: // HW_MTPR
-    function = (ins >> 8) & 0xff;
-    OP(HW_MTPR, MTPR);
-
-  case 0x1e:
-    OP(HW_RET, RET);
-
-  case 0x1f: // HW_ST
-    function = (ins >> 12) & 0xf;
-    if (function & 1) {
-      OP(HW_STQ, HW_ST);
-    } else {
-      OP(HW_STL, HW_ST);
-    }
-
-  case 0x20:
-    OP(LDF, FMEM);
-
-  case 0x21:
-    OP(LDG, FMEM);
-
-  case 0x22:
-    OP(LDS, FMEM);
-
-  case 0x23:
-    OP(LDT, FMEM);
+#include "cpu_decode.hpp"
 
-  case 0x24:
-    OP(STF, FMEM);
-
-  case 0x25:
-    OP(STG, FMEM);
-
-  case 0x26:
-    OP(STS, FMEM);
-
-  case 0x27:
-    OP(STT, FMEM);
-
-  case 0x28:
-    OP(LDL, MEM);
-
-  case 0x29:
-    OP(LDQ, MEM);
-
-  case 0x2a:
-    OP(LDL_L, MEM);
-
-  case 0x2b:
-    OP(LDQ_L, MEM);
-
-  case 0x2c:
-    OP(STL, MEM);
-
-  case 0x2d:
-    OP(STQ, MEM);
-
-  case 0x2e:
-    OP(STL_C, MEM);
-
-  case 0x2f:
-    OP(STQ_C, MEM);
+  return;
+}
 
-  case 0x30:
-    OP(BR, BR);
+template void CAlphaCPU::execute_ins<false>();
+template void CAlphaCPU::execute_ins<true>();
 
-  case 0x31:
-    OP(FBEQ, FCOND);
+#if !defined(IDB)
 
-  case 0x32:
-    OP(FBLT, FCOND);
+/**
+ * Check whether a block cache entry holds the block that starts at the
+ * current program counter, and whether it is still valid.
+ **/
+inline bool CAlphaCPU::bcache_hit(const SBlock *b) {
+  return b->valid && b->pc == state.pc && b->sde == state.sde &&
+         b->gen == icache_gen[b->line] && state.icache[b->line].valid &&
+         (state.icache[b->line].asn == state.asn ||
+          state.icache[b->line].asm_bit);
+}
 
-  case 0x33:
-    OP(FBLE, FCOND);
+/**
+ * \brief Execute a block of instructions from the block cache.
+ *
+ * Looks up the decoded block that starts at the current program counter,
+ * decoding it from the instruction cache if needed, and runs its handlers
+ * one after another. Everything execute() does for a single instruction is
+ * still done for each instruction in the block, so the result is exactly the
+ * same as executing the instructions one at a time; only the fetching and
+ * decoding is saved. The block is left early when an instruction changes the
+ * program counter (taken branch, exception) or an interrupt is taken.
+ *
+ * With the JIT enabled, a block that has been executed JIT_THRESHOLD times is
+ * translated to host code by jit_compile(), and the translation is run
+ * instead of the handlers whenever that gives the same result.
+ *
+ * MemtestHack tells whether skip_memtest_hack is set.
+ **/
+template <bool MemtestHack> void CAlphaCPU::execute_block() {
+  SBlock *b;
+  const SBlockIns *bi;
+  const SBlockIns *end;
+  u64 pc;
 
-  case 0x34:
-    OP(BSR, BSR);
+  b = &bcache[(state.pc >> 2) & (BCACHE_ENTRIES - 1)];
 
-  case 0x35:
-    OP(FBNE, FCOND);
+  // A block copy or fill loop runs as many iterations as it can at once; the
+  // one after those is interpreted.
+  if (b->loop && !MemtestHack && bcache_hit(b) && memloop_run(b))
+    return;
 
-  case 0x36:
-    OP(FBGE, FCOND);
+#if defined(HAVE_JIT)
+  // Translated code only counts its instructions, so it can only be used
+  // when clock_tick() wouldn't call clock_event() for any of them.
+  if (b->jit && !MemtestHack &&
+      state.instruction_count + b->jit_count <
+          next_event.load(std::memory_order_relaxed) &&
+      bcache_hit(b)) {
+    bi = b->ins + jit_run(b);
+    end = b->ins + b->count;
+    if (bi == end || state.pc != b->pc + 4 * (bi - b->ins))
+      return;
 
-  case 0x37:
-    OP(FBGT, FCOND);
+    // Interpret the rest of the block.
+    state.current_pc = state.pc;
+    if (clock_tick())
+      return;
+  } else
+#endif
+  {
+    state.current_pc = state.pc;
 
-  case 0x38:
-    OP(BLBC, COND);
+    if (MemtestHack)
+      skip_memtest();
 
-  case 0x39:
-    OP(BEQ, COND);
+    if (clock_tick())
+      return;
 
-  case 0x3a:
-    OP(BLT, COND);
+    if (!bcache_hit(b) && bcache_fill(b))
+      return;
 
-  case 0x3b:
-    OP(BLE, COND);
+    state.last_found_icache = b->line;
+    icache_ref[b->line] = true;
+    bi = b->ins;
+    end = bi + b->count;
 
-  case 0x3c:
-    OP(BLBS, COND);
+#if defined(HAVE_JIT)
+    if (jit_enabled && b->hits < JIT_THRESHOLD &&
+        ++b->hits == JIT_THRESHOLD)
+      jit_compile(b);
+#endif
+  }
 
-  case 0x3d:
-    OP(BNE, COND);
+  for (;;) {
+    next_pc();
+    state.r[31] = 0;
+    state.f[31] = 0;
+    pc = state.pc;
+    (this->*bi->handler)(bi);
+    if (++bi == end || state.pc != pc)
+      return;
 
-  case 0x3e:
-    OP(BGE, COND);
+    state.current_pc = state.pc;
 
-  case 0x3f:
-    OP(BGT, COND);
+    if (MemtestHack)
+      skip_memtest();
 
-  default:
-    UNKNOWN1;
+    if (clock_tick())
+      return;
   }
-
-  return;
 }
 
+template void CAlphaCPU::execute_block<false>();
+template void CAlphaCPU::execute_block<true>();
+#endif
+
 #if defined(IDB)
 
 /**
@@ -1237,6 +1252,8 @@ static u32 cpu_magic2 = 0xC8646212;
 int CAlphaCPU::SaveState(FILE *f) {
   long ss = sizeof(state);
 
+  sync_clock();
+
   fwrite(&cpu_magic1, sizeof(u32), 1, f);
   fwrite(&ss, sizeof(long), 1, f);
   fwrite(&state, sizeof(state), 1, f);
@@ -1293,6 +1310,30 @@ int CAlphaCPU::RestoreState(FILE *f) {
     return -1;
   }
 
+  // The instruction cache and translation buffers were replaced; rebuild
+  // their hash tables, and throw away blocks decoded from the icache.
+  rehash_icache();
+  rehash_tb(0);
+  rehash_tb(1);
+  stlb_flush();
+  clock_synced = state.instruction_count;
+  next_event.store(0, std::memory_order_relaxed);
+
+  // Post the restored interrupt lines as if irq_h() had asserted them.
+  irq_seen = (u32)state.eir & 0x3f;
+  for (int i = 0; i < 6; i++) {
+    if (state.irq_h_timer[i]) {
+      irq_seen |= 0x101U << i;
+      irq_delay[i].store(state.irq_h_timer[i], std::memory_order_relaxed);
+      irq_deadline[i] = state.instruction_count + state.irq_h_timer[i];
+    }
+  }
+  irq_mail.store(irq_seen);
+  osfpal_active = false;
+  osfpal_pending = -1;
+  if (bcache_enabled)
+    bcache_flush();
+
   printf("%s: %d bytes restored.\n", devid_string, (int)ss);
   return 0;
 }
@@ -1312,6 +1353,10 @@ int CAlphaCPU::RestoreState(FILE *f) {
  * Try to find a translation-buffer entry that maps the page inside which
  * the specified virtual address lies.
  *
+ * Entries are kept on hash chains by the part of the virtual address their
+ * granularity hint makes them match on, so only one chain has to be
+ * searched for each granularity hint that is in use.
+ *
  * \param virt    Virtual address to find in translation buffer.
  * \param flags   ACCESS_EXEC determines which translation buffer to use.
  * \return        Number of matching entry, or -1 if no match found.
@@ -1323,24 +1368,34 @@ int CAlphaCPU::FindTBEntry(u64 virt, int flags) {
   int asn = (flags & ACCESS_EXEC) ? state.asn : state.asn0;
 
   int rw = (flags & ACCESS_WRITE) ? 1 : 0;
+  int gh;
+
+// An entry matches if it maps virt, and either has the ASM bit set or
+// belongs to the current address space and wasn't invalidated by tbiap.
+#define TB_MATCH(i)                                                            \
+  (state.tb[t][i].valid &&                                                     \
+   !((state.tb[t][i].virt ^ virt) & state.tb[t][i].match_mask) &&              \
+   (state.tb[t][i].asm_bit ||                                                  \
+    (state.tb[t][i].asn == asn && state.tb[t][i].gen == state.tb_gen[t])))
 
   // Try last match first; this is a good quess, especially in the ITB
   int i = state.last_found_tb[t][rw];
-  if (state.tb[t][i].valid &&
-      !((state.tb[t][i].virt ^ virt) & state.tb[t][i].match_mask) &&
-      (state.tb[t][i].asm_bit || (state.tb[t][i].asn == asn)))
+  if (TB_MATCH(i))
     return i;
 
-  // Otherwise, loop through the TB entries to find a match.
-  for (i = 0; i < TB_ENTRIES; i++) {
-    if (state.tb[t][i].valid &&
-        !((state.tb[t][i].virt ^ virt) & state.tb[t][i].match_mask) &&
-        (state.tb[t][i].asm_bit || (state.tb[t][i].asn == asn))) {
-      state.last_found_tb[t][rw] = i;
-      return i;
+  // Otherwise, search the hash chains, smallest pages first.
+  for (gh = 0; gh < 4; gh++) {
+    if (!tb_gh_count[t][gh])
+      continue;
+    for (i = tb_hash[t][tb_bucket(virt, gh)]; i >= 0; i = tb_chain[t][i]) {
+      if (TB_MATCH(i)) {
+        state.last_found_tb[t][rw] = i;
+        return i;
+      }
     }
   }
 
+#undef TB_MATCH
   return -1;
 }
 
@@ -1484,6 +1539,11 @@ int CAlphaCPU::virt2phys(u64 virt, u64 *phys, int flags, bool *asm_bit,
     if (!state.pal_vms) // unknown PALcode
     {
 
+      // try to load the TB entry from the page table ourselves, and only
+      // run the PALcode miss handler if that doesn't work out.
+      if (tb_fill_enabled && !(flags & (VPTE | RECUR)) && tb_fill(virt, flags))
+        return virt2phys(virt, phys, flags | RECUR, asm_bit, ins);
+
       // transfer execution to PALcode
       state.exc_addr = state.current_pc;
       if (flags & VPTE) {
@@ -1696,6 +1756,7 @@ void CAlphaCPU::add_tb(u64 virt, u64 pte_phys, u64 pte_flags, int flags) {
   u64 keep_mask = 0;
   u64 phys_mask = 0;
   int i;
+  int h;
   int asn = (flags & ACCESS_EXEC) ? state.asn : state.asn0;
 
   switch (pte_flags & 0x60) // granularity hint
@@ -1734,9 +1795,21 @@ void CAlphaCPU::add_tb(u64 virt, u64 pte_phys, u64 pte_flags, int flags) {
       state.next_tb[t] = 0;
   }
 
+  // Take the entry off its hash chain.
+  if (tb_chain[t][i] != -2) {
+    int *link =
+        &tb_hash[t][tb_bucket(state.tb[t][i].virt, state.tb[t][i].gh)];
+    while (*link != i)
+      link = &tb_chain[t][*link];
+    *link = tb_chain[t][i];
+    tb_gh_count[t][state.tb[t][i].gh]--;
+  }
+
   state.tb[t][i].match_mask = match_mask;
   state.tb[t][i].keep_mask = keep_mask;
   state.tb[t][i].virt = virt & match_mask;
+  state.tb[t][i].gh = (int)(pte_flags >> 5) & 3;
+  state.tb[t][i].gen = state.tb_gen[t];
   state.tb[t][i].phys = pte_phys & phys_mask;
   state.tb[t][i].fault[0] = (int)pte_flags & 2;
   state.tb[t][i].fault[1] = (int)pte_flags & 4;
@@ -1754,6 +1827,13 @@ void CAlphaCPU::add_tb(u64 virt, u64 pte_phys, u64 pte_flags, int flags) {
   state.tb[t][i].valid = true;
   state.last_found_tb[t][rw] = i;
 
+  h = tb_bucket(state.tb[t][i].virt, state.tb[t][i].gh);
+  tb_chain[t][i] = tb_hash[t][h];
+  tb_hash[t][h] = i;
+  tb_gh_count[t][state.tb[t][i].gh]++;
+  if (!t)
+    stlb_flush();
+
 #if defined(DEBUG_TB_)
 #if defined(IDB)
   if (bTB_Debug)
@@ -1809,6 +1889,133 @@ void CAlphaCPU::add_tb_d(u64 virt, u64 pte) {
   add_tb(virt, pte >> (32 - 13), pte, ACCESS_READ);
 }
 
+/**
+ * \brief Check a PALcode TB miss handler.
+ *
+ * tb_fill() can only do the work of miss handlers that take the PTE from the
+ * virtual page table, like those of the OSF/1 PALcode do: one of the first
+ * few instructions of the handler reads VA_FORM (IVA_FORM for ITB misses)
+ * with HW_MFPR, and a later one loads the PTE from that address with a VPTE
+ * HW_LD.
+ *
+ * \param offset  Offset of the handler from the PAL base.
+ * \param ipr     HW_MFPR index of the VA_FORM register the handler uses.
+ * \return        true if the handler is recognized.
+ **/
+bool CAlphaCPU::tb_fill_pal_check(u64 offset, int ipr) {
+  int form = -1;
+
+  for (int n = 0; n < 8; n++) {
+    u64 a = state.pal_base + offset + 4 * n;
+    if (a >> cSystem->get_memory_bits())
+      return false;
+
+    u32 ins = (u32)cSystem->ReadMem(a, 32, this);
+    int opcode = ins >> 26;
+    int ra = (ins >> 21) & 31;
+    int rb = (ins >> 16) & 31;
+
+    if (opcode == 0x19 && ((ins >> 8) & 0xff) == (u32)ipr)
+      form = ra;
+    else if (opcode == 0x1b && ((ins >> 13) & 7) == 2 && rb == form)
+      return true;
+    else if (opcode >= 0x30 || opcode == 0x1a || opcode == 0x1e)
+      return false;
+    else if (ra == form || (int)(ins & 31) == form)
+      form = -1; // may have been overwritten
+  }
+  return false;
+}
+
+/**
+ * \brief Load a translation-buffer entry from the page table.
+ *
+ * Does what the PALcode TB miss handlers do, without running them: the
+ * PTE for \a virt is read from the virtual page table set up in VA_CTL
+ * (I_CTL for ITB misses). If the page table page is not in the DTB
+ * either, the self-mapped page table is used to go up one or two more
+ * levels, and the page table pages found on the way back down are added
+ * to the DTB, like the double miss handler would do.
+ *
+ * Only used when native_tb_fill is set in the configuration file, and only
+ * for PALcode whose miss handlers tb_fill_pal_check() recognizes. Which
+ * PALcode that is is determined again when the PAL base changes or the DTB
+ * is flushed, as on a PALcode switch.
+ *
+ * Every level is checked before it is used: the DTB entry the walk starts
+ * from and each page table page must be in main memory, and every PTE on
+ * the way must be valid. Page table pages must be mapped by plain 8K PTEs
+ * without fault-on-read. Anything else is left to the PALcode.
+ *
+ * \param virt    Virtual address that missed in the TB.
+ * \param flags   ACCESS_EXEC determines which translation buffer to fill.
+ * \return        true if the TB entry was added; false if the PALcode
+ *                should handle the miss (unrecognized PALcode, no page table
+ *                set up, a PTE on the way that fails the checks, or
+ *                fault-on-execute set).
+ **/
+bool CAlphaCPU::tb_fill(u64 virt, int flags) {
+  bool ibox = (flags & ACCESS_EXEC) ? true : false;
+  u64 va[4];
+  u64 pte;
+  u64 pte_phys;
+  int level;
+  int i = -1;
+
+  if (!(ibox ? state.i_ctl_vptb : state.va_ctl_vptb))
+    return false;
+
+  if (tb_fill_pal != state.pal_base) {
+    tb_fill_pal = state.pal_base;
+    tb_fill_pal_ok = tb_fill_pal_check(DTBM_SINGLE, 0xc3) &&
+                     tb_fill_pal_check(ITB_MISS, 0x07);
+  }
+  if (!tb_fill_pal_ok)
+    return false;
+
+  // find the lowest level of the page table that is mapped in the DTB.
+  va[0] = virt;
+  for (level = 1; level <= 3; level++) {
+    va[level] = va_form(va[level - 1], ibox && level == 1) & ~U64(0x7);
+    i = FindTBEntry(va[level], ACCESS_READ);
+    if (i >= 0)
+      break;
+  }
+
+  if (i < 0)
+    return false;
+
+  // walk back down, mapping the page table pages on the way.
+  for (;;) {
+    pte_phys = state.tb[0][i].phys | (va[level] & state.tb[0][i].keep_mask);
+    if (pte_phys >> cSystem->get_memory_bits())
+      return false;
+    pte = cSystem->ReadMem(pte_phys, 64, this);
+    if (!(pte & 1))
+      return false;
+
+    if (--level == 0)
+      break;
+
+    // a page table page: 8K, readable, in main memory
+    if ((pte & 0x62) || ((pte >> 32) << 13) >> cSystem->get_memory_bits())
+      return false;
+    add_tb_d(va[level], pte);
+    i = FindTBEntry(va[level], ACCESS_READ);
+    if (i < 0)
+      return false;
+  }
+
+  if (ibox) {
+    if (pte & 8) // fault on execute
+      return false;
+    add_tb_i(virt, ((pte >> (32 - 13)) & ~U64(0x1fff)) | (pte & 0xf70));
+  } else
+    add_tb_d(virt, pte);
+
+  return true;
+}
+
 /**
  * \brief Add translation-buffer entry to the ITB
  *
@@ -1848,6 +2055,11 @@ void CAlphaCPU::tbia(int flags) {
   state.last_found_tb[t][0] = 0;
   state.last_found_tb[t][1] = 0;
   state.next_tb[t] = 0;
+  rehash_tb(t);
+  if (!t) {
+    stlb_flush();
+    tb_fill_pal = 1;
+  }
 }
 
 /**
@@ -1856,14 +2068,22 @@ void CAlphaCPU::tbia(int flags) {
  * Invalidate all translation-buffer entries that do not have the ASM bit
  * set in one of the translation buffers.
  *
+ * This is done by moving on to a new generation; FindTBEntry doesn't match
+ * entries without the ASM bit from older generations. Only when the
+ * generation counter wraps around are the entries really invalidated.
+ *
  * \param flags   ACCESS_EXEC determines which translation buffer to use.
  **/
 void CAlphaCPU::tbiap(int flags) {
   int t = (flags & ACCESS_EXEC) ? 1 : 0;
   int i;
-  for (i = 0; i < TB_ENTRIES; i++)
-    if (!state.tb[t][i].asm_bit)
-      state.tb[t][i].valid = false;
+  if (++state.tb_gen[t] == 0) {
+    for (i = 0; i < TB_ENTRIES; i++)
+      if (!state.tb[t][i].asm_bit)
+        state.tb[t][i].valid = false;
+  }
+  if (!t)
+    stlb_flush();
 }
 
 /**
@@ -1877,16 +2097,236 @@ void CAlphaCPU::tbis(u64 virt, int flags) {
   int i = FindTBEntry(virt, flags);
   if (i >= 0)
     state.tb[t][i].valid = false;
+  if (!t)
+    stlb_flush();
+}
+
+/**
+ * \brief Rebuild a translation buffer's hash table.
+ *
+ * Puts every valid entry on the hash chain for its address and granularity
+ * hint. Entries that are on no chain have tb_chain set to -2.
+ *
+ * \param t       Translation buffer (0 = DTB, 1 = ITB).
+ **/
+void CAlphaCPU::rehash_tb(int t) {
+  int i;
+  int h;
+
+  for (h = 0; h < TB_HASH_SIZE; h++)
+    tb_hash[t][h] = -1;
+  for (h = 0; h < 4; h++)
+    tb_gh_count[t][h] = 0;
+
+  for (i = 0; i < TB_ENTRIES; i++) {
+    tb_chain[t][i] = -2;
+    if (state.tb[t][i].valid) {
+      h = tb_bucket(state.tb[t][i].virt, state.tb[t][i].gh);
+      tb_chain[t][i] = tb_hash[t][h];
+      tb_hash[t][h] = i;
+      tb_gh_count[t][state.tb[t][i].gh]++;
+    }
+  }
+}
+
+/**
+ * \brief Add a soft TLB entry
+ *
+ * Called after virt2phys() has translated a data address successfully. If
+ * the physical address is in main memory, the page is entered in the soft
+ * TLB, so that following accesses to it can go straight to host memory.
+ *
+ * \param virt    Virtual address.
+ * \param phys    Physical address virt2phys() translated it to.
+ * \param flags   ACCESS_READ or ACCESS_WRITE.
+ **/
+void CAlphaCPU::stlb_fill(u64 virt, u64 phys, int flags) {
+  SSoftTLB *e = &stlb[flags][(virt >> 13) & (STLB_ENTRIES - 1)];
+  u64 a = phys & U64(0x00000807ffffe000);
+
+  if (a >> cSystem->get_memory_bits())
+    return;
+
+  e->tag = (virt & ~U64(0x1fff)) | stlb_ctx;
+  e->addend = (u64)(size_t)cSystem->PtrToMem(a) - (virt & ~U64(0x1fff));
 }
 
 //\}
 
+/**
+ * \brief Count an unaligned access that was split up by DATA_PHYS, after
+ * all of its bytes have been transferred.
+ **/
+void CAlphaCPU::unalign_fixup() {
+  std::lock_guard<std::mutex> lock(unalign_mutex);
+  unalign_pcs[state.current_pc]++;
+}
+
+/**
+ * \brief Print the unaligned accesses split up so far, by PC.
+ *
+ * Lists the instructions that did the most unaligned accesses across a page
+ * boundary first. Called on SIGUSR2 and when the CPU is destroyed.
+ **/
+void CAlphaCPU::dump_unalign() {
+  std::vector<std::pair<u64, u64>> pcs;
+  u64 total = 0;
+
+  {
+    std::lock_guard<std::mutex> lock(unalign_mutex);
+    for (auto &i : unalign_pcs) {
+      pcs.push_back(std::make_pair(i.second, i.first));
+      total += i.second;
+    }
+  }
+  if (!total)
+    return;
+
+  std::sort(pcs.begin(), pcs.end(),
+            [](const std::pair<u64, u64> &a, const std::pair<u64, u64> &b) {
+              return a.first > b.first;
+            });
+  printf("%s: %" PRIu64 " unaligned accesses fixed up, at %zu PCs:\n",
+         devid_string, total, pcs.size());
+  for (size_t i = 0; i < pcs.size() && i < 32; i++)
+    printf("  %016" PRIx64 " %12" PRIu64 "\n", pcs[i].second, pcs[i].first);
+}
+
+/**
+ * \brief Rebuild the instruction cache hash table.
+ *
+ * Puts every valid icache entry on the hash chain for its address. Entries
+ * that are on no chain at all have icache_chain set to -2.
+ **/
+void CAlphaCPU::rehash_icache() {
+  int i;
+  int h;
+
+  for (h = 0; h < ICACHE_HASH_SIZE; h++)
+    icache_hash[h] = -1;
+
+  for (i = 0; i < ICACHE_ENTRIES; i++) {
+    icache_ref[i] = false;
+    icache_chain[i] = -2;
+    if (state.icache[i].valid) {
+      h = icache_bucket(state.icache[i].address);
+      icache_chain[i] = icache_hash[h];
+      icache_hash[h] = i;
+      cSystem->code_fetched(state.iProcNum, state.icache[i].p_address);
+    }
+  }
+}
+
+/**
+ * \brief Handle a store to main memory that we may have in the icache.
+ *
+ * Called by CSystem::code_stored(). A store by this CPU itself drops the
+ * affected icache lines right away, so that the next instruction fetched
+ * from them sees the store. Stores by other CPUs and devices come from other
+ * threads; those lines are queued, and dropped by clock_event() before the
+ * next instruction.
+ *
+ * \param address Physical address that was stored to.
+ * \param own     True if the store was done by this CPU.
+ **/
+void CAlphaCPU::icache_stored(u64 address, bool own) {
+  u64 p_address = address & ~(u64)(ICACHE_LINE_SIZE * 4 - 1);
+
+  if (own) {
+    icache_drop(p_address);
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(icache_stale_mutex);
+  if (icache_stale_count < ICACHE_STALE_MAX)
+    icache_stale_line[icache_stale_count] = p_address;
+  icache_stale_count++;
+  icache_stale = true;
+  next_event.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * \brief Drop all icache entries filled from a line of main memory.
+ *
+ * Blocks decoded from those entries are no longer used either, as
+ * bcache_hit() requires the entry to be valid.
+ **/
+void CAlphaCPU::icache_drop(u64 p_address) {
+  for (int i = 0; i < ICACHE_ENTRIES; i++) {
+    if (state.icache[i].valid && state.icache[i].p_address == p_address) {
+      state.icache[i].valid = false;
+      icache_snoops++;
+    }
+  }
+  cSystem->code_dropped(state.iProcNum, p_address);
+}
+
+/**
+ * \brief Note that an icache entry filled from a line of main memory was
+ * replaced.
+ *
+ * Tells CSystem that stores to the line no longer concern us, unless
+ * another entry was filled from it too.
+ **/
+void CAlphaCPU::icache_release(u64 p_address) {
+  for (int i = 0; i < ICACHE_ENTRIES; i++)
+    if (state.icache[i].valid && state.icache[i].p_address == p_address)
+      return;
+  cSystem->code_dropped(state.iProcNum, p_address);
+}
+
+/**
+ * \brief Invalidate the icache, and tell CSystem which lines we dropped.
+ *
+ * \param keep_asm Keep the entries with the ASM bit set, and the lines
+ *                 they were filled from.
+ **/
+void CAlphaCPU::icache_invalidate(bool keep_asm) {
+  std::vector<u64> kept;
+  std::vector<u64> dropped;
+
+  for (int i = 0; i < ICACHE_ENTRIES; i++) {
+    if (!state.icache[i].valid)
+      continue;
+    if (keep_asm && state.icache[i].asm_bit) {
+      kept.push_back(state.icache[i].p_address);
+    } else {
+      state.icache[i].valid = false;
+      dropped.push_back(state.icache[i].p_address);
+    }
+  }
+
+  std::sort(kept.begin(), kept.end());
+  for (u64 p_address : dropped)
+    if (!std::binary_search(kept.begin(), kept.end(), p_address))
+      cSystem->code_dropped(state.iProcNum, p_address);
+}
+
+/**
+ * \brief Drop the icache lines other threads stored to.
+ **/
+void CAlphaCPU::icache_sync() {
+  std::lock_guard<std::mutex> lock(icache_stale_mutex);
+
+  if (icache_stale_count > ICACHE_STALE_MAX) {
+    flush_icache();
+  } else {
+    for (int i = 0; i < icache_stale_count; i++)
+      icache_drop(icache_stale_line[i]);
+  }
+  icache_stale_count = 0;
+  icache_stale = false;
+}
+
 /**
  * \brief Enable i-cache regardles of config file.
  *
  * Required for SRM-ROM decompression.
  **/
-void CAlphaCPU::enable_icache() { icache_enabled = true; }
+void CAlphaCPU::enable_icache() {
+  icache_enabled = true;
+  select_execute();
+}
 
 /**
  * \brief Enable or disable i-cache depending on config file.
@@ -1894,12 +2334,13 @@ void CAlphaCPU::enable_icache() { icache_enabled = true; }
 void CAlphaCPU::restore_icache() {
   bool newval;
 
-  newval = myCfg->get_bool_value("icache", false);
+  newval = myCfg->get_bool_value("icache", true);
 
   if (!newval)
     flush_icache();
 
   icache_enabled = newval;
+  select_execute();
 }
 
 #if defined(IDB)
@@ -33,6 +33,12 @@
 #include "SystemComponent.hpp"
 #include "cpu_defs.hpp"
 
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
 /// Number of entries in the Instruction Cache
 #define ICACHE_ENTRIES 1024
 // Size of Instruction Cache entries in DWORDS (instructions)
@@ -44,8 +50,81 @@
 #define ICACHE_INDEX_MASK (u64)(ICACHE_LINE_SIZE - U64(0x1))
 /// Byte numer of an address in an ICache entry.
 #define ICACHE_BYTE_MASK (u64)(ICACHE_INDEX_MASK << 2)
+/// Number of buckets in the Instruction Cache hash table
+#define ICACHE_HASH_SIZE 2048
+/// Number of lines other threads can queue for invalidation before the whole
+/// Instruction Cache is flushed instead
+#define ICACHE_STALE_MAX 16
 /// Number of entries in each Translation Buffer
-#define TB_ENTRIES 16
+#define TB_ENTRIES 128
+/// Number of buckets in each Translation Buffer hash table
+#define TB_HASH_SIZE 256
+/// Number of entries in each soft TLB
+#define STLB_ENTRIES 256
+/// Number of blocks in the decoded block cache
+#define BCACHE_ENTRIES 4096
+/// Maximum number of instructions between two runs of clock_event()
+#define CLOCK_EVENT_MAX 1024
+/// Maximum number of instructions in a decoded block
+#define BCACHE_BLOCK_SIZE 16
+/// Maximum number of instructions in one iteration of a guest idle loop
+#define IDLE_LOOP_MAX 32
+/// Number of unchanged idle loop iterations before the CPU thread sleeps
+#define IDLE_ITERATIONS 64
+/// Maximum number of memory locations an idle loop may read
+#define IDLE_WATCH_MAX 4
+/// Maximum time the CPU thread sleeps at once, in microseconds
+#define IDLE_SLEEP_MAX 10000
+/// Number of OSF/1 PALcode calls that can be run natively
+#define OSFPAL_CALLS 4
+/// Times a call must give the same result natively and in the PALcode
+/// before the native version is used
+#define OSFPAL_CHECK_CALLS 16
+/// Minimum time worth sleeping for, in microseconds
+#define IDLE_SLEEP_MIN 50
+/// Number of calls to execute() a CPU gets before the next CPU sharing its
+/// host thread runs
+#define CPU_QUANTUM 10000
+/// Number of times a block is executed before it is translated to host code
+#define JIT_THRESHOLD 32
+/// Size of the buffer that holds translated host code
+#define JIT_BUFFER_SIZE (16 * 1024 * 1024)
+
+/** The translator emits x86-64 machine code, so it is only available when
+    running on an x86-64 host. */
+#if !defined(IDB) && (defined(__x86_64__) || defined(_M_X64))
+#define HAVE_JIT
+#endif
+
+/** The mnemonics the instruction decoder (cpu_decode.hpp) dispatches to,
+    except HW_MTPR. Used to declare and define the do_<mnemonic> handlers
+    of the block cache. */
+#define CPU_MNEMONICS(X)                                                       \
+  X(CALL_PAL) X(LDA) X(LDAH) X(LDBU) X(LDQ_U) X(LDWU) X(STW) X(STB) X(STQ_U)   \
+  X(ADDL_V) X(ADDL) X(S4ADDL) X(SUBL_V) X(SUBL) X(S4SUBL) X(CMPBGE) X(S8ADDL)  \
+  X(S8SUBL) X(CMPULT) X(ADDQ_V) X(ADDQ) X(S4ADDQ) X(SUBQ_V) X(SUBQ) X(S4SUBQ)  \
+  X(CMPEQ) X(S8ADDQ) X(S8SUBQ) X(CMPULE) X(CMPLT) X(CMPLE) X(AND) X(BIC)       \
+  X(CMOVLBS) X(CMOVLBC) X(BIS) X(CMOVEQ) X(CMOVNE) X(ORNOT) X(XOR) X(CMOVLT)   \
+  X(CMOVGE) X(EQV) X(AMASK) X(CMOVLE) X(CMOVGT) X(IMPLVER) X(MSKBL) X(EXTBL)   \
+  X(INSBL) X(MSKWL) X(EXTWL) X(INSWL) X(MSKLL) X(EXTLL) X(INSLL) X(ZAP)        \
+  X(ZAPNOT) X(MSKQL) X(SRL) X(EXTQL) X(SLL) X(INSQL) X(SRA) X(MSKWH) X(INSWH)  \
+  X(EXTWH) X(MSKLH) X(INSLH) X(EXTLH) X(MSKQH) X(INSQH) X(EXTQH) X(MULL_V)     \
+  X(MULL) X(MULQ_V) X(MULQ) X(UMULH) X(ITOFS) X(SQRTF) X(SQRTS) X(ITOFF)       \
+  X(ITOFT) X(SQRTG) X(SQRTT) X(CMPGEQ) X(CMPGLT) X(CMPGLE) X(CVTQF) X(CVTQG)   \
+  X(ADDF) X(SUBF) X(MULF) X(DIVF) X(CVTDG) X(ADDG) X(SUBG) X(MULG) X(DIVG)     \
+  X(CVTGF) X(CVTGD) X(CVTGQ) X(CMPTUN) X(CMPTEQ) X(CMPTLT) X(CMPTLE) X(CVTST)  \
+  X(ADDS) X(SUBS) X(MULS) X(DIVS) X(ADDT) X(SUBT) X(MULT) X(DIVT) X(CVTTS)     \
+  X(CVTTQ) X(CVTQS) X(CVTQT) X(CVTLQ) X(CPYS) X(CPYSN) X(CPYSE) X(MT_FPCR)     \
+  X(MF_FPCR) X(FCMOVEQ) X(FCMOVNE) X(FCMOVLT) X(FCMOVGE) X(FCMOVLE) X(FCMOVGT) \
+  X(CVTQL) X(TRAPB) X(EXCB) X(MB) X(WMB) X(FETCH) X(FETCH_M) X(RPCC) X(RC)     \
+  X(ECB) X(RS) X(WH64) X(WH64EN) X(HW_MFPR) X(JMP) X(HW_LDQ) X(HW_LDL)         \
+  X(SEXTB) X(SEXTW) X(CTPOP) X(PERR) X(CTLZ) X(CTTZ) X(UNPKBW) X(UNPKBL)       \
+  X(PKWB) X(PKLB) X(MINSB8) X(MINSW4) X(MINUB8) X(MINUW4) X(MAXUB8) X(MAXUW4)  \
+  X(MAXSB8) X(MAXSW4) X(FTOIT) X(FTOIS) X(HW_RET) X(HW_STQ) X(HW_STL) X(LDF)   \
+  X(LDG) X(LDS) X(LDT) X(STF) X(STG) X(STS) X(STT) X(LDL) X(LDQ) X(LDL_L)      \
+  X(LDQ_L) X(STL) X(STQ) X(STL_C) X(STQ_C) X(BR) X(FBEQ) X(FBLT) X(FBLE)       \
+  X(BSR) X(FBNE) X(FBGE) X(FBGT) X(BLBC) X(BEQ) X(BLT) X(BLE) X(BLBS) X(BNE)   \
+  X(BGE) X(BGT)
 
 /**
  * \brief Emulated CPU.
@@ -69,10 +148,14 @@ public:
   void irq_h(int number, bool assert, int delay);
   int get_cpuid();
   void flush_icache();
+  void icache_stored(u64 address, bool own);
+  void idle_stored(u64 address, size_t len);
 
   void run();
+  void run_shared();
   void execute();
   void release_threads();
+  void set_thread(CAlphaCPU *leader);
 
   void set_PAL_BASE(u64 pb);
   virtual void check_state();
@@ -105,6 +188,9 @@ public:
   void add_pc(u64 a_pc);
 
   u64 get_speed() { return cpu_hz; };
+  u64 get_icache_hits() { return icache_hits; };
+  void dump_unalign();
+  u64 get_icache_misses() { return icache_misses; };
 
   u64 va_form(u64 address, bool bIBOX);
 
@@ -124,14 +210,39 @@ private:
   CSemaphore mySemaphore;
   bool StopThread;
 
+  /**
+   * With cpu_threads set, several CPUs share a host thread, owned by the
+   * first of them (thread_leader), which runs them round-robin in
+   * run_shared(). Otherwise each CPU is its own thread_leader.
+   **/
+  CAlphaCPU *thread_leader;
+  std::vector<CAlphaCPU *> thread_cpus; /**< CPUs run by this thread */
+  bool thread_shared; /**< The host thread is shared with other CPUs */
+  bool thread_started; /**< Ran since wait_for_start was cleared */
+  void thread_wait();
+
   int get_icache(u64 address, u32 *data);
+  int icache_bucket(u64 address);
+  void rehash_icache();
+  void icache_drop(u64 p_address);
+  void icache_release(u64 p_address);
+  void icache_invalidate(bool keep_asm);
+  void icache_sync();
+  void unalign_fixup();
   int FindTBEntry(u64 virt, int flags);
+  int tb_bucket(u64 virt, int gh);
+  void rehash_tb(int t);
   void add_tb(u64 virt, u64 pte_phys, u64 pte_flags, int flags);
   void add_tb_i(u64 virt, u64 pte);
   void add_tb_d(u64 virt, u64 pte);
+  bool tb_fill(u64 virt, int flags);
+  bool tb_fill_pal_check(u64 offset, int ipr);
   void tbia(int flags);
   void tbiap(int flags);
   void tbis(u64 virt, int flags);
+  u8 *stlb_host(u64 virt, int align, int flags);
+  void stlb_fill(u64 virt, u64 phys, int flags);
+  void stlb_flush();
 
   /* Floating Point routines */
   u64 ieee_lds(u32 op);
@@ -145,6 +256,7 @@ private:
   u64 ieee_fmul(u64 s1, u64 s2, u32 ins, u32 dp);
   u64 ieee_fdiv(u64 s1, u64 s2, u32 ins, u32 dp);
   u64 ieee_sqrt(u64 op, u32 ins, u32 dp);
+  bool ieee_host(u64 s1, u64 s2, u32 ins, u32 dp, int op, u64 *res);
   int ieee_unpack(u64 op, UFP *r, u32 ins);
   void ieee_norm(UFP *r);
   u64 ieee_rpack(UFP *r, u32 ins, u32 dp);
@@ -166,6 +278,7 @@ private:
   u64 vax_fmul(u64 s1, u64 s2, u32 ins, u32 dp);
   u64 vax_fdiv(u64 s1, u64 s2, u32 ins, u32 dp);
   u64 vax_sqrt(u64 op, u32 ins, u32 dp);
+  bool vax_host(u64 s1, u64 s2, u32 ins, u32 dp, int op, u64 *res);
 
   /* VMS PALcode call: */
   void vmspal_call_cflush();
@@ -233,9 +346,230 @@ private:
   int vmspal_int_initiate_exception();
   int vmspal_int_initiate_interrupt();
 
+  /* OSF/1 PALcode calls: */
+  void osfpal_swap(int function);
+  bool osfpal_call(int function);
+  void osfpal_returned();
+  void osfpal_recognize();
+  void osfpal_effect(int ipr, u64 value);
+
+  /**
+   * \brief Pre-decoded instruction.
+   *
+   * An instruction in the block cache, with its handler and its operands
+   * extracted from the instruction word in advance.
+   **/
+  struct SBlockIns {
+    void (CAlphaCPU::*handler)(const SBlockIns *bi); /**< do_<mnemonic> */
+    u64 disp;       /**< Sign-extended displacement, or literal operand */
+    const u64 *rbv; /**< Rb operand value (register, or literal in disp) */
+    u32 ins;        /**< Instruction word */
+    int function;   /**< Function code as determined by the decoder */
+    u8 ra;          /**< Ra register number (PALshadow translated) */
+    u8 rb;          /**< Rb register number (PALshadow translated) */
+    u8 rc;          /**< Rc register number (PALshadow translated) */
+  };
+
+  /**
+   * \brief Decoded block.
+   *
+   * A run of instructions from one instruction cache entry, up to and
+   * including the first instruction that may change the flow of control or
+   * the processor mode. The block stays valid for as long as the icache entry
+   * it was decoded from, so it follows the icache contents exactly.
+   **/
+  struct SBlock {
+    u64 pc;     /**< Address of first instruction (including PALmode bit) */
+    int line;   /**< Instruction cache entry the block was decoded from */
+    u32 gen;    /**< Fill count of that icache entry when decoded */
+    bool sde;   /**< PALshadow enable used to translate register numbers */
+    bool valid; /**< Valid block */
+    int count;  /**< Number of instructions */
+    int hits;   /**< Number of times the block was executed */
+    int (*jit)(CAlphaCPU *cpu, void *state); /**< Translated code, or NULL */
+    int jit_count; /**< Number of instructions covered by the translation */
+    bool loop; /**< Block copy or fill loop, described in memloops */
+    SBlockIns ins[BCACHE_BLOCK_SIZE]; /**< Decoded instructions */
+  };
+
+  /**
+   * \brief Block copy or fill loop.
+   *
+   * A decoded block that loops back to itself, and consists of nothing but
+   * LDQ, STQ, LDQ_U and STQ_U instructions, constant increments of the
+   * registers they use as base, BIS and the byte manipulation instructions
+   * that combine the quadwords moved, and a conditional branch on a register
+   * that is incremented by a constant as well. Any number of iterations of
+   * such a loop can be run at once by memloop_run().
+   **/
+  struct SMemLoop {
+    struct {
+      s64 offset; /**< Displacement plus increments of base before the access */
+      u8 base;    /**< Base register */
+      u8 data;    /**< Register loaded or stored */
+      bool store; /**< STQ rather than LDQ */
+      bool unaligned; /**< LDQ_U or STQ_U */
+    } mem[BCACHE_BLOCK_SIZE]; /**< Memory accesses, in program order */
+    int nmem;                 /**< Number of memory accesses */
+    u8 kind[BCACHE_BLOCK_SIZE]; /**< MEMLOOP_MEM, _OP or _INC, by instruction */
+    int nops;                   /**< Number of operate instructions */
+    s64 inc[32]; /**< Increment of each integer register per iteration */
+    u32 loaded;  /**< Registers loaded by the loop */
+    u8 cond;     /**< Register tested by the branch */
+    int opcode;  /**< Opcode of the branch */
+    int shape;   /**< MEMLOOP_FILL, MEMLOOP_COPY or MEMLOOP_OTHER */
+    u8 src;      /**< For a copy: base register of the loads */
+    u8 dst;      /**< For a fill or copy: base register of the stores */
+    s64 src_lo;  /**< Lowest offset from src that is loaded */
+    s64 dst_lo;  /**< Lowest offset from dst that is stored */
+  };
+
+  template <bool MemtestHack> void execute_ins();
+  template <bool MemtestHack> void execute_block();
+  void select_execute();
+  void idle_check();
+  bool idle_scan();
+  void idle_sleep(int nwatch);
+  bool idle_watch(int nwatch);
+  void idle_unwatch();
+  bool clock_tick();
+  bool clock_event();
+  void sync_clock();
+  void set_check_int();
+  void irq_drain();
+  int bcache_fill(SBlock *b);
+  void bcache_decode(SBlockIns *bi, u32 ins);
+  void bcache_flush();
+  bool bcache_hit(const SBlock *b);
+  bool memloop_decode(const SBlock *b, SMemLoop *l);
+  static int memloop_shape(SMemLoop *l);
+  static bool memloop_contiguous(const SMemLoop *l, u8 base, bool store,
+                                 s64 *lo);
+  bool memloop_run(SBlock *b);
+  void jit_init();
+  void jit_free();
+  void jit_compile(SBlock *b);
+  int jit_run(SBlock *b);
+  static int jit_call(CAlphaCPU *cpu, const SBlockIns *bi);
+  static int jit_emit_native(u8 *&p, const SBlockIns *bi, u32 off_r);
+
+#define BCACHE_DECLARE(mnemonic) void do_##mnemonic(const SBlockIns *bi);
+  CPU_MNEMONICS(BCACHE_DECLARE)
+#undef BCACHE_DECLARE
+  void do_HW_MTPR(const SBlockIns *bi);
+  void do_UNKNOWN1(const SBlockIns *bi);
+  void do_UNKNOWN2(const SBlockIns *bi);
+
+  /**
+   * \brief Soft TLB entry.
+   *
+   * Maps a page of virtual memory that the DTB translates to main memory
+   * straight to the host memory that holds it.
+   **/
+  struct SSoftTLB {
+    u64 tag;    /**< Virtual page address, or'ed with stlb_ctx */
+    u64 addend; /**< Host address minus virtual address */
+  };
+
+  SSoftTLB stlb[2][STLB_ENTRIES]; /**< Soft TLB for reads and for writes */
+  u64 stlb_ctx; /**< Current soft TLB generation, in bits 3 to 12 */
+
+  int tb_hash[2][TB_HASH_SIZE];  /**< First TB entry in each chain */
+  int tb_chain[2][TB_ENTRIES];   /**< Next TB entry in the chain */
+  int tb_gh_count[2][4];         /**< TB entries on a chain, per granularity
+                                      hint */
   bool icache_enabled;
+  int icache_hash[ICACHE_HASH_SIZE]; /**< First icache entry in each chain */
+  int icache_chain[ICACHE_ENTRIES];  /**< Next icache entry in the chain */
+  bool icache_ref[ICACHE_ENTRIES];   /**< Referenced since last replacement
+                                          scan */
+  u64 icache_hits;                   /**< Lookups found in the icache */
+  u64 icache_misses;                 /**< Lookups that filled an entry */
+  u64 icache_snoops;                 /**< Lines dropped after a store */
+  std::mutex icache_stale_mutex;
+  std::atomic_bool icache_stale{false}; /**< Other threads stored to code we
+                                             have cached */
+  u64 icache_stale_line[ICACHE_STALE_MAX]; /**< Lines they stored to; under
+                                                icache_stale_mutex */
+  int icache_stale_count; /**< Entries in icache_stale_line, or more than
+                               ICACHE_STALE_MAX to flush everything */
+  bool bcache_enabled;
+  std::unique_ptr<SBlock[]> bcache; /**< Decoded block cache */
+  u32 icache_gen[ICACHE_ENTRIES];   /**< Times each icache entry was filled */
+  bool memloop_enabled;
+  std::unique_ptr<SMemLoop[]> memloops; /**< Loops in the block cache, by
+                                             block */
+  bool jit_enabled;
+  u8 *jit_buffer;  /**< Executable memory for translated blocks */
+  size_t jit_used; /**< Bytes of jit_buffer in use */
+  bool tb_fill_enabled; /**< Refill the TB without running PALcode */
+  u64 tb_fill_pal;      /**< PAL base tb_fill_pal_ok was determined for */
+  bool tb_fill_pal_ok;  /**< The PALcode's miss handlers use the VPTB */
+  bool host_fp_enabled; /**< Let ieee_host and vax_host do the work */
+  bool idle_enabled;    /**< Sleep while the guest is in an idle loop */
+  u64 idle_pc;          /**< Target of the backward branch being watched */
+  u64 idle_branch;      /**< Address of that branch */
+  u64 idle_icount;      /**< Instruction count when it was last taken */
+  int idle_count;       /**< Unchanged iterations of the loop seen so far */
+  u64 idle_r[32];       /**< Integer registers after the last iteration */
+  bool idle_ok;         /**< idle_scan() accepted the loop being watched */
+  int idle_nwatch;      /**< Number of quadwords of memory the loop reads */
+  std::atomic<u64> *idle_host[IDLE_WATCH_MAX]; /**< Those quadwords */
+  u64 idle_value[IDLE_WATCH_MAX]; /**< Their contents the loop last saw */
+  /// Physical addresses of the quadwords while sleeping, for idle_stored();
+  /// 1 if unused.
+  std::atomic<u64> idle_watch_pa[IDLE_WATCH_MAX];
+  bool idle_watching;                 /**< idle_watch_pa is set */
+  std::atomic_bool idle_poked{false}; /**< idle_stored() found a match */
+  std::mutex idle_mutex;
+  std::condition_variable idle_cond;
+  std::atomic_bool idle_sleeping{false}; /**< Thread is waiting in idle_sleep */
+  bool idle_wake; /**< Set by irq_h() and idle_stored() to end idle_sleep();
+                     under idle_mutex */
+  bool idle_parked; /**< Idle on a shared thread; skipped until idle_until */
+  std::chrono::steady_clock::time_point idle_start;
+  std::chrono::steady_clock::time_point idle_until;
+  bool idle_unpark(std::chrono::steady_clock::time_point now);
+  void idle_account(std::chrono::steady_clock::time_point start);
+
+  /**
+   * Interrupt mailbox. irq_h() posts the level each IRQ_H line should have
+   * (bits 0-5), and whether it is asserted after a delay (bits 8-13), from
+   * any thread. The CPU thread takes the changes over into eir and the
+   * irq_h timers in irq_drain(), called from clock_event(); nothing else
+   * touches those from outside the CPU thread.
+   **/
+  std::atomic<u32> irq_mail{0};
+  std::atomic<int> irq_delay[6]; /**< Delay posted with each line */
+  u32 irq_seen;                  /**< Value of irq_mail last drained */
+  u64 irq_deadline[6]; /**< Instruction count at which each delayed line is
+                            asserted */
   bool skip_memtest_hack;
   int skip_memtest_counter;
+  bool unalign_enabled; /**< Split unaligned accesses across a page instead
+                             of trapping */
+  std::mutex unalign_mutex;
+  std::unordered_map<u64, u64> unalign_pcs; /**< Accesses split up, by PC;
+                                                 under unalign_mutex */
+  bool osfpal_enabled; /**< Run hot OSF/1 PALcode calls natively */
+  bool osfpal_check;   /**< Check every call against the PALcode instead */
+  bool osfpal_active;  /**< Last SWPPAL switched to the OSF/1 PALcode */
+  u64 osfpal_pcbb;     /**< PCBB from the last SWPPAL or SWPCTX; 1 if
+                            unknown */
+  u64 osfpal_base;     /**< PALcode base osfpal_sum was computed for */
+  u32 osfpal_sum;      /**< Checksum of the CALL_PAL entry points */
+  int osfpal_trust[OSFPAL_CALLS]; /**< Per call: matching results seen so
+                                       far, or -1 after a mismatch */
+  int osfpal_pending;  /**< Call being checked, or -1 */
+  u64 osfpal_ret;      /**< Return address of that call */
+  u64 osfpal_expect;   /**< Result predicted for it */
+  u64 osfpal_va;       /**< Address passed to TBI */
+  int osfpal_seen;     /**< Effects of TBI seen so far, OSFPAL_TB_* */
+  u64 osfpal_r[32];    /**< Integer registers when TBI was called */
+
+  /// Variant of execute() to use; chosen by select_execute() whenever the
+  /// configuration changes.
+  void (CAlphaCPU::*execute_fn)();
 
   // ... ... ...
   u64 cc_large;
@@ -248,6 +582,11 @@ private:
   u64 cc_per_instruction;
   u64 ins_per_timer_int;
   u64 next_timer_int;
+  std::atomic<u64> next_event{0}; /**< Instruction count at which
+                                       clock_event() is due; other threads
+                                       only ever set it to 0 */
+  u64 clock_synced; /**< Instruction count cc_large and CC were last updated
+                       for */
   u64 cpu_hz;
 
   /// The state structure contains all elements that need to be saved to the
@@ -331,7 +670,7 @@ private:
       bool asm_bit;               /**< Address Space Match bit */
       bool valid;                 /**< Valid cache entry */
     } icache[ICACHE_ENTRIES];     /**< Instruction cache entries [HRM p 2-11] */
-    int next_icache;              /**< Number of next cache entry to use */
+    int next_icache;              /**< Replacement scan position */
     int last_found_icache;        /**< Number of last cache entry found */
 
     /**
@@ -351,9 +690,14 @@ private:
       int asm_bit;    /**< Address Space Match bit*/
       int access[2][4];  /**< Access permitted [read/write][current mode]*/
       int fault[3];      /**< Fault on access [read/write/execute]*/
+      int gh;            /**< Granularity hint*/
+      u32 gen;           /**< tb_gen when the entry was added*/
       bool valid;        /**< Valid entry*/
     } tb[2][TB_ENTRIES]; /**< Translation buffer entries */
 
+    u32 tb_gen[2]; /**< Entries without the ASM bit are only valid if their
+                      gen matches this; incremented by tbiap */
+
     int next_tb[2]; /**< Number of next translation buffer entry to use */
     int last_found_tb[2]
                      [2]; /**< Number of last translation buffer entry found */
@@ -387,22 +731,24 @@ private:
 #define RREG(a)                                                                \
   (((a)&0x1f) + (((state.pc & 1) && (((a)&0xc) == 0x4) && state.sde) ? 32 : 0))
 
+/**
+ * \brief Called each clock-cycle.
+ *
+ * Runs the variant of the execution loop that was specialized for the
+ * current configuration, so that none of the checks that don't apply to it
+ * have to be made for every instruction.
+ **/
+inline void CAlphaCPU::execute() { (this->*execute_fn)(); }
+
 /**
  * Empty the instruction cache.
  **/
 inline void CAlphaCPU::flush_icache() {
   if (icache_enabled) {
-
-    //  memset(state.icache,0,sizeof(state.icache));
-    int i;
-    for (i = 0; i < ICACHE_ENTRIES; i++) {
-      state.icache[i].valid = false;
-
-      //    state.icache[i].asm_bit = true;
-    }
-
+    icache_invalidate(false);
     state.next_icache = 0;
     state.last_found_icache = 0;
+    rehash_icache();
   }
 }
 
@@ -410,11 +756,39 @@ inline void CAlphaCPU::flush_icache() {
  * Empty the instruction cache of lines with the ASM bit clear.
  **/
 inline void CAlphaCPU::flush_icache_asm() {
-  if (icache_enabled) {
-    int i;
-    for (i = 0; i < ICACHE_ENTRIES; i++)
-      if (!state.icache[i].asm_bit)
-        state.icache[i].valid = false;
+  if (icache_enabled)
+    icache_invalidate(true);
+}
+
+/**
+ * Look up a virtual address in the soft TLB.
+ *
+ * \param virt   Virtual address.
+ * \param align  Alignment mask for the access size; unaligned accesses always
+ *               miss.
+ * \param flags  ACCESS_READ or ACCESS_WRITE.
+ * \return Host pointer to the data, or NULL if the address is not in the
+ *         soft TLB.
+ **/
+inline u8 *CAlphaCPU::stlb_host(u64 virt, int align, int flags) {
+  SSoftTLB *e = &stlb[flags][(virt >> 13) & (STLB_ENTRIES - 1)];
+
+  if (e->tag != ((virt & (~U64(0x1fff) | align)) | stlb_ctx))
+    return nullptr;
+  return (u8 *)(size_t)(virt + e->addend);
+}
+
+/**
+ * Invalidate all entries in the soft TLB. Needs to be called whenever the
+ * outcome of virt2phys() for a data access could change: when the DTB is
+ * modified, or when the current mode, DTB_ASN0 or the data superpage enables
+ * change.
+ **/
+inline void CAlphaCPU::stlb_flush() {
+  stlb_ctx += 8;
+  if (stlb_ctx > 0x1fff) {
+    memset(stlb, 0, sizeof(stlb));
+    stlb_ctx = 8;
   }
 }
 
@@ -427,28 +801,54 @@ inline void CAlphaCPU::set_PAL_BASE(u64 pb) {
   state.pal_vms = (pb == U64(0x8000));
 }
 
+/**
+ * Determine the instruction cache hash chain an address belongs to. The
+ * address space number is not part of the hash, so that lines with the ASM
+ * bit set are found from any address space.
+ **/
+inline int CAlphaCPU::icache_bucket(u64 address) {
+  u64 a = address & ICACHE_MATCH_MASK;
+  return (int)(((a >> 11) ^ (a >> 22) ^ (a << 10)) & (ICACHE_HASH_SIZE - 1));
+}
+
+/**
+ * Determine the translation buffer hash chain a virtual address belongs to,
+ * for entries with granularity hint \a gh. Only the bits that are compared
+ * for such an entry are used, and the address space number is left out,
+ * like it is for the icache.
+ **/
+inline int CAlphaCPU::tb_bucket(u64 virt, int gh) {
+  u64 a = (virt & U64(0x000007ffffffe000)) >> (13 + 3 * gh);
+  return (int)((a ^ (a >> 8) ^ (gh << 6)) & (TB_HASH_SIZE - 1));
+}
+
 /**
  * Get an instruction from the instruction cache.
  * If necessary, fill a new cache block from memory.
  *
- * get_icache checks all cache entries, to see if there is a
- * cache entry that matches the current address space number,
- * and that contains the address we're looking for. If it
- * exists, the instruction is fetched from this cache,
- * otherwise, the physical address for the instruction is
- * calculated, and the cache block is filled.
+ * get_icache looks for a cache entry that matches the current
+ * address space number, and that contains the address we're
+ * looking for. If it exists, the instruction is fetched from
+ * this cache, otherwise, the physical address for the
+ * instruction is calculated, and the cache block is filled.
  *
  * The last cache entry that was a hit is remembered, so that
  * cache entry is checked first on the next instruction. (very
- * likely to be the same cache block)
+ * likely to be the same cache block) Otherwise, only the entries
+ * on the hash chain for the address are checked.
  *
- * It would be easiest to do without the instruction cache
- * altogether, but unfortunately SRM uses self-modifying
- * code, that relies on the correct instruction stream to
- * remain in the cache.
+ * Entries are replaced using the clock algorithm: next_icache
+ * sweeps over the entries, and takes the first one that is
+ * invalid or that hasn't been referenced since the last sweep.
+ *
+ * Lines filled are registered with the system, so that a
+ * store to them by any CPU or device invalidates them (see
+ * icache_stored()); self-modifying code is always seen.
  **/
 inline int CAlphaCPU::get_icache(u64 address, u32 *data) {
   int i = state.last_found_icache;
+  int h;
+  int *link;
   u64 v_a;
   u64 p_a;
   int result;
@@ -464,14 +864,17 @@ inline int CAlphaCPU::get_icache(u64 address, u32 *data) {
       current_pc_physical =
           state.icache[i].p_address + (address & ICACHE_BYTE_MASK);
 #endif
+      icache_hits++;
       return 0;
     }
 
-    for (i = 0; i < ICACHE_ENTRIES; i++) {
+    h = icache_bucket(address);
+    for (i = icache_hash[h]; i >= 0; i = icache_chain[i]) {
       if (state.icache[i].valid &&
           (state.icache[i].asn == state.asn || state.icache[i].asm_bit) &&
           state.icache[i].address == (address & ICACHE_MATCH_MASK)) {
         state.last_found_icache = i;
+        icache_ref[i] = true;
         *data =
             endian_32(state.icache[i].data[(address >> 2) & ICACHE_INDEX_MASK]);
 
@@ -479,6 +882,7 @@ inline int CAlphaCPU::get_icache(u64 address, u32 *data) {
         current_pc_physical =
             state.icache[i].p_address + (address & ICACHE_BYTE_MASK);
 #endif
+        icache_hits++;
         return 0;
       }
     }
@@ -494,26 +898,50 @@ inline int CAlphaCPU::get_icache(u64 address, u32 *data) {
         return result;
     }
 
-    memcpy(state.icache[state.next_icache].data, cSystem->PtrToMem(p_a),
-           ICACHE_LINE_SIZE * 4);
+    icache_misses++;
+
+    // Pick the entry to replace, and take it off its hash chain.
+    for (;;) {
+      i = state.next_icache;
+      if (++state.next_icache == ICACHE_ENTRIES)
+        state.next_icache = 0;
+      if (!state.icache[i].valid || !icache_ref[i])
+        break;
+      icache_ref[i] = false;
+    }
+    bool evict = state.icache[i].valid && state.icache[i].p_address != p_a;
+    u64 evicted = state.icache[i].p_address;
+
+    if (icache_chain[i] != -2) {
+      link = &icache_hash[icache_bucket(state.icache[i].address)];
+      while (*link != i)
+        link = &icache_chain[*link];
+      *link = icache_chain[i];
+    }
+
+    icache_chain[i] = icache_hash[h];
+    icache_hash[h] = i;
+    icache_ref[i] = true;
 
-    state.icache[state.next_icache].valid = true;
-    state.icache[state.next_icache].asn = state.asn;
-    state.icache[state.next_icache].asm_bit = asm_bit;
-    state.icache[state.next_icache].address = address & ICACHE_MATCH_MASK;
-    state.icache[state.next_icache].p_address = p_a;
+    cSystem->code_fetched(state.iProcNum, p_a);
+    memcpy(state.icache[i].data, cSystem->PtrToMem(p_a), ICACHE_LINE_SIZE * 4);
+    icache_gen[i]++;
 
-    *data = endian_32(state.icache[state.next_icache]
-                          .data[(address >> 2) & ICACHE_INDEX_MASK]);
+    state.icache[i].valid = true;
+    state.icache[i].asn = state.asn;
+    state.icache[i].asm_bit = asm_bit;
+    state.icache[i].address = address & ICACHE_MATCH_MASK;
+    state.icache[i].p_address = p_a;
+    if (evict)
+      icache_release(evicted);
+
+    *data = endian_32(state.icache[i].data[(address >> 2) & ICACHE_INDEX_MASK]);
 
 #ifdef IDB
-    current_pc_physical = state.icache[state.next_icache].p_address +
-                          (address & ICACHE_BYTE_MASK);
+    current_pc_physical =
+        state.icache[i].p_address + (address & ICACHE_BYTE_MASK);
 #endif
-    state.last_found_icache = state.next_icache;
-    state.next_icache++;
-    if (state.next_icache == ICACHE_ENTRIES)
-      state.next_icache = 0;
+    state.last_found_icache = i;
     return 0;
   }
 
@@ -560,6 +988,32 @@ inline u64 CAlphaCPU::va_form(u64 address, bool bIBOX) {
   return 0;
 }
 
+/**
+ * Flag that the interrupt state may have changed, so that clock_tick()
+ * checks for pending interrupts before the next instruction. Only used from
+ * the CPU thread; other threads go through irq_h().
+ **/
+inline void CAlphaCPU::set_check_int() {
+  state.check_int = true;
+  next_event.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * Bring cc_large and the cycle counter up to date with the instructions
+ * counted by clock_tick() since the last time. Must be called before CC or
+ * CC_CTL is read or written.
+ **/
+inline void CAlphaCPU::sync_clock() {
+  u64 n = state.instruction_count - clock_synced;
+
+  if (n) {
+    clock_synced = state.instruction_count;
+    cc_large += n * cc_per_instruction;
+    if (state.cc_ena)
+      state.cc += n * cc_per_instruction;
+  }
+}
+
 /**
  * Return processor number.
  **/
@@ -567,29 +1021,39 @@ inline int CAlphaCPU::get_cpuid() { return state.iProcNum; }
 
 /**
  * Assert or release an external interrupt line to the cpu.
+ *
+ * May be called from any thread. The new level is posted to irq_mail, and
+ * the CPU thread is made to run clock_event() (and so irq_drain()) before
+ * its next instruction.
  **/
 inline void CAlphaCPU::irq_h(int number, bool assert, int delay) {
-  bool active = (state.eir & (U64(0x1) << number)) || state.irq_h_timer[number];
-  if (assert && !active) {
-    if (delay) {
-      state.irq_h_timer[number] = delay;
-      state.check_timers = true;
-    } else {
-      state.eir |= (U64(0x1) << number);
-      state.check_int = true;
-    }
+  u32 bit = 1U << number;
+
+  if (!(irq_mail.load(std::memory_order_relaxed) & bit) != assert)
+    return;
 
+  if (!assert) {
+    irq_mail.fetch_and(~(bit | (bit << 8)));
+    next_event.store(0, std::memory_order_relaxed);
     return;
   }
 
-  if (!assert && active) {
-    state.eir &= ~(U64(0x1) << number);
-    state.irq_h_timer[number] = 0;
-    state.check_timers = false;
-    for (int i = 0; i < 6; i++) {
-      if (state.irq_h_timer[i])
-        state.check_timers = true;
-    }
+  if (delay) {
+    irq_delay[number].store(delay, std::memory_order_relaxed);
+    irq_mail.fetch_or(bit | (bit << 8));
+  } else {
+    irq_mail.fetch_or(bit);
+  }
+  next_event.store(0, std::memory_order_relaxed);
+
+  // Wake up the CPU thread if it is sleeping in an idle loop. The fence
+  // pairs with the one in idle_sleep() and thread_wait(), so that either we
+  // see it sleeping, or it sees the interrupt before going to sleep.
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (idle_sleeping.load(std::memory_order_relaxed)) {
+    std::lock_guard<std::mutex> lock(thread_leader->idle_mutex);
+    thread_leader->idle_wake = true;
+    thread_leader->idle_cond.notify_one();
   }
 }
 
@@ -0,0 +1,223 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+
+#include "AlphaCPU.hpp"
+#include "StdAfx.hpp"
+#include "TraceEngine.hpp"
+#include "cpu_arith.hpp"
+#include "cpu_bwx.hpp"
+#include "cpu_control.hpp"
+#include "cpu_debug.hpp"
+#include "cpu_fp_branch.hpp"
+#include "cpu_fp_memory.hpp"
+#include "cpu_fp_operate.hpp"
+#include "cpu_logical.hpp"
+#include "cpu_memory.hpp"
+#include "cpu_misc.hpp"
+#include "cpu_mvi.hpp"
+#include "cpu_pal.hpp"
+#include "cpu_vax.hpp"
+
+#if !defined(HAVE_NEW_FP)
+#include "es40_float.hpp"
+#endif
+
+/***********************************************************
+ *                                                         *
+ *                  Decoded block cache                    *
+ *                                                         *
+ ***********************************************************/
+
+// The block cache is not used by the interactive debugger, which needs to
+// disassemble every instruction it executes.
+#if !defined(IDB)
+
+/**
+ * Define the block cache handler for an instruction. The handler executes the
+ * same DO_<mnemonic> macro that execute() uses, with the same local variables
+ * available to it; most macros use only a few of them.
+ **/
+#define BCACHE_HANDLER(mnemonic)                                               \
+  void CAlphaCPU::do_##mnemonic(const SBlockIns *bi) {                         \
+    u32 ins = bi->ins;                                                         \
+    int function = bi->function;                                               \
+    int opcode = ins >> 26;                                                    \
+    int i;                                                                     \
+    u64 phys_address;                                                          \
+    u64 temp_64;                                                               \
+    u64 temp_64_1;                                                             \
+    u64 temp_64_2;                                                             \
+    bool pbc;                                                                  \
+                                                                               \
+    do {                                                                       \
+      DO_##mnemonic;                                                           \
+    } while (0);                                                               \
+    (void)function;                                                            \
+    (void)opcode;                                                              \
+    (void)i;                                                                   \
+    (void)phys_address;                                                        \
+    (void)temp_64;                                                             \
+    (void)temp_64_1;                                                           \
+    (void)temp_64_2;                                                           \
+    (void)pbc;                                                                 \
+  }
+
+#define DO_UNKNOWN1 UNKNOWN1
+#define DO_UNKNOWN2 UNKNOWN2
+
+BCACHE_HANDLER(UNKNOWN1)
+BCACHE_HANDLER(UNKNOWN2)
+
+// HW_MTPR to I_CTL changes the PALshadow enable bit while it is still reading
+// its operand, so it translates its register numbers at execution time, like
+// execute() does.
+BCACHE_HANDLER(HW_MTPR)
+
+// All other handlers use the register numbers, displacement and literal that
+// were extracted when the block was decoded.
+#undef REG_1
+#undef REG_2
+#undef REG_3
+#undef RBV
+#undef DISP_12
+#undef DISP_16
+#undef DISP_21
+#define REG_1 (bi->ra)
+#define REG_2 (bi->rb)
+#define REG_3 (bi->rc)
+#define RBV (*bi->rbv)
+#define DISP_12 (bi->disp)
+#define DISP_16 (bi->disp)
+#define DISP_21 (bi->disp)
+
+CPU_MNEMONICS(BCACHE_HANDLER)
+
+/**
+ * Decode a single instruction into a block cache entry.
+ *
+ * The displacement is sign-extended according to the instruction format; for
+ * operate-format instructions with a literal operand, the literal is stored
+ * in its place, and the Rb operand points to it.
+ **/
+void CAlphaCPU::bcache_decode(SBlockIns *bi, u32 ins) {
+  int opcode = ins >> 26;
+  int function = 0;
+
+  bi->ins = ins;
+  bi->ra = (u8)RREG(I_GETRA(ins));
+  bi->rb = (u8)RREG(I_GETRB(ins));
+  bi->rc = (u8)RREG(I_GETRC(ins));
+  bi->rbv = &state.r[bi->rb];
+
+  if (opcode >= 0x30) {
+    bi->disp = sext_u64_21(ins); // branch format
+  } else if (opcode == 0x1b || opcode == 0x1f) {
+    bi->disp = sext_u64_12(ins); // HW_LD, HW_ST
+  } else if (opcode >= 0x20 || (opcode >= 0x08 && opcode < 0x10)) {
+    bi->disp = sext_u64_16(ins); // memory format
+  } else {
+    bi->disp = (ins >> 13) & 0xff; // operate format
+    if (ins & 0x1000)
+      bi->rbv = &bi->disp;
+  }
+
+#undef OP
+#undef UNKNOWN1
+#undef UNKNOWN2
+#define OP(mnemonic, format)                                                   \
+  {                                                                            \
+    bi->handler = &CAlphaCPU::do_##mnemonic;                                   \
+    bi->function = function;                                                   \
+    return;                                                                    \
+  }
+#define UNKNOWN1 OP(UNKNOWN1, NOP)
+#define UNKNOWN2 OP(UNKNOWN2, NOP)
+#include "cpu_decode.hpp"
+}
+
+/**
+ * Fill a block cache entry with the block that starts at the current program
+ * counter.
+ *
+ * The first instruction is fetched through get_icache(), which fills the
+ * instruction cache entry if needed; the rest of the block is decoded from
+ * the same icache entry. A block ends after an instruction that may transfer
+ * control or change the processor mode (CALL_PAL, JMP, HW_MTPR, HW_RET and
+ * the branches), at the end of the icache entry, or when it is full.
+ *
+ * \return 0 on success, or non-zero if fetching the first instruction caused
+ *         an exception (which has then already been initiated).
+ **/
+int CAlphaCPU::bcache_fill(SBlock *b) {
+  u32 ins;
+  int line;
+  int index;
+  int opcode;
+  int n;
+
+  if (get_icache(state.pc, &ins))
+    return -1;
+
+  line = state.last_found_icache;
+  index = (int)((state.pc >> 2) & ICACHE_INDEX_MASK);
+
+  b->pc = state.pc;
+  b->line = line;
+  b->gen = icache_gen[line];
+  b->sde = state.sde;
+  b->valid = true;
+  b->hits = 0;
+  b->jit = nullptr;
+
+  for (n = 0; n < BCACHE_BLOCK_SIZE && index < ICACHE_LINE_SIZE;) {
+    ins = endian_32(state.icache[line].data[index++]);
+    bcache_decode(&b->ins[n++], ins);
+
+    opcode = ins >> 26;
+    if (opcode == 0x00 || opcode == 0x1a || opcode == 0x1d || opcode == 0x1e ||
+        opcode >= 0x30)
+      break;
+  }
+
+  b->count = n;
+  b->loop =
+      memloop_enabled && memloop_decode(b, &memloops[b - bcache.get()]);
+  return 0;
+}
+
+/**
+ * Invalidate all blocks in the block cache.
+ **/
+void CAlphaCPU::bcache_flush() {
+  for (int i = 0; i < BCACHE_ENTRIES; i++) {
+    bcache[i].valid = false;
+    bcache[i].loop = false;
+  }
+}
+#endif
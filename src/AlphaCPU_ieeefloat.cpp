@@ -84,6 +84,17 @@
 #include "StdAfx.hpp"
 #include "cpu_debug.hpp"
 
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+/* The host FPU can stand in for the software routines only if it evaluates
+   float and double expressions in their own precision (no x87 excess
+   precision). */
+#if defined(FLT_EVAL_METHOD) && (FLT_EVAL_METHOD == 0)
+#define IEEE_HOST_FP
+#endif
+
 /***************************************************************************/
 
 /**
@@ -184,6 +195,13 @@
 #define UF_TRND U64(0x0000000000000400) /* T normal round */
 #define UF_TINF U64(0x00000000000007FF) /* T infinity round */
 
+/* Operations for ieee_host */
+#define IEEE_HOST_ADD 0
+#define IEEE_HOST_SUB 1
+#define IEEE_HOST_MUL 2
+#define IEEE_HOST_DIV 3
+#define IEEE_HOST_SQRT 4
+
 /***************************************************************************/
 
 /**
@@ -447,6 +465,148 @@ u64 CAlphaCPU::ieee_cvtfi(u64 op, u32 ins) {
   return (a.sign ? NEG_Q(a.frac) : a.frac);
 }
 
+/**
+ * \brief Check if an IEEE value can be handled by ieee_host.
+ *
+ * S-floating values must be normal numbers above the smallest normal, with
+ * the low fraction bits clear. T-floating values must be well above the
+ * underflow threshold, so that the error terms computed by ieee_host are
+ * representable.
+ *
+ * \param op  IEEE floating in register format.
+ * \param dp  DT_S for S-floating or DT_T for T-floating.
+ * \return    True if op is in the range ieee_host handles.
+ **/
+static inline bool ieee_host_range(u64 op, u32 dp) {
+  u32 exp = FPR_GETEXP(op);
+
+  if (dp == DT_T)
+    return (exp >= 0x40) && (exp < FPR_NAN);
+  return (exp > T_BIAS - S_BIAS + 1) && (exp < T_BIAS - S_BIAS + S_M_EXP) &&
+         !(op & U64(0x1fffffff));
+}
+
+/**
+ * \brief Do an IEEE arithmetic operation with host floating point.
+ *
+ * For round-to-nearest operations on normal operands that deliver a normal
+ * result, the host FPU produces the same bits as the software routines, and
+ * the only exception that can occur is inexact. Everything else (other
+ * rounding modes, zeroes, denormals, infinities, NaNs, overflow, underflow)
+ * is left to the software routines.
+ *
+ * Inexact is detected by computing the rounding error exactly (TwoSum for
+ * add and subtract, a fused multiply-add or a double-precision product for
+ * the others) rather than through the host's exception flags, which are
+ * slow to read and clear.
+ *
+ * Results at the smallest normal number are left to the software routines
+ * as well; those round to full precision before checking for underflow, the
+ * host rounds to denormal precision.
+ *
+ * \param s1  First operand.
+ * \param s2  Second operand (ignored for IEEE_HOST_SQRT).
+ * \param ins The instruction currently being executed. Used to determine the
+ *            rounding mode and to properly handle exceptions.
+ * \param dp  DT_S for S-floating or DT_T for T-floating.
+ * \param op  IEEE_HOST_ADD, _SUB, _MUL, _DIV or _SQRT.
+ * \param res Pointer to where the result is to be returned.
+ * \return    True if the result was computed, false if the software routine
+ *            has to be used.
+ **/
+bool CAlphaCPU::ieee_host(u64 s1, u64 s2, u32 ins, u32 dp, int op, u64 *res) {
+#if defined(IEEE_HOST_FP)
+  u32 rndm;
+  bool inexact;
+  double a;
+  double b;
+  double c;
+  u64 r;
+
+  if (!host_fp_enabled)
+    return false;
+  rndm = I_GETFRND(ins); /* inst round mode */
+  if (rndm == I_FRND_D)
+    rndm = FPCR_GETFRND(state.fpcr); /* dynamic? use FPCR */
+  if (rndm != I_FRND_N)
+    return false;
+  if (!ieee_host_range(s1, dp))
+    return false;
+  if (op == IEEE_HOST_SQRT) {
+    if (FPR_GETSIGN(s1))
+      return false;
+  } else if (!ieee_host_range(s2, dp))
+    return false;
+
+  memcpy(&a, &s1, sizeof(u64));
+  memcpy(&b, &s2, sizeof(u64));
+  if (op == IEEE_HOST_SUB) {
+    b = -b;
+    op = IEEE_HOST_ADD;
+  }
+
+  if (dp == DT_T) {
+    double e;
+    switch (op) {
+    case IEEE_HOST_ADD:
+      c = a + b;
+      e = c - a;
+      inexact = ((a - (c - e)) + (b - e)) != 0;
+      break;
+    case IEEE_HOST_MUL:
+      c = a * b;
+      inexact = std::fma(a, b, -c) != 0;
+      break;
+    case IEEE_HOST_DIV:
+      c = a / b;
+      inexact = std::fma(c, b, -a) != 0;
+      break;
+    default:
+      c = std::sqrt(a);
+      inexact = std::fma(c, c, -a) != 0;
+      break;
+    }
+  } else {
+    float fa = (float)a; /* exact, low bits are zero */
+    float fb = (float)b;
+    float fc;
+    float fe;
+    switch (op) {
+    case IEEE_HOST_ADD:
+      fc = fa + fb;
+      fe = fc - fa;
+      inexact = ((fa - (fc - fe)) + (fb - fe)) != 0;
+      break;
+    case IEEE_HOST_MUL:
+      fc = fa * fb;
+      inexact = (double)fc != (double)fa * fb; /* exact in double */
+      break;
+    case IEEE_HOST_DIV:
+      fc = fa / fb;
+      inexact = (double)fc * fb != a;
+      break;
+    default:
+      fc = std::sqrt(fa);
+      inexact = (double)fc * fc != a;
+      break;
+    }
+
+    c = fc; /* widen to register format */
+  }
+
+  memcpy(&r, &c, sizeof(u64));
+  if (!ieee_host_range(r, dp))
+    return false;
+
+  if (inexact)
+    ieee_trap(TRAP_INE, Q_SUI(ins), FPCR_INED, ins); /* set inexact */
+  *res = r;
+  return true;
+#else
+  return false;
+#endif
+}
+
 /**
  * \brief Add or subtract 2 IEEE floating-point values.
  *
@@ -485,6 +645,10 @@ u64 CAlphaCPU::ieee_fadd(u64 s1, u64 s2, u32 ins, u32 dp, bool sub) {
   u32 ftpb;
   u32 sticky;
   s32 ediff;
+  u64 res;
+
+  if (ieee_host(s1, s2, ins, dp, sub ? IEEE_HOST_SUB : IEEE_HOST_ADD, &res))
+    return res;
 
   ftpa = ieee_unpack(s1, &a, ins); /* unpack operands */
   ftpb = ieee_unpack(s2, &b, ins);
@@ -572,6 +736,9 @@ u64 CAlphaCPU::ieee_fmul(u64 s1, u64 s2, u32 ins, u32 dp) {
   u32 ftpb;
   u64 resl;
 
+  if (ieee_host(s1, s2, ins, dp, IEEE_HOST_MUL, &resl))
+    return resl;
+
   ftpa = ieee_unpack(s1, &a, ins); /* unpack operands */
   ftpb = ieee_unpack(s2, &b, ins);
   if (ftpb == UFT_NAN)
@@ -627,6 +794,10 @@ u64 CAlphaCPU::ieee_fdiv(u64 s1, u64 s2, u32 ins, u32 dp) {
   u32 ftpa;
   u32 ftpb;
   u32 sticky;
+  u64 res;
+
+  if (ieee_host(s1, s2, ins, dp, IEEE_HOST_DIV, &res))
+    return res;
 
   ftpa = ieee_unpack(s1, &a, ins);
   ftpb = ieee_unpack(s2, &b, ins);
@@ -690,6 +861,10 @@ u64 CAlphaCPU::ieee_fdiv(u64 s1, u64 s2, u32 ins, u32 dp) {
 u64 CAlphaCPU::ieee_sqrt(u64 op, u32 ins, u32 dp) {
   u32 ftpb;
   UFP b;
+  u64 res;
+
+  if (ieee_host(op, 0, ins, dp, IEEE_HOST_SQRT, &res))
+    return res;
 
   ftpb = ieee_unpack(op, &b, ins); /* unpack */
   if (ftpb == UFT_NAN)
@@ -701,8 +876,8 @@ u64 CAlphaCPU::ieee_sqrt(u64 op, u32 ins, u32 dp) {
     return CQNAN;
   }
 
-  b.exp = ((b.exp - T_BIAS) >> 1) + T_BIAS; /* result exponent */
   b.frac = fsqrt64(b.frac, b.exp);          /* result fraction */
+  b.exp = ((b.exp - T_BIAS) >> 1) + T_BIAS; /* result exponent */
   return ieee_rpack(&b, ins, dp);           /* round and pack */
 }
 
@@ -855,6 +1030,7 @@ u64 CAlphaCPU::ieee_rpack(UFP *r, u32 ins, u32 dp) {
   else
     rndadd = 0;
   r->frac = (r->frac + rndadd) & X64_QUAD; /* round */
+  r->frac = r->frac & ~infrnd[dp];         /* drop round bits */
   if ((r->frac & UF_NM) == 0) {            /* carry out? */
     r->frac = (r->frac >> 1) | UF_NM;      /* renormalize */
     r->exp = r->exp + 1;
@@ -881,7 +1057,7 @@ u64 CAlphaCPU::ieee_rpack(UFP *r, u32 ins, u32 dp) {
   res = (((u64)r->sign) << FPR_V_SIGN) | /* form result */
         (((u64)r->exp) << FPR_V_EXP) | ((r->frac >> FPR_GUARD) & FPR_FRAC);
   if ((rndm == I_FRND_N) && (rndbits == stdrnd[dp])) /* nearest and halfway? */
-    res = res & ~1;                                  /* clear lo bit */
+    res = res & ~((stdrnd[dp] << 1) >> FPR_GUARD);   /* clear lo bit */
   return res;
 }
 
@@ -901,7 +1077,7 @@ u64 CAlphaCPU::ieee_rpack(UFP *r, u32 ins, u32 dp) {
 void CAlphaCPU::ieee_trap(u64 trap, u32 instenb, u64 fpcrdsb, u32 ins) {
   u64 real_trap = U64(0x0);
 
-  if (~(state.fpcr & (trap << 51))) // trap bit not set in FPCR
+  if (!(state.fpcr & (trap << 51))) // trap bit not set in FPCR
     real_trap |= trap << 41;        // SET trap bit in EXC_SUM
   if ((instenb != 0)                /* not enabled in inst? ignore */
       && !((ins & I_FTRP_S) &&
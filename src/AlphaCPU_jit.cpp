@@ -0,0 +1,568 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#include "AlphaCPU.hpp"
+#include "StdAfx.hpp"
+
+#if defined(HAVE_JIT) && !defined(_WIN32)
+#include <sys/mman.h>
+#endif
+
+/***********************************************************
+ *                                                         *
+ *            Translation of hot blocks to x86-64          *
+ *                                                         *
+ ***********************************************************/
+
+#if defined(HAVE_JIT)
+
+/// Space reserved in the code buffer for translating a single block
+#define JIT_MAX_BLOCK_CODE 4096
+
+/// x86-64 register numbers used by the translator
+#define X86_RAX 0
+#define X86_RCX 1
+
+/**
+ * Stack space allocated by the prologue, which keeps the stack aligned to 16
+ * bytes for the calls to jit_call(), and includes the 32-byte home area the
+ * Windows x64 calling convention requires.
+ **/
+#if defined(_WIN32)
+#define JIT_FRAME 40
+#else
+#define JIT_FRAME 8
+#endif
+
+static inline void emit8(u8 *&p, u8 v) { *p++ = v; }
+
+static inline void emit32(u8 *&p, u32 v) {
+  memcpy(p, &v, 4);
+  p += 4;
+}
+
+static inline void emit64(u8 *&p, u64 v) {
+  memcpy(p, &v, 8);
+  p += 8;
+}
+
+/**
+ * mov reg, [rbx + off]
+ **/
+static void emit_load(u8 *&p, int reg, u32 off) {
+  emit8(p, 0x48);
+  emit8(p, 0x8b);
+  emit8(p, 0x83 | (reg << 3));
+  emit32(p, off);
+}
+
+/**
+ * mov [rbx + off], reg
+ **/
+static void emit_store(u8 *&p, int reg, u32 off) {
+  emit8(p, 0x48);
+  emit8(p, 0x89);
+  emit8(p, 0x83 | (reg << 3));
+  emit32(p, off);
+}
+
+/**
+ * mov qword [rbx + off], imm (sign-extended 32-bit immediate)
+ **/
+static void emit_store_imm(u8 *&p, u32 off, u32 imm) {
+  emit8(p, 0x48);
+  emit8(p, 0xc7);
+  emit8(p, 0x83);
+  emit32(p, off);
+  emit32(p, imm);
+}
+
+/**
+ * mov reg, imm64
+ **/
+static void emit_mov_imm64(u8 *&p, int reg, u64 imm) {
+  emit8(p, 0x48);
+  emit8(p, 0xb8 + reg);
+  emit64(p, imm);
+}
+
+/**
+ * Emit the function epilogue, returning \a n as the number of instructions
+ * executed.
+ **/
+static void emit_return(u8 *&p, int n) {
+  emit8(p, 0xb8); // mov eax, n
+  emit32(p, n);
+  emit8(p, 0x48); // add rsp, JIT_FRAME
+  emit8(p, 0x83);
+  emit8(p, 0xc4);
+  emit8(p, JIT_FRAME);
+  emit8(p, 0x41); // pop r12
+  emit8(p, 0x5c);
+  emit8(p, 0x5b); // pop rbx
+  emit8(p, 0xc3); // ret
+}
+
+/**
+ * Allocate the buffer translated code is placed in.
+ **/
+void CAlphaCPU::jit_init() {
+  jit_used = 0;
+#if defined(_WIN32)
+  jit_buffer = (u8 *)VirtualAlloc(NULL, JIT_BUFFER_SIZE,
+                                  MEM_COMMIT | MEM_RESERVE,
+                                  PAGE_EXECUTE_READWRITE);
+#else
+  jit_buffer = (u8 *)mmap(NULL, JIT_BUFFER_SIZE,
+                          PROT_READ | PROT_WRITE | PROT_EXEC,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit_buffer == (u8 *)MAP_FAILED)
+    jit_buffer = nullptr;
+#endif
+  if (!jit_buffer) {
+    printf("%s: Unable to allocate executable memory; JIT disabled.\n",
+           devid_string);
+    jit_enabled = false;
+  }
+}
+
+/**
+ * Release the translated code buffer.
+ **/
+void CAlphaCPU::jit_free() {
+  if (!jit_buffer)
+    return;
+#if defined(_WIN32)
+  VirtualFree(jit_buffer, 0, MEM_RELEASE);
+#else
+  munmap(jit_buffer, JIT_BUFFER_SIZE);
+#endif
+  jit_buffer = nullptr;
+}
+
+/**
+ * Execute a pre-decoded instruction on behalf of translated code.
+ *
+ * execute_block() only enters translated code when next_event is beyond the
+ * end of the block, so the deadline can only have come closer because the
+ * instruction, or another thread through irq_h(), asked for clock_event() to
+ * run; everything that does so resets next_event to 0. The instruction count
+ * has not been updated for the translated instructions yet, so comparing
+ * with it catches exactly that.
+ *
+ * \return non-zero if the translated code must return to execute_block()
+ *         after this instruction: the program counter was changed (branch or
+ *         exception), or clock_tick() has work to do before the next
+ *         instruction, such as an interrupt line posted to irq_mail.
+ **/
+int CAlphaCPU::jit_call(CAlphaCPU *cpu, const SBlockIns *bi) {
+  u64 pc = cpu->state.pc;
+
+  (cpu->*bi->handler)(bi);
+  return cpu->state.pc != pc || cpu->state.check_int ||
+         cpu->state.check_timers ||
+         cpu->next_event.load(std::memory_order_relaxed) <=
+             cpu->state.instruction_count ||
+         cpu->irq_mail.load(std::memory_order_relaxed) != cpu->irq_seen;
+}
+
+/**
+ * Emit host code for an integer instruction that cannot trap.
+ *
+ * \return the register written by the instruction, or -1 if the instruction
+ *         is not translated to host code.
+ **/
+int CAlphaCPU::jit_emit_native(u8 *&p, const SBlockIns *bi, u32 off_r) {
+  int opcode = bi->ins >> 26;
+  bool lit = (bi->ins & 0x1000) != 0;
+  u8 op = 0;     // x86 operation on rax, rcx
+  int shift = 0; // scale applied to Ra
+  bool is32 = false;
+  bool notb = false;
+  int setcc = 0;
+  int cmov = 0;
+  bool is_zap = false;
+  u64 zap = 0;
+
+  switch (opcode) {
+  case 0x08: // LDA
+  case 0x09: // LDAH
+    emit_load(p, X86_RAX, off_r + 8 * bi->rb);
+    emit8(p, 0x48); // add rax, imm32
+    emit8(p, 0x05);
+    emit32(p, (u32)(opcode == 0x08 ? bi->disp : bi->disp << 16));
+    emit_store(p, X86_RAX, off_r + 8 * bi->ra);
+    return bi->ra;
+
+  case 0x10:
+    switch (bi->function) {
+    case 0x00: op = 0x01; is32 = true; break;             // ADDL
+    case 0x02: op = 0x01; is32 = true; shift = 2; break;  // S4ADDL
+    case 0x12: op = 0x01; is32 = true; shift = 3; break;  // S8ADDL
+    case 0x09: op = 0x29; is32 = true; break;             // SUBL
+    case 0x0b: op = 0x29; is32 = true; shift = 2; break;  // S4SUBL
+    case 0x1b: op = 0x29; is32 = true; shift = 3; break;  // S8SUBL
+    case 0x20: op = 0x01; break;                          // ADDQ
+    case 0x22: op = 0x01; shift = 2; break;               // S4ADDQ
+    case 0x32: op = 0x01; shift = 3; break;               // S8ADDQ
+    case 0x29: op = 0x29; break;                          // SUBQ
+    case 0x2b: op = 0x29; shift = 2; break;               // S4SUBQ
+    case 0x3b: op = 0x29; shift = 3; break;               // S8SUBQ
+    case 0x2d: setcc = 0x94; break;                       // CMPEQ
+    case 0x4d: setcc = 0x9c; break;                       // CMPLT
+    case 0x6d: setcc = 0x9e; break;                       // CMPLE
+    case 0x1d: setcc = 0x92; break;                       // CMPULT
+    case 0x3d: setcc = 0x96; break;                       // CMPULE
+    default:
+      return -1;
+    }
+    break;
+
+  case 0x11:
+    switch (bi->function) {
+    case 0x00: op = 0x21; break;              // AND
+    case 0x08: op = 0x21; notb = true; break; // BIC
+    case 0x20: op = 0x09; break;              // BIS
+    case 0x28: op = 0x09; notb = true; break; // ORNOT
+    case 0x40: op = 0x31; break;              // XOR
+    case 0x48: op = 0x31; notb = true; break; // EQV
+    case 0x24: cmov = 0x75; break;            // CMOVEQ: skip if Ra != 0
+    case 0x26: cmov = 0x74; break;            // CMOVNE: skip if Ra == 0
+    case 0x44: cmov = 0x79; break;            // CMOVLT: skip if Ra >= 0
+    case 0x46: cmov = 0x78; break;            // CMOVGE: skip if Ra < 0
+    case 0x64: cmov = 0x7f; break;            // CMOVLE: skip if Ra > 0
+    case 0x66: cmov = 0x7e; break;            // CMOVGT: skip if Ra <= 0
+    case 0x14: cmov = 0x174; break;           // CMOVLBS: skip if bit 0 clear
+    case 0x16: cmov = 0x175; break;           // CMOVLBC: skip if bit 0 set
+    default:
+      return -1;
+    }
+    break;
+
+  case 0x12:
+    switch (bi->function) {
+    case 0x39: op = 0xe0; break; // SLL
+    case 0x34: op = 0xe8; break; // SRL
+    case 0x3c: op = 0xf8; break; // SRA
+    case 0x30:                   // ZAP
+    case 0x31:                   // ZAPNOT
+      if (!lit)
+        return -1;
+      is_zap = true;
+      for (int i = 0; i < 8; i++)
+        if (((bi->disp >> i) & 1) == (u64)(bi->function == 0x31))
+          zap |= U64(0xff) << (i * 8);
+      break;
+    default:
+      return -1;
+    }
+    break;
+
+  case 0x13:
+    switch (bi->function) {
+    case 0x00: op = 0xaf; is32 = true; break; // MULL
+    case 0x20: op = 0xaf; break;              // MULQ
+    default:
+      return -1;
+    }
+    break;
+
+  case 0x1c:
+    switch (bi->function) {
+    case 0x00: op = 0xbe; break; // SEXTB
+    case 0x01: op = 0xbf; break; // SEXTW
+    default:
+      return -1;
+    }
+    break;
+
+  default:
+    return -1;
+  }
+
+  // Load Ra into rax, and the Rb operand (register or literal) into rcx.
+  if (opcode != 0x1c)
+    emit_load(p, X86_RAX, off_r + 8 * bi->ra);
+  if (lit) {
+    emit8(p, 0xb8 + X86_RCX); // mov ecx, imm32
+    emit32(p, (u32)bi->disp);
+  } else {
+    emit_load(p, X86_RCX, off_r + 8 * bi->rb);
+  }
+
+  if (cmov) {
+    u8 *skip;
+    if (cmov & 0x100) {
+      emit8(p, 0xa8); // test al, 1
+      emit8(p, 0x01);
+    } else {
+      emit8(p, 0x48); // test rax, rax
+      emit8(p, 0x85);
+      emit8(p, 0xc0);
+    }
+    emit8(p, (u8)cmov); // jcc skip
+    emit8(p, 0);
+    skip = p;
+    emit_store(p, X86_RCX, off_r + 8 * bi->rc);
+    skip[-1] = (u8)(p - skip);
+    return bi->rc;
+  }
+
+  if (is_zap) {
+    emit_mov_imm64(p, X86_RCX, zap);
+    emit8(p, 0x48); // and rax, rcx
+    emit8(p, 0x21);
+    emit8(p, 0xc8);
+  } else if (opcode == 0x12) {
+    emit8(p, 0x48); // shl/shr/sar rax, cl
+    emit8(p, 0xd3);
+    emit8(p, op);
+  } else if (opcode == 0x13) {
+    if (!is32)
+      emit8(p, 0x48);
+    emit8(p, 0x0f); // imul (e/r)ax, (e/r)cx
+    emit8(p, op);
+    emit8(p, 0xc1);
+  } else if (opcode == 0x1c) {
+    emit8(p, 0x48); // movsx rax, cl/cx
+    emit8(p, 0x0f);
+    emit8(p, op);
+    emit8(p, 0xc1);
+  } else if (setcc) {
+    emit8(p, 0x48); // cmp rax, rcx
+    emit8(p, 0x39);
+    emit8(p, 0xc8);
+    emit8(p, 0x0f); // setcc al
+    emit8(p, (u8)setcc);
+    emit8(p, 0xc0);
+    emit8(p, 0x0f); // movzx eax, al
+    emit8(p, 0xb6);
+    emit8(p, 0xc0);
+  } else {
+    if (shift) {
+      if (!is32)
+        emit8(p, 0x48);
+      emit8(p, 0xc1); // shl (e/r)ax, shift
+      emit8(p, 0xe0);
+      emit8(p, (u8)shift);
+    }
+    if (notb) {
+      emit8(p, 0x48); // not rcx
+      emit8(p, 0xf7);
+      emit8(p, 0xd1);
+    }
+    if (!is32)
+      emit8(p, 0x48);
+    emit8(p, op); // op (e/r)ax, (e/r)cx
+    emit8(p, 0xc8);
+  }
+
+  if (is32) {
+    emit8(p, 0x48); // movsxd rax, eax
+    emit8(p, 0x63);
+    emit8(p, 0xc0);
+  }
+
+  emit_store(p, X86_RAX, off_r + 8 * bi->rc);
+  return bi->rc;
+}
+
+/**
+ * Translate a block to host code.
+ *
+ * The translated code is a function that executes the instructions of the
+ * block in order. Integer instructions that cannot cause an exception are
+ * translated to x86-64 instructions operating directly on state.r[]; all
+ * other instructions are executed by calling their block cache handler
+ * through jit_call(), after the program counter has been set up the way
+ * execute_block() does. When a handler changes the program counter, or
+ * leaves work for clock_tick(), the function returns immediately. The
+ * function returns the number of instructions it executed; execute_block()
+ * does the bookkeeping for these instructions afterwards.
+ *
+ * Translated blocks are never chained: every block ends at its first branch,
+ * so a loop returns to execute_block() once per iteration, which checks
+ * next_event again before it enters the next block.
+ *
+ * Translation stops at the first instruction that is only valid in PALmode
+ * or that reads the cycle counter (RPCC, CALL_PAL); such instructions are
+ * left to the interpreter, as is the rest of the block.
+ **/
+void CAlphaCPU::jit_compile(SBlock *b) {
+  u8 *code;
+  u8 *p;
+  u8 *skip;
+  const SBlockIns *bi;
+  u32 off_r = (u32)((u8 *)&state.r[0] - (u8 *)&state);
+  u32 off_f31 = (u32)((u8 *)&state.f[31] - (u8 *)&state);
+  u32 off_pc = (u32)((u8 *)&state.pc - (u8 *)&state);
+  u32 off_current_pc = (u32)((u8 *)&state.current_pc - (u8 *)&state);
+  bool dirty_r31 = true; // r31/f31 are cleared before the first instruction
+  bool dirty_f31 = true;
+  bool native = false;
+  int opcode;
+  int n;
+
+  if (b->pc & 1)
+    return;
+
+  // Start over when the code buffer is full.
+  if (jit_used + JIT_MAX_BLOCK_CODE > JIT_BUFFER_SIZE) {
+    for (int i = 0; i < BCACHE_ENTRIES; i++) {
+      bcache[i].jit = nullptr;
+      bcache[i].hits = 0;
+    }
+    jit_used = 0;
+  }
+
+  code = p = jit_buffer + jit_used;
+
+  emit8(p, 0x53); // push rbx
+  emit8(p, 0x41); // push r12
+  emit8(p, 0x54);
+  emit8(p, 0x48); // sub rsp, JIT_FRAME
+  emit8(p, 0x83);
+  emit8(p, 0xec);
+  emit8(p, JIT_FRAME);
+#if defined(_WIN32)
+  emit8(p, 0x49); // mov r12, rcx
+  emit8(p, 0x89);
+  emit8(p, 0xcc);
+  emit8(p, 0x48); // mov rbx, rdx
+  emit8(p, 0x89);
+  emit8(p, 0xd3);
+#else
+  emit8(p, 0x49); // mov r12, rdi
+  emit8(p, 0x89);
+  emit8(p, 0xfc);
+  emit8(p, 0x48); // mov rbx, rsi
+  emit8(p, 0x89);
+  emit8(p, 0xf3);
+#endif
+
+  for (n = 0; n < b->count; n++) {
+    bi = &b->ins[n];
+    opcode = bi->ins >> 26;
+    if (opcode == 0x00 || opcode == 0x19 || opcode == 0x1b ||
+        opcode == 0x1d || opcode == 0x1e || opcode == 0x1f ||
+        bi->handler == &CAlphaCPU::do_RPCC)
+      break;
+
+    // execute_block() clears r31 and f31 before each instruction; only do so
+    // when the previous instruction may have written them.
+    if (dirty_r31)
+      emit_store_imm(p, off_r + 8 * 31, 0);
+    if (dirty_f31)
+      emit_store_imm(p, off_f31, 0);
+
+    int reg = jit_emit_native(p, bi, off_r);
+    if (reg >= 0) {
+      dirty_r31 = (reg == 31);
+      dirty_f31 = false;
+      native = true;
+      continue;
+    }
+
+    dirty_r31 = dirty_f31 = true;
+    native = false;
+    emit_mov_imm64(p, X86_RAX, b->pc + 4 * (n + 1));
+    emit_store(p, X86_RAX, off_pc);
+    emit_mov_imm64(p, X86_RAX, b->pc + 4 * n);
+    emit_store(p, X86_RAX, off_current_pc);
+#if defined(_WIN32)
+    emit8(p, 0x4c); // mov rcx, r12
+    emit8(p, 0x89);
+    emit8(p, 0xe1);
+    emit_mov_imm64(p, 2, (u64)bi); // mov rdx, bi
+#else
+    emit8(p, 0x4c); // mov rdi, r12
+    emit8(p, 0x89);
+    emit8(p, 0xe7);
+    emit_mov_imm64(p, 6, (u64)bi); // mov rsi, bi
+#endif
+    emit_mov_imm64(p, X86_RAX, (u64)&CAlphaCPU::jit_call);
+    emit8(p, 0xff); // call rax
+    emit8(p, 0xd0);
+    emit8(p, 0x85); // test eax, eax
+    emit8(p, 0xc0);
+    emit8(p, 0x74); // jz next
+    emit8(p, 0);
+    skip = p;
+    emit_return(p, n + 1);
+    skip[-1] = (u8)(p - skip);
+  }
+
+  if (n == 0)
+    return;
+
+  // Leave the program counter where the interpreter would have left it.
+  if (native) {
+    emit_mov_imm64(p, X86_RAX, b->pc + 4 * n);
+    emit_store(p, X86_RAX, off_pc);
+    emit_mov_imm64(p, X86_RAX, b->pc + 4 * (n - 1));
+    emit_store(p, X86_RAX, off_current_pc);
+  }
+  emit_return(p, n);
+
+  jit_used += p - code;
+  b->jit = (int (*)(CAlphaCPU *, void *))code;
+  b->jit_count = n;
+}
+
+/**
+ * Run the translated code for a block, and account for the instructions it
+ * executed in the same way clock_tick() and next_pc() would have. The cycle
+ * counters are brought up to date by sync_clock() later, like they are for
+ * interpreted instructions.
+ *
+ * \return the number of instructions executed.
+ **/
+int CAlphaCPU::jit_run(SBlock *b) {
+  int n;
+
+  state.last_found_icache = b->line;
+  icache_ref[b->line] = true;
+  n = b->jit(this, &state);
+
+  state.instruction_count += n;
+  state.pc_phys += 4 * n;
+  state.rem_ins_in_page =
+      (state.rem_ins_in_page > (u32)n) ? state.rem_ins_in_page - n : 0;
+  return n;
+}
+
+#else
+
+void CAlphaCPU::jit_init() {
+  printf("%s: JIT is not supported on this host; using the interpreter.\n",
+         devid_string);
+  jit_enabled = false;
+}
+
+void CAlphaCPU::jit_free() {}
+#endif
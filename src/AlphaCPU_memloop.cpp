@@ -0,0 +1,477 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#include "AlphaCPU.hpp"
+#include "StdAfx.hpp"
+#include "System.hpp"
+#include "cpu_defs.hpp"
+
+#include <algorithm>
+
+/***********************************************************
+ *                                                         *
+ *                Block copy and fill loops                *
+ *                                                         *
+ ***********************************************************/
+
+/*
+ * The inner loops of bcopy, bzero, memcpy and friends, once the unaligned
+ * head has been dealt with, look like this:
+ *
+ *   loop: ldq   t0, 0(a0)            loop: stq   zero, 0(a0)
+ *         ldq   t1, 8(a0)                  stq   zero, 8(a0)
+ *         lda   a0, 16(a0)                 subq  a1, 16, a1
+ *         stq   t0, 0(a1)                  lda   a0, 16(a0)
+ *         stq   t1, 8(a1)                  bgt   a1, loop
+ *         subq  a2, 16, a2
+ *         lda   a1, 16(a1)
+ *         bne   a2, loop
+ *
+ * When source and destination are not aligned the same way, the quadwords
+ * are taken apart and put together with the byte manipulation instructions:
+ *
+ *   loop: ldq_u t1, 8(a1)            loop: ldq   t0, 0(a1)
+ *         subq  a2, 8, a2                  insql t0, a0, t1
+ *         extql t0, a1, t0                 insqh t0, a0, t2
+ *         extqh t1, a1, t2                 bis   t1, t3, t1
+ *         lda   a1, 8(a1)                  stq_u t1, 0(a0)
+ *         bis   t0, t2, t0                 bis   t2, t2, t3
+ *         stq   t0, 0(a0)                  lda   a1, 8(a1)
+ *         lda   a0, 8(a0)                  lda   a0, 8(a0)
+ *         bis   t1, t1, t0                 subq  a2, 8, a2
+ *         bge   a2, loop                   bgt   a2, loop
+ *
+ * Those only use the low three bits of the pointers, which stay the same
+ * from one iteration to the next.
+ *
+ * Such a loop is recognized when its block is decoded, and memloop_run()
+ * then does as many iterations as it can at once: as long as the branch is
+ * taken, every access stays within the page it is in now, and the next
+ * event is not due. Each page must be in the soft TLB for the access, so the
+ * translation and access checks have been done by the interpreter. The
+ * iteration that leaves the loop or crosses into another page is left to the
+ * interpreter, which takes any fault on it exactly like it would have
+ * without this.
+ */
+
+// Like the block cache, this is not used by the interactive debugger.
+#if !defined(IDB)
+
+/// Shapes of SMemLoop::shape
+#define MEMLOOP_OTHER 0
+#define MEMLOOP_FILL 1
+#define MEMLOOP_COPY 2
+
+/// Kinds of instruction in SMemLoop::kind
+#define MEMLOOP_MEM 0 /* load or store */
+#define MEMLOOP_OP 1  /* operate instruction, run through its handler */
+#define MEMLOOP_INC 2 /* increment of a register by a constant */
+
+/**
+ * Check for the opcode 0x12 functions that memloop_run() can run through
+ * their handlers: MSKxL, EXTxL, INSxL, ZAP, ZAPNOT, MSKxH, INSxH and EXTxH.
+ * The shifts are not among them.
+ **/
+static bool memloop_byte_op(int function) {
+  static const u8 functions[] = {0x02, 0x06, 0x0b, 0x12, 0x16, 0x1b,
+                                 0x22, 0x26, 0x2b, 0x30, 0x31, 0x32,
+                                 0x36, 0x3b, 0x52, 0x57, 0x5a, 0x62,
+                                 0x67, 0x6a, 0x72, 0x77, 0x7a};
+
+  return std::find(functions, functions + sizeof(functions), function) !=
+         functions + sizeof(functions);
+}
+
+/**
+ * Check that the offsets of the loads or stores with a given base register
+ * cover one contiguous range of the size the base is incremented by. False
+ * if there are none.
+ *
+ * \param lo  Receives the lowest offset.
+ **/
+bool CAlphaCPU::memloop_contiguous(const SMemLoop *l, u8 base, bool store,
+                                   s64 *lo) {
+  s64 off[BCACHE_BLOCK_SIZE];
+  int n = 0;
+
+  for (int i = 0; i < l->nmem; i++)
+    if (l->mem[i].base == base && l->mem[i].store == store)
+      off[n++] = l->mem[i].offset;
+
+  if (!n)
+    return false;
+  std::sort(off, off + n);
+  for (int i = 1; i < n; i++)
+    if (off[i] != off[i - 1] + 8)
+      return false;
+
+  *lo = off[0];
+  return l->inc[base] == 8 * n;
+}
+
+/**
+ * Classify a recognized loop as a fill (only stores of the same value to
+ * one contiguous range), a copy (loads from one contiguous range, each
+ * followed by a store to the same place in another), or neither. Loops
+ * with unaligned accesses or operate instructions are never a plain fill
+ * or copy.
+ **/
+int CAlphaCPU::memloop_shape(SMemLoop *l) {
+  int loads = 0;
+  int stores = 0;
+
+  if (l->nops)
+    return MEMLOOP_OTHER;
+  for (int i = 0; i < l->nmem; i++)
+    if (l->mem[i].unaligned)
+      return MEMLOOP_OTHER;
+
+  for (int i = 0; i < l->nmem; i++) {
+    if (l->mem[i].store) {
+      if (stores++ && (l->mem[i].base != l->dst ||
+                       (!l->loaded && l->mem[i].data != l->mem[0].data)))
+        return MEMLOOP_OTHER;
+      l->dst = l->mem[i].base;
+    } else {
+      if (loads++ && l->mem[i].base != l->src)
+        return MEMLOOP_OTHER;
+      l->src = l->mem[i].base;
+    }
+  }
+
+  if (!stores || !memloop_contiguous(l, l->dst, true, &l->dst_lo))
+    return MEMLOOP_OTHER;
+  if (!loads)
+    return MEMLOOP_FILL;
+  if (loads != stores || l->src == l->dst ||
+      !memloop_contiguous(l, l->src, false, &l->src_lo))
+    return MEMLOOP_OTHER;
+
+  // Every store writes the register loaded from the same place in the source
+  // range earlier in the iteration.
+  for (int i = 0; i < l->nmem; i++) {
+    int j;
+
+    if (!l->mem[i].store)
+      continue;
+    for (j = 0; j < i; j++)
+      if (!l->mem[j].store && l->mem[j].data == l->mem[i].data)
+        break;
+    if (j == i ||
+        l->mem[j].offset - l->src_lo != l->mem[i].offset - l->dst_lo)
+      return MEMLOOP_OTHER;
+  }
+  return MEMLOOP_COPY;
+}
+
+/**
+ * \brief Recognize a block copy or fill loop.
+ *
+ * Called by bcache_fill() for each block it decodes.
+ *
+ * \return true if the block is a loop memloop_run() can handle; it is then
+ *         described in l.
+ **/
+bool CAlphaCPU::memloop_decode(const SBlock *b, SMemLoop *l) {
+  const SBlockIns *br = b->ins + b->count - 1;
+  u32 incremented = 0;
+  u32 bases = 0;
+  u32 values = 0;
+  u32 computed = 0;
+  u32 used = 0;
+  u32 low_bits = 0;
+
+  if ((b->pc & 1) || b->count < 3)
+    return false;
+
+  // The block must end in a conditional branch back to its start, on a
+  // register that counts towards zero.
+  l->opcode = br->ins >> 26;
+  if (l->opcode != 0x3a && l->opcode != 0x3b && l->opcode != 0x3d &&
+      l->opcode != 0x3e && l->opcode != 0x3f)
+    return false;
+  if ((s64)br->disp != -b->count)
+    return false;
+  l->cond = br->ra;
+
+  l->nmem = 0;
+  l->nops = 0;
+  l->loaded = 0;
+  memset(l->inc, 0, sizeof(l->inc));
+
+  for (const SBlockIns *bi = b->ins; bi < br; bi++) {
+    int opcode = bi->ins >> 26;
+    int function = (bi->ins >> 5) & 0x7f;
+    bool literal = (bi->ins & 0x1000) != 0;
+    u32 ra = 1U << bi->ra;
+
+    if (opcode == 0x29 || opcode == 0x2d || // LDQ, STQ
+        opcode == 0x0b || opcode == 0x0f) { // LDQ_U, STQ_U
+      bool store = (opcode == 0x2d || opcode == 0x0f);
+
+      if (bi->rb == 31)
+        return false;
+      l->kind[bi - b->ins] = MEMLOOP_MEM;
+      l->mem[l->nmem].base = bi->rb;
+      l->mem[l->nmem].data = bi->ra;
+      l->mem[l->nmem].store = store;
+      l->mem[l->nmem].unaligned = (opcode == 0x0b || opcode == 0x0f);
+      l->mem[l->nmem].offset = l->inc[bi->rb] + (s64)bi->disp;
+      l->nmem++;
+      bases |= 1U << bi->rb;
+      if (store) {
+        if (!((l->loaded | computed) & ra))
+          values |= ra;
+      } else {
+        if (bi->ra == 31 || (l->loaded & ra))
+          return false;
+        l->loaded |= ra;
+      }
+    } else if (opcode == 0x08 && bi->ra == bi->rb && bi->ra != 31) { // LDA
+      l->kind[bi - b->ins] = MEMLOOP_INC;
+      l->inc[bi->ra] += (s64)bi->disp;
+      incremented |= ra;
+    } else if (opcode == 0x10 && literal && bi->ra == bi->rc &&
+               bi->ra != 31 && (function == 0x20 || function == 0x29)) {
+      // ADDQ, SUBQ with a literal
+      l->kind[bi - b->ins] = MEMLOOP_INC;
+      l->inc[bi->ra] += (function == 0x20) ? (s64)bi->disp : -(s64)bi->disp;
+      incremented |= ra;
+    } else if (((opcode == 0x11 && function == 0x20) || // BIS
+                (opcode == 0x12 && memloop_byte_op(function))) &&
+               bi->rc != 31) {
+      // The byte manipulation instructions only use the low three bits of
+      // Rb, which must not change as the loop goes round.
+      l->kind[bi - b->ins] = MEMLOOP_OP;
+      l->nops++;
+      used |= ra;
+      if (!literal && opcode == 0x11) {
+        used |= 1U << bi->rb;
+      } else if (!literal) {
+        if (l->inc[bi->rb] & 7)
+          return false;
+        low_bits |= 1U << bi->rb;
+      }
+      computed |= 1U << bi->rc;
+    } else {
+      return false;
+    }
+  }
+
+  // Registers are either loaded or computed, incremented, or left alone;
+  // the base registers are incremented by whole quadwords, and the counter
+  // by something other than zero. Operate instructions only take the low
+  // three bits of incremented registers.
+  if (!l->nmem || ((l->loaded | computed) & (incremented | bases)) ||
+      (values & (l->loaded | computed | incremented)) ||
+      (used & incremented) || !(incremented & (1U << l->cond)) ||
+      !l->inc[l->cond])
+    return false;
+  for (int i = 0; i < l->nmem; i++)
+    if (l->inc[l->mem[i].base] & 7)
+      return false;
+  for (int i = 0; i < 32; i++)
+    if ((low_bits & (1U << i)) && (l->inc[i] & 7))
+      return false;
+
+  l->shape = memloop_shape(l);
+  return true;
+}
+
+/**
+ * \brief Run iterations of a block copy or fill loop at once.
+ *
+ * Called by execute_block() before the block is interpreted. The registers,
+ * memory and instruction count are left exactly as they would have been had
+ * the iterations been interpreted, with the program counter at the start of
+ * the loop again.
+ *
+ * \return true if any iterations were run; false if the next one needs to be
+ *         interpreted.
+ **/
+bool CAlphaCPU::memloop_run(SBlock *b) {
+  SMemLoop *l = &memloops[b - bcache.get()];
+  u8 *host[BCACHE_BLOCK_SIZE];
+  s64 stride[BCACHE_BLOCK_SIZE];
+  s64 c = (s64)state.r[l->cond];
+  s64 inc = l->inc[l->cond];
+  u64 n;
+
+  // Number of iterations after which the branch is still taken. A loop that
+  // would only get there by wrapping around is left alone.
+  switch (l->opcode) {
+  case 0x3d: // BNE
+    if (!c || (c < 0) == (inc < 0) || c == INT64_MIN || c % inc)
+      return false;
+    n = (u64)(c / -inc) - 1;
+    break;
+  case 0x3f: // BGT
+    if (inc > 0 || c <= 0)
+      return false;
+    n = (u64)(c - 1) / (u64)-inc;
+    break;
+  case 0x3e: // BGE
+    if (inc > 0 || c < 0)
+      return false;
+    n = (u64)c / (u64)-inc;
+    break;
+  case 0x3a: // BLT
+    if (inc < 0 || c >= 0)
+      return false;
+    n = ((u64)0 - (u64)c - 1) / (u64)inc;
+    break;
+  default: // BLE
+    if (inc < 0 || c > 0)
+      return false;
+    n = ((u64)0 - (u64)c) / (u64)inc;
+  }
+
+  // clock_tick() must not need to call clock_event() for any of them.
+  u64 event = next_event.load(std::memory_order_relaxed);
+
+  if (state.instruction_count >= event)
+    return false;
+  n = std::min(n, (event - state.instruction_count - 1) / b->count);
+
+  // Every access must stay within the page it is in now, and that page must
+  // be in the soft TLB for it.
+  for (int i = 0; i < l->nmem && n; i++) {
+    u64 a = state.r[l->mem[i].base] + l->mem[i].offset;
+
+    if (l->mem[i].unaligned)
+      a &= ~U64(0x7);
+
+    stride[i] = l->inc[l->mem[i].base];
+    host[i] = stlb_host(a, 7, l->mem[i].store ? ACCESS_WRITE : ACCESS_READ);
+    if (!host[i])
+      return false;
+    if (stride[i] > 0)
+      n = std::min(n, ((a | 0x1fff) - a) / stride[i] + 1);
+    else if (stride[i] < 0)
+      n = std::min(n, (a & 0x1fff) / -stride[i] + 1);
+  }
+  if (!n)
+    return false;
+
+  state.r[31] = 0;
+
+  // A fill or copy whose ranges are contiguous in host memory, and don't
+  // overlap, is done with memset() or memcpy().
+  u8 *dst = nullptr;
+  u8 *src = nullptr;
+  size_t len = (size_t)n * l->inc[l->dst];
+  bool contiguous = (l->shape != MEMLOOP_OTHER);
+
+  for (int i = 0; i < l->nmem && contiguous; i++) {
+    u8 *p = host[i] - l->mem[i].offset;
+    u8 *&start = l->mem[i].store ? dst : src;
+
+    p += l->mem[i].store ? l->dst_lo : l->src_lo;
+    contiguous = (!start || start == p);
+    start = p;
+  }
+  if (contiguous && src && src < dst + len && dst < src + len)
+    contiguous = false;
+
+  if (contiguous && !src) {
+    u64 v = state.r[l->mem[0].data];
+
+    if (v == (v & 0xff) * U64(0x0101010101010101)) {
+      memset(dst, (int)(v & 0xff), len);
+    } else {
+      v = endian_64(v);
+      for (size_t i = 0; i < len; i += 8)
+        memcpy(dst + i, &v, 8);
+    }
+  } else if (contiguous) {
+    memcpy(dst, src, len);
+    for (int i = 0; i < l->nmem; i++)
+      if (!l->mem[i].store)
+        state.r[l->mem[i].data] =
+            endian_64(*(u64 *)(host[i] + (n - 1) * stride[i]));
+  } else if (l->nops) {
+    // The operate instructions are run through their handlers, in program
+    // order with the accesses; the increments are all done afterwards, which
+    // the operate instructions cannot tell.
+    for (u64 k = 0; k < n; k++) {
+      int i = 0;
+
+      for (int j = 0; j < b->count - 1; j++) {
+        SBlockIns *bi = &b->ins[j];
+
+        if (l->kind[j] == MEMLOOP_OP) {
+          (this->*bi->handler)(bi);
+        } else if (l->kind[j] == MEMLOOP_MEM) {
+          u64 *p = (u64 *)(host[i] + (s64)k * stride[i]);
+
+          if (l->mem[i].store)
+            *p = endian_64(state.r[l->mem[i].data]);
+          else
+            state.r[l->mem[i].data] = endian_64(*p);
+          i++;
+        }
+      }
+      state.r[31] = 0;
+    }
+  } else {
+    for (u64 k = 0; k < n; k++) {
+      for (int i = 0; i < l->nmem; i++) {
+        u64 *p = (u64 *)(host[i] + (s64)k * stride[i]);
+
+        if (l->mem[i].store)
+          *p = endian_64(state.r[l->mem[i].data]);
+        else
+          state.r[l->mem[i].data] = endian_64(*p);
+      }
+    }
+  }
+
+  // Tell the system what was stored, for LDx_L reservations and cached code.
+  for (int i = 0; i < l->nmem; i++) {
+    if (!l->mem[i].store)
+      continue;
+    if (contiguous) {
+      cSystem->dma_stored(cSystem->MemToPhys(dst), len, this);
+      break;
+    }
+    u8 *p = host[i];
+    size_t size =
+        (size_t)(n - 1) * (size_t)(stride[i] < 0 ? -stride[i] : stride[i]) + 8;
+
+    if (stride[i] < 0)
+      p -= size - 8;
+    cSystem->dma_stored(cSystem->MemToPhys(p), size, this);
+  }
+
+  for (int i = 0; i < 31; i++)
+    state.r[i] += n * l->inc[i];
+  state.instruction_count += n * b->count;
+  state.current_pc = b->pc + 4 * (b->count - 1);
+  return true;
+}
+#endif
@@ -0,0 +1,316 @@
+/* AXPbox Alpha Emulator
+ * Copyright (C) 2020 Tomáš Glozar
+ * Website: https://github.com/lenticularis39/axpbox
+ *
+ * Forked from: ES40 emulator
+ * Copyright (C) 2007-2008 by the ES40 Emulator Project
+ * Copyright (C) 2007 by Camiel Vanderhoeven
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301,
+ * USA.
+ *
+ * Although this is not required, the author would appreciate being notified of,
+ * and receiving any modifications you may make to the source code that might
+ * serve the general public.
+ */
+
+#include "AlphaCPU.hpp"
+#include "StdAfx.hpp"
+
+/***********************************************************
+ *                                                         *
+ *                    OSF/1 PALcode                        *
+ *                                                         *
+ ***********************************************************/
+
+/*
+ * Unlike the VMS PALcode replacement in AlphaCPU_vmspal.cpp, which was
+ * written against one particular PALcode image, the calls below only rely on
+ * what the OSF/1 PALcode interface defines: the PCBB passed to SWPPAL and
+ * SWPCTX, the layout of the hardware PCB, and the TB invalidations TBI asks
+ * for. Whether the PALcode that is running actually agrees is checked at run
+ * time: each call is run through the PALcode OSFPAL_CHECK_CALLS times
+ * first, and the result is compared with the one predicted here. Only when
+ * all of them match is the call handled natively from then on; a single
+ * mismatch leaves it to the PALcode for good. The results are kept for as
+ * long as the CALL_PAL entry points of the PALcode (identified by a
+ * checksum) stay the same.
+ *
+ * The other frequent calls (SWPIPL, RDPS, RDUSP, WRVAL, SWPCTX, CALLSYS,
+ * RTI, RETSYS) are left to the PALcode. They read or write the PS, the
+ * stack pointers and other state that the PALcode keeps wherever it likes,
+ * and that the emulator can't find or keep in step with it without knowing
+ * the image.
+ */
+
+/// Native call numbers, indexes into osfpal_trust.
+#define OSFPAL_WHAMI 0
+#define OSFPAL_RDUNIQUE 1
+#define OSFPAL_WRUNIQUE 2
+#define OSFPAL_TBI 3
+
+/// Offset of the process unique value in the OSF/1 hardware PCB.
+#define OSFPAL_PCB_UNIQUE 0x20
+
+/// Effects of TBI, as seen in the IPR writes done by the PALcode.
+#define OSFPAL_TB_IA_I 0x01  /**< ITB_IA */
+#define OSFPAL_TB_IA_D 0x02  /**< DTB_IA */
+#define OSFPAL_TB_IAP_I 0x04 /**< ITB_IAP */
+#define OSFPAL_TB_IAP_D 0x08 /**< DTB_IAP */
+#define OSFPAL_TB_IS_I 0x10  /**< ITB_IS of the address passed */
+#define OSFPAL_TB_IS_D 0x20  /**< DTB_IS0 or DTB_IS1 of that address */
+#define OSFPAL_TB_OTHER 0x40 /**< Anything else, including stores */
+
+static const char *osfpal_name[OSFPAL_CALLS] = {"WHAMI", "RDUNIQUE",
+                                                "WRUNIQUE", "TBI"};
+
+/**
+ * \brief Effects of TBI with a given type (R16), or 0 for an unknown type.
+ **/
+static int osfpal_tbi_effects(u64 type) {
+  switch ((s64)type) {
+  case -2: // TBIA
+    return OSFPAL_TB_IA_I | OSFPAL_TB_IA_D;
+  case -1: // TBIAP
+    return OSFPAL_TB_IAP_I | OSFPAL_TB_IAP_D;
+  case 1: // TBISI
+    return OSFPAL_TB_IS_I;
+  case 2: // TBISD
+    return OSFPAL_TB_IS_D;
+  case 3: // TBIS
+    return OSFPAL_TB_IS_I | OSFPAL_TB_IS_D;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * \brief Watch SWPPAL and SWPCTX for the current PCBB.
+ *
+ * Called for CALL_PAL SWPPAL (0x0a) and OSF/1 SWPCTX (0x30) before they are
+ * run by the PALcode.
+ * SWPPAL to the OSF/1 PALcode (R16 = 2) passes the physical address of the
+ * initial PCB in R18; OSF/1 SWPCTX passes the new one in R16.
+ **/
+void CAlphaCPU::osfpal_swap(int function) {
+  osfpal_pending = -1;
+  if (function == 0x0a) { // SWPPAL
+    osfpal_active = (state.r[16] == 2);
+    osfpal_pcbb = osfpal_active ? state.r[18] : 1;
+  } else if (osfpal_active) { // SWPCTX
+    osfpal_pcbb = state.r[16];
+  }
+}
+
+/**
+ * \brief Identify the OSF/1 PALcode that is running.
+ *
+ * Computes a checksum of the CALL_PAL entry points at the current PALcode
+ * base. If it differs from that of the PALcode the calls were checked
+ * against so far, the checks start over.
+ **/
+void CAlphaCPU::osfpal_recognize() {
+  u64 a = state.pal_base + 0x2000;
+  u32 sum = 0;
+
+  osfpal_base = state.pal_base;
+  for (int i = 0; i < 0x2000; i += 4)
+    sum = ((sum << 5) | (sum >> 27)) ^ (u32)cSystem->ReadMem(a + i, 32, this);
+
+  if (sum == osfpal_sum)
+    return;
+
+  printf("%s: OSF/1 PALcode at %" PRIx64 ", checksum %08x.\n", devid_string,
+         state.pal_base, sum);
+  osfpal_sum = sum;
+  for (int i = 0; i < OSFPAL_CALLS; i++)
+    osfpal_trust[i] = 0;
+}
+
+/**
+ * \brief Run an OSF/1 PALcode call natively.
+ *
+ * Called from DO_CALL_PAL while the OSF/1 PALcode is running.
+ *
+ * \return true if the call was done; false if the PALcode needs to run it.
+ *         In the latter case the result is predicted, and checked by
+ *         osfpal_returned() when the PALcode returns.
+ **/
+bool CAlphaCPU::osfpal_call(int function) {
+  int i;
+  u64 result;
+
+  switch (function) {
+  case 0x3c:
+    i = OSFPAL_WHAMI;
+    break;
+  case 0x9e:
+    i = OSFPAL_RDUNIQUE;
+    break;
+  case 0x9f:
+    i = OSFPAL_WRUNIQUE;
+    break;
+  case 0x33:
+    i = OSFPAL_TBI;
+    break;
+  default:
+    return false;
+  }
+
+  if (state.pal_base != osfpal_base)
+    osfpal_recognize();
+  if (osfpal_trust[i] < 0 ||
+      ((i == OSFPAL_RDUNIQUE || i == OSFPAL_WRUNIQUE) && (osfpal_pcbb & 1)))
+    return false;
+
+  switch (i) {
+  case OSFPAL_WHAMI:
+    result = state.iProcNum;
+    break;
+  case OSFPAL_RDUNIQUE:
+    result = cSystem->ReadMem(osfpal_pcbb + OSFPAL_PCB_UNIQUE, 64, this);
+    break;
+  case OSFPAL_TBI:
+    result = osfpal_tbi_effects(state.r[16]);
+    if (!result)
+      return false;
+    break;
+  default:
+    result = state.r[16];
+  }
+
+  if (osfpal_trust[i] < OSFPAL_CHECK_CALLS || osfpal_check) {
+    osfpal_pending = i;
+    osfpal_ret = state.pc;
+    osfpal_expect = result;
+    if (i == OSFPAL_TBI) {
+      osfpal_va = state.r[17];
+      osfpal_seen = 0;
+      memcpy(osfpal_r, state.r, sizeof(osfpal_r));
+    }
+    return false;
+  }
+
+  switch (i) {
+  case OSFPAL_WRUNIQUE:
+    cSystem->WriteMem(osfpal_pcbb + OSFPAL_PCB_UNIQUE, 64, result, this);
+    break;
+  case OSFPAL_TBI:
+    if (result & OSFPAL_TB_IA_I)
+      tbia(ACCESS_EXEC);
+    if (result & OSFPAL_TB_IA_D)
+      tbia(ACCESS_READ);
+    if (result & OSFPAL_TB_IAP_I)
+      tbiap(ACCESS_EXEC);
+    if (result & OSFPAL_TB_IAP_D)
+      tbiap(ACCESS_READ);
+    if (result & OSFPAL_TB_IS_I)
+      tbis(state.r[17], ACCESS_EXEC);
+    if (result & OSFPAL_TB_IS_D)
+      tbis(state.r[17], ACCESS_READ);
+    break;
+  default:
+    state.r[0] = result;
+  }
+  return true;
+}
+
+/**
+ * \brief Record what the PALcode does while a TBI call is checked.
+ *
+ * Called for every HW_MTPR (\a ipr is the IPR index, \a value what is
+ * written), and for every HW_ST (\a ipr is -1), while a call started by
+ * osfpal_call() is pending.
+ **/
+void CAlphaCPU::osfpal_effect(int ipr, u64 value) {
+  int effect;
+
+  if (osfpal_pending != OSFPAL_TBI)
+    return;
+
+  switch (ipr) {
+  case 0x03: // ITB_IA
+    effect = OSFPAL_TB_IA_I;
+    break;
+  case 0xa3: // DTB_IA
+    effect = OSFPAL_TB_IA_D;
+    break;
+  case 0x02: // ITB_IAP
+    effect = OSFPAL_TB_IAP_I;
+    break;
+  case 0xa2: // DTB_IAP
+    effect = OSFPAL_TB_IAP_D;
+    break;
+  case 0x04: // ITB_IS
+    effect = OSFPAL_TB_IS_I;
+    break;
+  case 0x24: // DTB_IS0
+  case 0xa4: // DTB_IS1
+    effect = OSFPAL_TB_IS_D;
+    break;
+  default:
+    effect = OSFPAL_TB_OTHER;
+  }
+
+  if ((effect & (OSFPAL_TB_IS_I | OSFPAL_TB_IS_D)) &&
+      ((value ^ osfpal_va) >> 13))
+    effect = OSFPAL_TB_OTHER;
+  osfpal_seen |= effect;
+}
+
+/**
+ * \brief Check the result of an OSF/1 PALcode call.
+ *
+ * Called on HW_RET while a call started by osfpal_call() is pending. The
+ * check is done once the PALcode returns to the instruction after the
+ * CALL_PAL; if it leaves PALmode elsewhere, the call is not counted.
+ **/
+void CAlphaCPU::osfpal_returned() {
+  int i = osfpal_pending;
+  u64 result;
+
+  if (state.pc & 1)
+    return;
+
+  osfpal_pending = -1;
+  if (state.pc != osfpal_ret)
+    return;
+
+  if (i == OSFPAL_WRUNIQUE) {
+    result = cSystem->ReadMem(osfpal_pcbb + OSFPAL_PCB_UNIQUE, 64, this);
+  } else if (i == OSFPAL_TBI) {
+    // R0 is not looked at; the native call leaves it alone, and the OS
+    // can't expect anything in it.
+    result = osfpal_seen;
+    if (memcmp(osfpal_r + 1, state.r + 1, sizeof(osfpal_r) - 8))
+      result |= OSFPAL_TB_OTHER;
+  } else {
+    result = state.r[0];
+  }
+
+  if (result != osfpal_expect) {
+    printf("%s: OSF/1 PALcode %s returned %016" PRIx64
+           ", expected %016" PRIx64 "; leaving it to the PALcode.\n",
+           devid_string, osfpal_name[i], result, osfpal_expect);
+    osfpal_trust[i] = -1;
+    return;
+  }
+
+  if (osfpal_trust[i] == OSFPAL_CHECK_CALLS)
+    return;
+  if (++osfpal_trust[i] == OSFPAL_CHECK_CALLS && !osfpal_check)
+    printf("%s: OSF/1 PALcode %s checked; running it natively.\n",
+           devid_string, osfpal_name[i]);
+}
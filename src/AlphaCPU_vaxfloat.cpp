@@ -56,6 +56,17 @@
 #include "StdAfx.hpp"
 #include "cpu_debug.hpp"
 
+#include <cfloat>
+#include <cmath>
+#include <cstring>
+
+/* F and G arithmetic can be done on host float and double values only if
+   the host evaluates those in their own precision (no x87 excess
+   precision). */
+#if defined(FLT_EVAL_METHOD) && (FLT_EVAL_METHOD == 0)
+#define VAX_HOST_FP
+#endif
+
 #define IPMAX U64(0x7FFFFFFFFFFFFFFF) /* plus MAX (int) */
 #define IMMAX U64(0x8000000000000000) /* minus MAX (int) */
 
@@ -64,6 +75,15 @@
 #define UF_DRND U64(0x0000000000000080) /* D round */
 #define UF_GRND U64(0x0000000000000400) /* G round */
 
+/* Operations for vax_host */
+#define VAX_HOST_ADD 0
+#define VAX_HOST_MUL 1
+#define VAX_HOST_DIV 2
+#define VAX_HOST_SQRT 3
+
+/* Register format exponent minus IEEE T exponent of the same value */
+#define VAX_HOST_EXP U64(0x0020000000000000)
+
 /***************************************************************************/
 
 /**
@@ -249,6 +269,155 @@ u64 CAlphaCPU::vax_cvtfi(u64 op, u32 ins) {
   return (a.sign ? NEG_Q(a.frac) : a.frac);
 }
 
+/**
+ * \brief Check if a VAX value can be handled by vax_host.
+ *
+ * F-floating values must convert to a normal host float above the smallest
+ * normal, with the low fraction bits clear. G-floating values must be well
+ * above the underflow threshold of a host double, so that the error terms
+ * computed by vax_host are representable.
+ *
+ * \param exp Register format exponent of the value.
+ * \param op  64-bit VAX floating in register format.
+ * \param dp  DT_F for F-floating or DT_G for G-floating.
+ * \return    True if op is in the range vax_host handles.
+ **/
+static inline bool vax_host_range(u32 exp, u64 op, u32 dp) {
+  if (dp == DT_G)
+    return (exp >= 0x42) && (exp <= G_M_EXP);
+  return (exp >= G_BIAS - F_BIAS + 4) && (exp <= G_BIAS - F_BIAS + F_M_EXP) &&
+         !(op & U64(0x1fffffff));
+}
+
+/**
+ * \brief Do a VAX arithmetic operation with host floating point.
+ *
+ * Within the range checked by vax_host_range, an F- or G-floating value is
+ * exactly a host float or double with the exponent lowered by 2, and the
+ * operation can neither overflow nor underflow. The host rounds to nearest
+ * even; the rounding error is computed exactly (TwoSum for add, a fused
+ * multiply-add or a double-precision product for the others) and used to
+ * turn that into the VAX chopped (/C) or round-half-away-from-zero result.
+ * Division and square root never produce a result exactly halfway.
+ *
+ * Reserved operands, zeroes and results outside the range are left to the
+ * software routines.
+ *
+ * \param s1  First operand in 64-bit VAX floating register format.
+ * \param s2  Second operand (ignored for VAX_HOST_SQRT).
+ * \param ins The instruction currently being executed. Used to determine the
+ *            rounding mode.
+ * \param dp  DT_F for F-floating or DT_G for G-floating.
+ * \param op  VAX_HOST_ADD, _MUL, _DIV or _SQRT.
+ * \param res Pointer to where the result is to be returned.
+ * \return    True if the result was computed, false if the software routine
+ *            has to be used.
+ **/
+bool CAlphaCPU::vax_host(u64 s1, u64 s2, u32 ins, u32 dp, int op, u64 *res) {
+#if defined(VAX_HOST_FP)
+  double a;
+  double b;
+  double c;
+  double lo;   /* exact result - c, times a positive factor */
+  double half; /* half an ulp of c, for add and multiply */
+  u64 r;
+
+  if (!host_fp_enabled)
+    return false;
+  if (!vax_host_range(FPR_GETEXP(s1), s1, dp))
+    return false;
+  if (op == VAX_HOST_SQRT) {
+    if (FPR_GETSIGN(s1))
+      return false;
+  } else if (!vax_host_range(FPR_GETEXP(s2), s2, dp))
+    return false;
+
+  s1 = s1 - VAX_HOST_EXP;
+  s2 = s2 - VAX_HOST_EXP;
+  memcpy(&a, &s1, sizeof(u64));
+  memcpy(&b, &s2, sizeof(u64));
+
+  if (dp == DT_G) {
+    switch (op) {
+    case VAX_HOST_ADD:
+      c = a + b;
+      lo = c - a;
+      lo = (a - (c - lo)) + (b - lo);
+      break;
+    case VAX_HOST_MUL:
+      c = a * b;
+      lo = std::fma(a, b, -c);
+      break;
+    case VAX_HOST_DIV:
+      c = a / b;
+      lo = std::fma(-c, b, a);
+      if (b < 0)
+        lo = -lo;
+      break;
+    default:
+      c = std::sqrt(a);
+      lo = std::fma(-c, c, a);
+      break;
+    }
+
+    memcpy(&r, &c, sizeof(u64));
+    r = ((r >> FPR_V_EXP) - 53) << FPR_V_EXP; /* ulp(c) / 2 */
+  } else {
+    float fa = (float)a; /* exact, low bits are zero */
+    float fb = (float)b;
+    float fc;
+    float fe;
+    u32 fr;
+    switch (op) {
+    case VAX_HOST_ADD:
+      fc = fa + fb;
+      fe = fc - fa;
+      lo = (fa - (fc - fe)) + (fb - fe);
+      break;
+    case VAX_HOST_MUL:
+      fc = fa * fb;
+      lo = a * b - fc; /* product is exact in double */
+      break;
+    case VAX_HOST_DIV:
+      fc = fa / fb;
+      lo = a - (double)fc * b;
+      if (b < 0)
+        lo = -lo;
+      break;
+    default:
+      fc = std::sqrt(fa);
+      lo = a - (double)fc * fc;
+      break;
+    }
+
+    c = fc;
+    memcpy(&r, &c, sizeof(u64));
+    r = ((r >> FPR_V_EXP) - 24) << FPR_V_EXP; /* ulp(c) / 2 */
+  }
+
+  memcpy(&half, &r, sizeof(u64));
+  half = std::fabs(half);
+  memcpy(&r, &c, sizeof(u64));
+
+  if (lo != 0) {
+    if (!I_GETFRND(ins)) { /* chopped? */
+      if ((lo < 0) != (c < 0))
+        r = r - ((dp == DT_G) ? 1 : U64(0x20000000)); /* c too large */
+    } else if (((lo < 0) == (c < 0)) && (std::fabs(lo) == half) &&
+               ((op == VAX_HOST_ADD) || (op == VAX_HOST_MUL))) {
+      r = r + ((dp == DT_G) ? 1 : U64(0x20000000)); /* tie, round away */
+    }
+  }
+
+  if (!vax_host_range(FPR_GETEXP(r) + 2, r, dp))
+    return false;
+  *res = r + VAX_HOST_EXP;
+  return true;
+#else
+  return false;
+#endif
+}
+
 /**
  * \brief Add or subtract 2 VAX floating-point values.
  *
@@ -268,6 +437,10 @@ u64 CAlphaCPU::vax_fadd(u64 s1, u64 s2, u32 ins, u32 dp, bool sub) {
   UFP t;
   u32 sticky;
   s32 ediff;
+  u64 res;
+
+  if (vax_host(s1, sub ? s2 ^ FPR_SIGN : s2, ins, dp, VAX_HOST_ADD, &res))
+    return res;
 
   vax_unpack(s1, &a, ins);
   vax_unpack(s2, &b, ins);
@@ -329,6 +502,10 @@ u64 CAlphaCPU::vax_fmul(u64 s1, u64 s2, u32 ins, u32 dp) {
   UFP a;
 
   UFP b;
+  u64 res;
+
+  if (vax_host(s1, s2, ins, dp, VAX_HOST_MUL, &res))
+    return res;
 
   vax_unpack(s1, &a, ins);
   vax_unpack(s2, &b, ins);
@@ -359,6 +536,10 @@ u64 CAlphaCPU::vax_fdiv(u64 s1, u64 s2, u32 ins, u32 dp) {
   UFP a;
 
   UFP b;
+  u64 res;
+
+  if (vax_host(s1, s2, ins, dp, VAX_HOST_DIV, &res))
+    return res;
 
   vax_unpack(s1, &a, ins);
   vax_unpack(s2, &b, ins);
@@ -389,6 +570,10 @@ u64 CAlphaCPU::vax_fdiv(u64 s1, u64 s2, u32 ins, u32 dp) {
  **/
 u64 CAlphaCPU::vax_sqrt(u64 op, u32 ins, u32 dp) {
   UFP b;
+  u64 res;
+
+  if (vax_host(op, 0, ins, dp, VAX_HOST_SQRT, &res))
+    return res;
 
   vax_unpack(op, &b, ins);
   if (b.exp == 0)
@@ -398,8 +583,8 @@ u64 CAlphaCPU::vax_sqrt(u64 op, u32 ins, u32 dp) {
     return 0;
   }
 
-  b.exp = ((b.exp + 1 - G_BIAS) >> 1) + G_BIAS; /* result exponent */
   b.frac = fsqrt64(b.frac, b.exp);              /* result fraction */
+  b.exp = ((b.exp + 1 - G_BIAS) >> 1) + G_BIAS; /* result exponent */
   return vax_rpack(&b, ins, dp);                /* round and pack */
 }
 
@@ -551,6 +736,8 @@ u64 CAlphaCPU::vax_rpack(UFP *r, u32 ins, u32 dp) {
     }
   }
 
+  r->frac = r->frac & ~((roundbit[dp] << 1) - 1); /* drop round bits */
+
   if (r->exp > expmax[dp]) { /* ovflo? */
     vax_trap(TRAP_OVF, ins); /* set trap */
     r->exp = expmax[dp];
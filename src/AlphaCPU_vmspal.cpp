@@ -199,15 +199,17 @@ void CAlphaCPU::vmspal_call_swpctx() {
   state.asn0 = (int)p6;
   state.asn1 = (int)p6;
   state.asn = (int)p6;
+  stlb_flush();
   state.aster = (int)p4 & 0xf;
   state.astrr = (int)(p4 >> 4) & 0xf;
   state.fpen = (int)p5 & 1;
   state.ppcen = (int)(p5 >> 0x3e) & 1;
-  state.check_int = true;
+  set_check_int();
 
   hw_ldq(r16 + 0x40, p7);
   hw_ldq(r16 + 0x20, p6);
 
+  sync_clock();
   p4 = (state.cc & U64(0xffffffff)) + state.cc_offset;
   state.cc_offset = ((u32)p7 & 0xffffffff) - (state.cc & U64(0xffffffff));
 
@@ -235,7 +237,7 @@ void CAlphaCPU::vmspal_call_mtpr_asten() {
   r0 = state.aster;
   state.aster &= r16;
   state.aster |= (r16 >> 4) & 0xf;
-  state.check_int = true;
+  set_check_int();
 }
 
 /**
@@ -245,7 +247,7 @@ void CAlphaCPU::vmspal_call_mtpr_astsr() {
   r0 = state.astrr;
   state.astrr &= r16;
   state.astrr |= (r16 >> 4) & 0xf;
-  state.check_int = true;
+  set_check_int();
 }
 
 /**
@@ -335,7 +337,7 @@ void CAlphaCPU::vmspal_call_mtpr_ipl() {
   state.pcen = ipl_ier_mask[r16][3];
   state.sien = ipl_ier_mask[r16][4];
   state.asten = ipl_ier_mask[r16][5];
-  state.check_int = true;
+  set_check_int();
 }
 
 /**
@@ -396,7 +398,7 @@ void CAlphaCPU::vmspal_call_mtpr_scbb() {
 void CAlphaCPU::vmspal_call_mtpr_sirr() {
   if (r16 > 0 && r16 < 16) {
     state.sir |= 1 << r16;
-    state.check_int = true;
+    set_check_int();
   }
 }
 
@@ -652,6 +654,7 @@ int CAlphaCPU::vmspal_call_rei() {
     p20 &= 0xffff;
     p22 &= ~U64(0xffff);
     state.cm = (int)(p4 >> 3) & 3;
+    stlb_flush();
     p22 |= p20;
     p23 &= ~U64(0x3);
     p20 = r30 + 0x40;
@@ -678,6 +681,7 @@ int CAlphaCPU::vmspal_call_rei() {
     hw_ldq(p21 + 0x10, p7);
     p7 += p4;
     state.cm = (int)(p4 >> 3) & 3;
+    stlb_flush();
     p5 = (p20 >> 56) & 0xff;
     p20 &= 0xff;
     p22 &= ~U64(0xffff);
@@ -693,7 +697,7 @@ int CAlphaCPU::vmspal_call_rei() {
     state.pcen = ipl_ier_mask[0][3];
     state.sien = ipl_ier_mask[0][4];
     state.asten = ipl_ier_mask[0][5];
-    state.check_int = true;
+    set_check_int();
     set_pc(p23);
     return 0;
   }
@@ -712,7 +716,7 @@ int CAlphaCPU::vmspal_call_rei() {
   state.pcen = ipl_ier_mask[p7][3];
   state.sien = ipl_ier_mask[p7][4];
   state.asten = ipl_ier_mask[p7][5];
-  state.check_int = true;
+  set_check_int();
   set_pc(p23);
   return 0;
 }
@@ -724,7 +728,7 @@ void CAlphaCPU::vmspal_call_swasten() {
   r0 = (state.aster & (1 << ((p22 >> 3) & 3))) ? 1 : 0;
   if (r16 & 1) {
     state.aster |= (1 << ((p22 >> 3) & 3));
-    state.check_int = true;
+    set_check_int();
   } else
     state.aster &= ~(1 << ((p22 >> 3) & 3));
 }
@@ -742,6 +746,7 @@ void CAlphaCPU::vmspal_call_wr_ps_sw() {
  **/
 void CAlphaCPU::vmspal_call_rscc() {
   hw_ldq(p21 + 0xa0, r0);
+  sync_clock();
   if ((state.cc & U64(0xffffffff)) < (r0 & U64(0x00000000ffffffff)))
     r0 += U64(0x1) << 0x20;
   r0 &= U64(0xffffffff00000000);
@@ -790,6 +795,7 @@ int CAlphaCPU::vmspal_int_initiate_exception() {
 
     // change mode to kernel
     state.cm = 0;
+    stlb_flush();
 
     // switch to kernel stack
     p20 += p4;
@@ -841,6 +847,7 @@ int CAlphaCPU::vmspal_int_initiate_interrupt() {
 
     // change mode to kernel
     state.cm = 0;
+    stlb_flush();
 
     // switch to kernel stack
     p20 += p4;
@@ -921,7 +928,7 @@ int CAlphaCPU::vmspal_ent_sw_int(int si) {
   state.pcen = ipl_ier_mask[x][3];
   state.sien = ipl_ier_mask[x][4];
   state.asten = ipl_ier_mask[x][5];
-  state.check_int = true;
+  set_check_int();
   p20 = (u64)x << 8;
   p20 |= 4;
   hw_stq(p21 + 0x128, p20);
@@ -947,6 +954,7 @@ int CAlphaCPU::vmspal_ent_ext_int(int ei) {
     p22 &= U64(0xffff0fffffffffff);
 
     hw_ldq(p21 + 0xa0, p20);
+    sync_clock();
     p6 = U64(0x1) << 0x20;
     p4 = (state.cc & U64(0xffffffff));
     p5 = p20 & U64(0xffffffff);
@@ -1028,7 +1036,7 @@ int CAlphaCPU::vmspal_ent_ext_int(int ei) {
     state.pcen = ipl_ier_mask[p7][3];
     state.sien = ipl_ier_mask[p7][4];
     state.asten = ipl_ier_mask[p7][5];
-    state.check_int = true;
+    set_check_int();
     p20 = p7 << 8;
     p20 |= 4;
     hw_stq(p21 + 0x128, p20);
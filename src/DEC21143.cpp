@@ -1002,6 +1002,7 @@ int CDEC21143::dec21143_rx() {
   int buf1_size;
   int buf2_size;
   int to_xfer;
+  SPCI_dma_map buf_map;
 
   /*  Is current packet finished? Then check for new ones.  */
   if (state.rx.current.used >= state.rx.current.len) {
@@ -1075,8 +1076,10 @@ int CDEC21143::dec21143_rx() {
       to_xfer = buf1_size;
 
     // DMA bytes from the packet into buffer 1
-    do_pci_write(rdes2, &state.rx.current.frame[state.rx.current.used], 1,
-                 to_xfer);
+    pci_dma_map(rdes2, to_xfer, &buf_map);
+    pci_dma_write(&buf_map, 0, &state.rx.current.frame[state.rx.current.used],
+                  to_xfer);
+    pci_dma_unmap(&buf_map);
 
     // update used
     state.rx.current.used += to_xfer;
@@ -1089,8 +1092,10 @@ int CDEC21143::dec21143_rx() {
       to_xfer = buf2_size;
 
     // DMA bytes from the packet into buffer 2
-    do_pci_write(rdes3, state.rx.current.frame + state.rx.current.used, 1,
-                 to_xfer);
+    pci_dma_map(rdes3, to_xfer, &buf_map);
+    pci_dma_write(&buf_map, 0, state.rx.current.frame + state.rx.current.used,
+                  to_xfer);
+    pci_dma_unmap(&buf_map);
 
     // update used
     state.rx.current.used += to_xfer;
@@ -1142,6 +1147,9 @@ int CDEC21143::dec21143_tx() {
 
   u32 bufaddr;
   unsigned char descr[16];
+  SPCI_dma_map descr_map;
+  SPCI_dma_map buf_map;
+  u8 *frame;
   u32 tdes0;
   u32 tdes1;
   u32 tdes2;
@@ -1153,7 +1161,8 @@ int CDEC21143::dec21143_tx() {
   if (state.tx.suspend)
     return 0;
 
-  do_pci_read(addr, descr, 1, 16);
+  pci_dma_map(addr, 16, &descr_map);
+  pci_dma_read(&descr_map, 0, descr, 16);
 
   tdes0 = descr[0] + (descr[1] << 8) + (descr[2] << 16) + (descr[3] << 24);
   tdes1 = descr[4] + (descr[5] << 8) + (descr[6] << 16) + (descr[7] << 24);
@@ -1171,6 +1180,7 @@ int CDEC21143::dec21143_tx() {
       state.tx.idling = 0;
     } else
       state.tx.idling++;
+    pci_dma_unmap(&descr_map);
     return 0;
   }
 
@@ -1250,10 +1260,21 @@ int CDEC21143::dec21143_tx() {
       // state.tx.cur_buf_len + bufsize), unsigned char);
     }
 
-    /*  "DMA" data from emulated physical memory into the buf:  */
-    do_pci_read(bufaddr, state.tx.cur_buf + state.tx.cur_buf_len, 1, bufsize);
-
-    state.tx.cur_buf_len += bufsize;
+    /*  A frame in one piece of main memory is sent from there; others are
+        "DMA"ed from emulated physical memory into the buf:  */
+    pci_dma_map(bufaddr, bufsize, &buf_map);
+    if ((tdes1 & TDCTL_Tx_FS) && (tdes1 & TDCTL_Tx_LS) &&
+        !((buf2_size > 0) && (!(tdes1 & TDCTL_CH))) && buf_map.in_memory &&
+        buf_map.iov.size() == 1) {
+      frame = buf_map.iov[0].base;
+      state.tx.cur_buf_len = bufsize;
+    } else {
+      pci_dma_read(&buf_map, 0, state.tx.cur_buf + state.tx.cur_buf_len,
+                   bufsize);
+      pci_dma_unmap(&buf_map);
+      frame = state.tx.cur_buf;
+      state.tx.cur_buf_len += bufsize;
+    }
 
 /* only partial frames were written to the pcap filter, because the second
  * buffer was not considered when collecting the ethernet frames in dec21143_tx.
@@ -1264,7 +1285,10 @@ int CDEC21143::dec21143_tx() {
  * tdes3 to the current frame.
  */
     if ((buf2_size > 0) && (!(tdes1 & TDCTL_CH))) {
-      do_pci_read(tdes3, state.tx.cur_buf + state.tx.cur_buf_len, 1, buf2_size);
+      pci_dma_map(tdes3, buf2_size, &buf_map);
+      pci_dma_read(&buf_map, 0, state.tx.cur_buf + state.tx.cur_buf_len,
+                   buf2_size);
+      pci_dma_unmap(&buf_map);
       state.tx.cur_buf_len += buf2_size;
     }
 
@@ -1277,7 +1301,7 @@ int CDEC21143::dec21143_tx() {
       if (!(state.reg[CSR_OPMODE / 8] & OPMODE_OM_INTLOOP)) {
 
         // printf("pcap send: %d bytes   \n", state.tx.cur_buf_len);
-        if (pcap_sendpacket(fp, state.tx.cur_buf, state.tx.cur_buf_len))
+        if (pcap_sendpacket(fp, frame, state.tx.cur_buf_len))
           printf("Error sending the packet: %s\n", pcap_geterr(fp));
       }
 
@@ -1297,8 +1321,7 @@ int CDEC21143::dec21143_tx() {
         //      printf("%02x-",*aptr++);
         //}
         // printf("|\n");
-        rx_queue->add_tail(state.tx.cur_buf, state.tx.cur_buf_len, calc_crc,
-                           crc);
+        rx_queue->add_tail(frame, state.tx.cur_buf_len, calc_crc, crc);
       }
 
       // free(state.tx.cur_buf);
@@ -1310,6 +1333,10 @@ int CDEC21143::dec21143_tx() {
         state.reg[CSR_STATUS / 8] |= STATUS_TI;
     }
 
+    /*  A frame sent straight from main memory is done with it now:  */
+    if (frame != state.tx.cur_buf)
+      pci_dma_unmap(&buf_map);
+
     /*  We are done with this segment.  */
     tdes0 &= ~TDSTAT_OWN;
   }
@@ -1337,7 +1364,8 @@ int CDEC21143::dec21143_tx() {
   descr[14] = (u8)(tdes3 >> 16);
   descr[15] = (u8)(tdes3 >> 24);
 
-  do_pci_write(addr, descr, 1, 16);
+  pci_dma_write(&descr_map, 0, descr, 16);
+  pci_dma_unmap(&descr_map);
 
   return 1;
 }
@@ -633,6 +633,7 @@ void CPCIDevice::do_pci_write(u32 address, void *source, size_t element_size,
 
       if (memptr) {
         memcpy(memptr, src, chunk);
+        cSystem->dma_stored(cur_phys, chunk, this);
       } else {
         for (el = 0; el < chunk; el++)
           cSystem->WriteMem(cur_phys + el, 8, (u8)src[el], this);
@@ -675,3 +676,135 @@ void CPCIDevice::do_pci_write(u32 address, void *source, size_t element_size,
     FAILURE(InvalidArgument, "Strange element size");
   }
 }
+
+/**
+ * \brief Map a range of PCI bus addresses for DMA.
+ *
+ * Translates len bytes at PCI address through the Pchip into the runs of
+ * system address space they cover, so that the device can move data
+ * straight between guest memory and its own buffers, or a disk image or
+ * network interface, instead of going through ReadMem/WriteMem or a bounce
+ * buffer. Adjacent pages that are also adjacent in system memory end up in
+ * one run. Runs outside main memory (MMIO, or addresses no window matches)
+ * have a NULL base; pci_dma_read() and pci_dma_write() handle those with
+ * ReadMem and WriteMem.
+ *
+ * Returns true if all of the range is in main memory.
+ *
+ * A device that stores into the mapped memory itself must report that with
+ * pci_dma_dirty(), so that CPU reservations and instruction cache lines on
+ * those bytes are dropped. Call pci_dma_unmap() when the transfer is done.
+ **/
+bool CPCIDevice::pci_dma_map(u32 address, size_t len, SPCI_dma_map *map) {
+  map->iov.clear();
+  map->len = len;
+  map->in_memory = true;
+
+  while (len != 0) {
+    u64 phys = cSystem->PCI_Phys(myPCIBus, address);
+    size_t chunk = pci_dma_chunk_limit(phys, len);
+    u8 *base = (u8 *)cSystem->PtrToMem(phys);
+    SPCI_iovec *last = map->iov.empty() ? NULL : &map->iov.back();
+
+    if (!base)
+      map->in_memory = false;
+
+    if (last && last->phys + last->len == phys && !last->base == !base) {
+      last->len += chunk;
+    } else {
+      SPCI_iovec v = {base, phys, chunk};
+      map->iov.push_back(v);
+    }
+
+    address += (u32)chunk;
+    len -= chunk;
+  }
+
+  return map->in_memory;
+}
+
+/**
+ * \brief Release a DMA mapping made by pci_dma_map().
+ **/
+void CPCIDevice::pci_dma_unmap(SPCI_dma_map *map) {
+  map->iov.clear();
+  map->len = 0;
+}
+
+/**
+ * Call f(iov, iov_offset, offset, n) for each run of map that the n bytes
+ * at offset in the mapping overlap.
+ **/
+template <typename F>
+static void pci_dma_each(SPCI_dma_map *map, size_t offset, size_t len, F f) {
+  size_t done = 0;
+
+  if (offset + len > map->len)
+    FAILURE(InvalidArgument, "DMA beyond the end of the mapping");
+
+  for (size_t i = 0; i < map->iov.size() && done < len; i++) {
+    SPCI_iovec *v = &map->iov[i];
+
+    if (offset >= v->len) {
+      offset -= v->len;
+      continue;
+    }
+
+    size_t n = v->len - offset;
+    if (n > len - done)
+      n = len - done;
+    f(v, offset, done, n);
+    done += n;
+    offset = 0;
+  }
+}
+
+/**
+ * \brief Note that the device stored into mapped memory directly.
+ **/
+void CPCIDevice::pci_dma_dirty(SPCI_dma_map *map, size_t offset, size_t len) {
+  pci_dma_each(map, offset, len,
+               [this](SPCI_iovec *v, size_t o, size_t done, size_t n) {
+                 if (v->base)
+                   cSystem->dma_stored(v->phys + o, n, this);
+               });
+}
+
+/**
+ * \brief Copy len bytes at offset in a DMA mapping to dest.
+ **/
+void CPCIDevice::pci_dma_read(SPCI_dma_map *map, size_t offset, void *dest,
+                              size_t len) {
+  u8 *dst = (u8 *)dest;
+
+  pci_dma_each(map, offset, len,
+               [this, dst](SPCI_iovec *v, size_t o, size_t done, size_t n) {
+                 if (v->base) {
+                   memcpy(dst + done, v->base + o, n);
+                 } else {
+                   for (size_t el = 0; el < n; el++)
+                     dst[done + el] =
+                         (u8)cSystem->ReadMem(v->phys + o + el, 8, this);
+                 }
+               });
+}
+
+/**
+ * \brief Copy len bytes from source to offset in a DMA mapping.
+ **/
+void CPCIDevice::pci_dma_write(SPCI_dma_map *map, size_t offset,
+                               const void *source, size_t len) {
+  const u8 *src = (const u8 *)source;
+
+  pci_dma_each(map, offset, len,
+               [this, src](SPCI_iovec *v, size_t o, size_t done, size_t n) {
+                 if (v->base) {
+                   memcpy(v->base + o, src + done, n);
+                   cSystem->dma_stored(v->phys + o, n, this);
+                 } else {
+                   for (size_t el = 0; el < n; el++)
+                     cSystem->WriteMem(v->phys + o + el, 8, src[done + el],
+                                       this);
+                 }
+               });
+}
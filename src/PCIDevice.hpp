@@ -35,6 +35,26 @@
 
 #include "SystemComponent.hpp"
 
+#include <vector>
+
+/**
+ * \brief A run of a DMA mapping that is contiguous in system address space.
+ **/
+struct SPCI_iovec {
+  u8 *base;   /**< Host pointer into main memory, or NULL if not memory */
+  u64 phys;   /**< System address */
+  size_t len; /**< Length in bytes */
+};
+
+/**
+ * \brief A range of PCI bus addresses mapped for DMA by pci_dma_map().
+ **/
+struct SPCI_dma_map {
+  std::vector<SPCI_iovec> iov; /**< The runs the range is made up of */
+  size_t len;                  /**< Length of the range in bytes */
+  bool in_memory;              /**< All of the range is main memory */
+};
+
 /**
  * \brief Abstract base class for devices on the PCI-bus.
  **/
@@ -71,6 +91,13 @@ public:
   void do_pci_write(u32 address, void *source, size_t element_size,
                     size_t element_count);
 
+  bool pci_dma_map(u32 address, size_t len, SPCI_dma_map *map);
+  void pci_dma_unmap(SPCI_dma_map *map);
+  void pci_dma_dirty(SPCI_dma_map *map, size_t offset, size_t len);
+  void pci_dma_read(SPCI_dma_map *map, size_t offset, void *dest, size_t len);
+  void pci_dma_write(SPCI_dma_map *map, size_t offset, const void *source,
+                     size_t len);
+
 protected:
   bool do_pci_interrupt(int func, bool asserted);
   void add_function(int func, u32 data[64], u32 mask[64]);
@@ -1675,6 +1675,7 @@ void CSym53C895::execute_bm_op() {
 
     u32 start;
     u32 count;
+    SPCI_dma_map map;
 
     if (table_indirect) {
       u32 add = R32(DSA) + sext_u32_24(R32(DSPS));
@@ -1721,14 +1722,18 @@ void CSym53C895::execute_bm_op() {
     case SCSI_PHASE_COMMAND:
     case SCSI_PHASE_DATA_OUT:
     case SCSI_PHASE_MSG_OUT:
-      do_pci_read(R32(DNAD), scsi_data_ptr, 1, count);
+      pci_dma_map(R32(DNAD), count, &map);
+      pci_dma_read(&map, 0, scsi_data_ptr, count);
+      pci_dma_unmap(&map);
       R32(DNAD) += count;
       break;
 
     case SCSI_PHASE_STATUS:
     case SCSI_PHASE_DATA_IN:
     case SCSI_PHASE_MSG_IN:
-      do_pci_write(R32(DNAD), scsi_data_ptr, 1, count);
+      pci_dma_map(R32(DNAD), count, &map);
+      pci_dma_write(&map, 0, scsi_data_ptr, count);
+      pci_dma_unmap(&map);
       R32(DNAD) += count;
       break;
     }
@@ -2427,13 +2432,36 @@ void CSym53C895::execute_mm_op() {
          R32(DSP) - 12, GET_DBC(), R32(DSPS), temp_shadow);
 #endif
 
-  // To speed things up, we set up a buffer and read all data
-  // at once, followed by writing all data at once.
-  void *buf = malloc(GET_DBC());
-  do_pci_read(R32(DSPS), buf, 1, GET_DBC());
-  do_pci_write(temp_shadow, buf, 1, GET_DBC());
-  free(buf);
-  return;
+  // Map both ranges, and copy straight from one to the other; only parts
+  // that aren't main memory go through a buffer. Overlapping moves go
+  // through a buffer as a whole, which makes them work like memmove.
+  SPCI_dma_map src;
+  SPCI_dma_map dst;
+  u32 len = GET_DBC();
+  size_t offset = 0;
+
+  pci_dma_map(R32(DSPS), len, &src);
+  pci_dma_map(temp_shadow, len, &dst);
+  if (R32(DSPS) < temp_shadow + len && temp_shadow < R32(DSPS) + len) {
+    std::vector<u8> buf(len);
+    pci_dma_read(&src, 0, buf.data(), len);
+    pci_dma_write(&dst, 0, buf.data(), len);
+  } else {
+    for (size_t i = 0; i < src.iov.size(); i++) {
+      SPCI_iovec *v = &src.iov[i];
+
+      if (v->base) {
+        pci_dma_write(&dst, offset, v->base, v->len);
+      } else {
+        std::vector<u8> buf(v->len);
+        pci_dma_read(&src, offset, buf.data(), v->len);
+        pci_dma_write(&dst, offset, buf.data(), v->len);
+      }
+      offset += v->len;
+    }
+  }
+  pci_dma_unmap(&src);
+  pci_dma_unmap(&dst);
 }
 
 /**
@@ -36,6 +36,15 @@
 #include <signal.h>
 #include <stdlib.h>
 
+#if defined(HAVE_MMAP)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#if defined(HAVE_SYS_MBIND)
+#include <sys/syscall.h>
+#endif
+
 #define CLOCK_RATIO 10000
 
 #if defined(LS_MASTER) || defined(LS_SLAVE)
@@ -58,6 +67,7 @@ CSystem::CSystem(CConfigurator *cfg) {
   iNumMemories = 0;
   iNumCPUs = 0;
   iNumMemoryBits = (int)myCfg->get_num_value("memory.bits", false, 27);
+  iNumCPUThreads = (int)myCfg->get_num_value("cpu_threads", false, 0);
 
   //  iNumConfig = 0;
 #if defined(IDB)
@@ -81,6 +91,13 @@ CSystem::CSystem(CConfigurator *cfg) {
     state.pchip[i].wsba[3] = 2;
   }
 
+  for (i = 0; i < 2; i++) {
+    pci_tlb[i].hits = 0;
+    pci_tlb[i].misses = 0;
+    pci_tlb[i].epoch = 0;
+    pci_tlb_invalidate(i, 0, 0);
+  }
+
   state.pchip[0].pctl = U64(0x0000104401440081);
   state.pchip[1].pctl = U64(0x0000504401440081);
 
@@ -88,18 +105,26 @@ CSystem::CSystem(CConfigurator *cfg) {
   state.tig.HaltA = 0;
   state.tig.HaltB = 0;
 
-  state.cpu_lock_flags = 0;
-
-  if (iNumMemoryBits > 30) {
-
-    // size_t may not be big enough, and makes 2^31 negative, so the
-    // alloc fails.  We're going to allocate the memory in
-    //  2^(iNumMemoryBits-10) chunks of 2^10.
-    CHECK_ALLOCATION(memory = calloc(1 << (iNumMemoryBits - 10), 1 << 10));
-  } else
-    CHECK_ALLOCATION(memory = calloc(1 << iNumMemoryBits, 1));
-
-  cpu_lock_mutex = new CFastMutex("cpu-locking-lock");
+  for (i = 0; i < IO_CHUNKS; i++)
+    io_map[i].store(nullptr);
+  RegisterMemory(nullptr, CHIPSET_CCHIP, U64(0x00000801A0000000), 0x10000000);
+  RegisterMemory(nullptr, CHIPSET_PCHIP0, U64(0x0000080180000000), 0x10000000);
+  RegisterMemory(nullptr, CHIPSET_PCHIP1, U64(0x0000080380000000), 0x10000000);
+  RegisterMemory(nullptr, CHIPSET_DCHIP, U64(0x00000801B0000000), 0x10000000);
+  RegisterMemory(nullptr, CHIPSET_TIG, U64(0x0000080100000000), 0x40000000);
+
+  cpu_lock_flags = 0;
+  idle_watchers = 0;
+  for (int i = 0; i < 4; i++)
+    cpu_lock_address[i] = 0;
+
+  // The Typhoon takes 16 MB to 32 GB of memory.
+  if (iNumMemoryBits < 24 || iNumMemoryBits > 35 ||
+      iNumMemoryBits >= sizeof(size_t) * 8 - 1)
+    FAILURE_1(Configuration, "memory.bits = %d is not supported",
+              iNumMemoryBits);
+  alloc_memory();
+  alloc_code_lines();
 
   printf("%s(%s): $Id: System.cpp,v 1.79 2008/06/12 07:29:44 iamcamiel Exp $\n",
          cfg->get_myName(), cfg->get_myValue());
@@ -120,16 +145,146 @@ CSystem::~CSystem() {
   for (i = 0; i < iNumMemories; i++)
     free(asMemories[i]);
 
-  free(memory);
+  for (i = 0; i < IO_CHUNKS; i++)
+    delete[] io_map[i].load();
+
+  for (i = 0; i < 2; i++)
+    if (pci_tlb[i].misses)
+      printf("pchip%d: scatter-gather TLB %" PRIu64 " hits, %" PRIu64
+             " misses.\n",
+             i, pci_tlb[i].hits.load(), pci_tlb[i].misses.load());
+
+  free_memory();
 }
 
 /**
  * free memory, and allocate and clear new memory.
  **/
 void CSystem::ResetMem(unsigned int membits) {
-  free(memory);
+  free_memory();
   iNumMemoryBits = membits;
-  CHECK_ALLOCATION(memory = calloc(1 << iNumMemoryBits, 1));
+  alloc_memory();
+  alloc_code_lines();
+}
+
+/**
+ * Allocate 2^iNumMemoryBits bytes of cleared main memory.
+ *
+ * Where the host has mmap, main memory is mapped rather than allocated, so
+ * that host memory is only committed for pages the guest actually touches,
+ * and a large guest starts without clearing all of its memory first. The
+ * memory.* options (see es40.cfg) select huge pages, committing everything
+ * up front, a file or memfd to map it from, and the host NUMA node.
+ **/
+void CSystem::alloc_memory() {
+  memory_size = size_t(1) << iNumMemoryBits;
+  memory_fd = -1;
+
+#if defined(HAVE_MMAP)
+  const char *hugepages =
+      myCfg->get_text_value("memory.hugepages", "transparent");
+  const char *file = myCfg->get_text_value("memory.file", "");
+  bool reserve = myCfg->get_bool_value("memory.reserve", false);
+  int numa_node = (int)myCfg->get_num_value("memory.numa_node", false, -1);
+  int flags = MAP_SHARED;
+
+  if (*file) {
+    memory_fd = open(file, O_RDWR | O_CREAT, 0600);
+    if (memory_fd < 0)
+      FAILURE_1(Runtime, "Can't open memory file %s", file);
+  }
+#if defined(HAVE_MEMFD_CREATE)
+  else if (myCfg->get_bool_value("memory.shared", false)) {
+    memory_fd = memfd_create("axpbox-memory", 0);
+    if (memory_fd < 0)
+      FAILURE(Runtime, "Can't create shared memory file");
+    printf("%%SYS-I-MEMFD: Main memory is shared as /proc/%d/fd/%d.\n",
+           (int)getpid(), memory_fd);
+  }
+#endif
+  else
+    flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+  if (memory_fd >= 0 && ftruncate(memory_fd, (off_t)memory_size))
+    FAILURE(Runtime, "Can't resize memory file");
+
+  memory = MAP_FAILED;
+#if defined(MAP_HUGETLB)
+  // Huge pages are always reserved: with MAP_NORESERVE, running out of
+  // them would kill us with SIGBUS on the guest's first touch.
+  if (memory_fd < 0 && !strcasecmp(hugepages, "hugetlb")) {
+    memory = mmap(NULL, memory_size, PROT_READ | PROT_WRITE,
+                  flags | MAP_HUGETLB, -1, 0);
+    if (memory == MAP_FAILED)
+      printf("%%SYS-W-HUGETLB: Not enough huge pages for main memory, using "
+             "transparent huge pages.\n");
+  }
+#endif
+  if (memory == MAP_FAILED) {
+    if (!reserve)
+      flags |= MAP_NORESERVE;
+    memory = mmap(NULL, memory_size, PROT_READ | PROT_WRITE, flags,
+                  memory_fd, 0);
+    if (memory == MAP_FAILED)
+      FAILURE(OutOfMemory, "Out of memory");
+#if defined(MADV_HUGEPAGE)
+    if (strcasecmp(hugepages, "none"))
+      madvise(memory, memory_size, MADV_HUGEPAGE);
+#endif
+  }
+
+#if defined(HAVE_SYS_MBIND)
+  if (numa_node >= 0) {
+    const int long_bits = 8 * sizeof(unsigned long);
+    std::vector<unsigned long> nodes(numa_node / long_bits + 1);
+
+    nodes[numa_node / long_bits] = 1UL << (numa_node % long_bits);
+    if (syscall(SYS_mbind, memory, memory_size, 2 /* MPOL_BIND */,
+                nodes.data(), nodes.size() * long_bits + 1, 0))
+      printf("%%SYS-W-NUMA: Can't bind main memory to node %d.\n", numa_node);
+  }
+#endif
+
+  // Fault every page in now, without changing what a memory file holds.
+  if (reserve) {
+#if defined(MADV_POPULATE_WRITE)
+    if (madvise(memory, memory_size, MADV_POPULATE_WRITE))
+#endif
+    {
+      volatile char *p = (volatile char *)memory;
+      for (size_t i = 0; i < memory_size; i += 4096)
+        p[i] = p[i];
+    }
+  }
+#else
+  CHECK_ALLOCATION(memory = calloc(memory_size, 1));
+#endif
+}
+
+/**
+ * Release main memory.
+ **/
+void CSystem::free_memory() {
+#if defined(HAVE_MMAP)
+  munmap(memory, memory_size);
+  if (memory_fd >= 0)
+    close(memory_fd);
+  memory_fd = -1;
+#else
+  free(memory);
+#endif
+  memory = NULL;
+}
+
+/**
+ * Allocate the map of main memory lines that may be in an icache.
+ **/
+void CSystem::alloc_code_lines() {
+  size_t n = size_t(1) << (iNumMemoryBits - CODE_LINE_BITS);
+
+  code_lines.reset(new std::atomic<u8>[n]);
+  for (size_t i = 0; i < n; i++)
+    code_lines[i] = 0;
 }
 
 /**
@@ -157,7 +312,7 @@ char *CSystem::PtrToMem(u64 address) {
   if (address >> iNumMemoryBits) // Non Memory
     return 0;
 
-  return &(((char *)memory)[(int)address]);
+  return &(((char *)memory)[address]);
 }
 
 /**
@@ -173,6 +328,9 @@ int CSystem::RegisterCPU(class CAlphaCPU *cpu) {
 
 /**
  * Reserve a range of the 64-bit system address space for a device.
+ *
+ * The chipset registers its own ranges with a null component. Devices take
+ * precedence over those, so that they can claim ranges inside them.
  **/
 int CSystem::RegisterMemory(CSystemComponent *component, int index, u64 base,
                             u64 length) {
@@ -181,7 +339,8 @@ int CSystem::RegisterMemory(CSystemComponent *component, int index, u64 base,
 
 #if defined(CHECK_MEM_RANGES)
   for (i = 0; i < iNumMemories; i++) {
-    if (component == asMemories[i]->component)
+    if (component == asMemories[i]->component || !component ||
+        !asMemories[i]->component)
       continue;
 
     // check for overlaps
@@ -213,8 +372,12 @@ int CSystem::RegisterMemory(CSystemComponent *component, int index, u64 base,
   for (i = 0; i < iNumMemories; i++) {
     if ((asMemories[i]->component == component) &&
         (asMemories[i]->index == index)) {
+      u64 old_base = asMemories[i]->base;
+      u64 old_length = asMemories[i]->length;
       asMemories[i]->base = base;
       asMemories[i]->length = length;
+      map_memory(old_base, old_length);
+      map_memory(base, length);
       return 0;
     }
   }
@@ -228,9 +391,89 @@ int CSystem::RegisterMemory(CSystemComponent *component, int index, u64 base,
 
   asMemories[iNumMemories] = m;
   iNumMemories++;
+  map_memory(base, length);
   return 0;
 }
 
+/**
+ * \brief Update the pages of io_map that a range covers.
+ *
+ * Called by RegisterMemory() for a range that was added, and for both the
+ * old and the new place of a range that moved.
+ **/
+void CSystem::map_memory(u64 base, u64 length) {
+  u64 first;
+  u64 last;
+
+  if (!length || (base & ~U64(0x7ffffffff)) != IO_SPACE)
+    return;
+
+  first = (base - IO_SPACE) >> IO_PAGE_BITS;
+  last = (base - IO_SPACE + length - 1) >> IO_PAGE_BITS;
+  if (last >= (U64(1) << (35 - IO_PAGE_BITS)))
+    last = (U64(1) << (35 - IO_PAGE_BITS)) - 1;
+
+  for (u64 p = first; p <= last; p++) {
+    u64 lo = IO_SPACE + (p << IO_PAGE_BITS);
+    u64 hi = lo + (1 << IO_PAGE_BITS);
+    SMemoryList l;
+
+    for (int chipset = 0; chipset < 2; chipset++) {
+      for (int i = 0; i < iNumMemories; i++) {
+        struct SMemoryUser *m = asMemories[i];
+        if (!m->component == !chipset || !m->length)
+          continue;
+        if (m->base < hi && m->base + m->length > lo)
+          l.push_back(m);
+      }
+    }
+
+    std::atomic<const SMemoryList *> *chunk =
+        io_map[p >> IO_CHUNK_BITS].load(std::memory_order_relaxed);
+    if (!chunk) {
+      if (l.empty())
+        continue;
+      chunk = new std::atomic<const SMemoryList *>[1 << IO_CHUNK_BITS];
+      for (int j = 0; j < (1 << IO_CHUNK_BITS); j++)
+        chunk[j].store(nullptr, std::memory_order_relaxed);
+      io_map[p >> IO_CHUNK_BITS].store(chunk, std::memory_order_release);
+    }
+    chunk[p & ((1 << IO_CHUNK_BITS) - 1)].store(
+        l.empty() ? nullptr : &*io_lists.insert(l).first,
+        std::memory_order_release);
+  }
+}
+
+/**
+ * \brief Find the range a physical address outside main memory belongs to.
+ *
+ * \return The range, or null if no device or chipset range contains it.
+ **/
+struct SMemoryUser *CSystem::find_memory(u64 a) {
+  if (a & IO_SPACE) {
+    u64 p = (a - IO_SPACE) >> IO_PAGE_BITS;
+    std::atomic<const SMemoryList *> *chunk =
+        io_map[p >> IO_CHUNK_BITS].load(std::memory_order_acquire);
+    const SMemoryList *l;
+
+    if (!chunk || !(l = chunk[p & ((1 << IO_CHUNK_BITS) - 1)].load(
+                        std::memory_order_acquire)))
+      return nullptr;
+    for (struct SMemoryUser *m : *l)
+      if (a >= m->base && a < m->base + m->length)
+        return m;
+    return nullptr;
+  }
+
+  // Nothing is normally registered outside I/O space.
+  for (int i = 0; i < iNumMemories; i++) {
+    if ((a >= asMemories[i]->base) &&
+        (a < asMemories[i]->base + asMemories[i]->length))
+      return asMemories[i];
+  }
+  return nullptr;
+}
+
 int got_sigint = 0;
 
 /**
@@ -238,6 +481,15 @@ int got_sigint = 0;
  **/
 void sigint_handler(int signum) { got_sigint = 1; }
 
+#if defined(SIGUSR2)
+static volatile sig_atomic_t got_sigusr2 = 0;
+
+/**
+ * Handle a SIGUSR2 by setting a flag that prints the CPU statistics.
+ **/
+static void sigusr2_handler(int signum) { got_sigusr2 = 1; }
+#endif
+
 /**
  * Run the system by clocking the CPU(s) and devices.
  **/
@@ -252,19 +504,32 @@ void CSystem::Run() {
   printf("---------------- -------- -------------------------\n");
   for (i = 0; i < iNumMemories; i++) {
     printf("%016" PRIx64 " %8x %s/%d\n", asMemories[i]->base,
-           asMemories[i]->length, asMemories[i]->component->devid_string,
+           asMemories[i]->length,
+           asMemories[i]->component ? asMemories[i]->component->devid_string
+                                    : "chipset",
            asMemories[i]->index);
   }
 #endif // defined(DUMP_MEMMAP)
 
   /* catch CTRL-C and shutdown gracefully */
   signal(SIGINT, &sigint_handler);
+#if defined(SIGUSR2)
+  /* print the unaligned accesses fixed up so far on SIGUSR2 */
+  signal(SIGUSR2, &sigusr2_handler);
+#endif
 
   start_threads();
 
   for (k = 0;; k++) {
     if (got_sigint)
       FAILURE(Graceful, "CTRL-C detected");
+#if defined(SIGUSR2)
+    if (got_sigusr2) {
+      got_sigusr2 = 0;
+      for (i = 0; i < iNumCPUs; i++)
+        acCPUs[i]->dump_unalign();
+    }
+#endif
     std::this_thread::sleep_for(std::chrono::milliseconds(100));
     for (i = 0; i < iNumComponents; i++)
       acComponents[i]->check_state();
@@ -325,29 +590,187 @@ int CSystem::SingleStep() {
 #if defined(DEBUG_PORTACCESS)
 u64 lastport;
 #endif // defined(DEBUG_PORTACCESS)
+/**
+ * \brief Set the reservation of a CPU (LDx_L).
+ *
+ * The reservation is made before the data is read, and stores check for
+ * reservations after the data is written, so a store that the load misses
+ * always breaks the reservation.
+ **/
 void CSystem::cpu_lock(int cpuid, u64 address) {
-  SCOPED_FM_LOCK(cpu_lock_mutex);
-
-  //  printf("cpu%d: lock %" PRIx64 ".   \n",cpuid,address);
-  state.cpu_lock_flags |= (1 << cpuid);
-  state.cpu_lock_address[cpuid] = address;
+  cpu_lock_address[cpuid] = (address & CPU_LOCK_MASK) | 1;
+  if (!(cpu_lock_flags.load(std::memory_order_relaxed) & (1 << cpuid)))
+    cpu_lock_flags.fetch_or(1 << cpuid);
 }
 
+/**
+ * \brief Clear the reservation of a CPU (STx_C).
+ *
+ * \return true if the CPU still held its reservation, in which case the store
+ *         is done by cpu_store_cond().
+ **/
 bool CSystem::cpu_unlock(int cpuid) {
-  SCOPED_FM_LOCK(cpu_lock_mutex);
+  bool retval = cpu_lock_address[cpuid].exchange(0) != 0;
+
+  cpu_lock_flags.fetch_and(~(1 << cpuid));
+  return retval;
+}
 
+/**
+ * \brief Do the store of a STx_C that still held its reservation.
+ *
+ * Another CPU can store to the granule after our reservation was checked,
+ * so in main memory the store is done with a compare-and-swap against the
+ * data LDx_L read. Of two CPUs racing on the same data, only one succeeds.
+ *
+ * \return true if the store was done.
+ **/
+bool CSystem::cpu_store_cond(int cpuid, u64 address, int dsize, u64 data,
+                             CSystemComponent *source) {
+  u64 a = address & U64(0x00000807ffffffff);
   bool retval;
-  retval = state.cpu_lock_flags & (1 << cpuid);
 
-  //  printf("cpu%d: unlock (%s).   \n",cpuid,retval?"ok":"failed");
-  state.cpu_lock_flags &= ~(1 << cpuid);
+  if ((a >> iNumMemoryBits) || (a & ((dsize / 8) - 1))) {
+    WriteMem(address, dsize, data, source);
+    return true;
+  }
+
+  if (dsize == 32) {
+    u32 expected = endian_32((u32)cpu_lock_value[cpuid]);
+    retval = ((std::atomic<u32> *)((u8 *)memory + a))
+                 ->compare_exchange_strong(expected, endian_32((u32)data));
+  } else {
+    u64 expected = endian_64(cpu_lock_value[cpuid]);
+    retval = ((std::atomic<u64> *)((u8 *)memory + a))
+                 ->compare_exchange_strong(expected, endian_64(data));
+  }
+
+  if (retval) {
+    if (cpu_lock_flags.load())
+      cpu_break_lock(a, source);
+    if (code_lines[a >> CODE_LINE_BITS].load(std::memory_order_relaxed))
+      code_stored(a, source);
+    if (idle_watchers.load(std::memory_order_relaxed))
+      idle_stored(a, 1, source);
+  }
   return retval;
 }
 
-void CSystem::cpu_break_lock(int cpuid, CSystemComponent *source) {
-  SCOPED_FM_LOCK(cpu_lock_mutex);
-  printf("cpu%d: lock broken by %s.   \n", cpuid, source->devid_string);
-  state.cpu_lock_flags &= ~(1 << cpuid);
+/**
+ * \brief Break the reservations on the granule an address is in.
+ *
+ * Called after a store; the CPU (or device) that did the store keeps its
+ * own reservation.
+ **/
+void CSystem::cpu_break_lock(u64 address, CSystemComponent *source) {
+  u64 lock = (address & CPU_LOCK_MASK) | 1;
+
+  for (int i = 0; i < iNumCPUs; i++) {
+    u64 expected = lock;
+    if (source != acCPUs[i] && cpu_lock_address[i] == lock)
+      cpu_lock_address[i].compare_exchange_strong(expected, 0);
+  }
+}
+
+/**
+ * \brief Invalidate cached code that was just written to.
+ *
+ * Called after a store to a line of main memory that one or more CPUs may
+ * have in their instruction cache. Each of those CPUs drops the line, so the
+ * new contents are fetched the next time the code is executed. This makes
+ * the icache (and the blocks decoded from it) coherent with memory, which
+ * unlike a real 21264 doesn't depend on the guest issuing an IMB.
+ **/
+void CSystem::code_stored(u64 address, CSystemComponent *source) {
+  u8 cpus = code_lines[address >> CODE_LINE_BITS].load();
+
+  for (int i = 0; i < iNumCPUs; i++)
+    if (cpus & (1 << i))
+      acCPUs[i]->icache_stored(address, source == acCPUs[i]);
+}
+
+/**
+ * \brief Wake up CPUs whose idle loop reads memory that was just written to.
+ *
+ * Called after a store when one or more CPUs sleep in an idle loop that
+ * polls main memory (see CAlphaCPU::idle_sleep()). The CPU that did the
+ * store doesn't need waking up.
+ **/
+void CSystem::idle_stored(u64 address, size_t len, CSystemComponent *source) {
+  for (int i = 0; i < iNumCPUs; i++)
+    if (source != acCPUs[i])
+      acCPUs[i]->idle_stored(address, len);
+}
+
+/**
+ * \brief Account for a device writing directly to main memory.
+ *
+ * Does what WriteMem() does after a store, for every byte in the range:
+ * breaks the LDx_L reservations on it, invalidates cached code in it and
+ * wakes up the CPUs whose idle loop reads it.
+ **/
+void CSystem::dma_stored(u64 address, size_t len, CSystemComponent *source) {
+  u64 a;
+
+  if (!len)
+    return;
+
+  // Order the device's writes before reading the maps; see code_fetched().
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+
+  if (cpu_locked())
+    for (a = address & CPU_LOCK_MASK; a < address + len; a += 0x100)
+      cpu_break_lock(a, source);
+
+  for (a = address & ~((U64(0x1) << CODE_LINE_BITS) - 1); a < address + len;
+       a += U64(0x1) << CODE_LINE_BITS)
+    if (code_lines[a >> CODE_LINE_BITS].load(std::memory_order_relaxed))
+      code_stored(a, source);
+
+  if (idle_watchers.load(std::memory_order_relaxed))
+    idle_stored(address, len, source);
+}
+
+/**
+ * \brief Read from one of the ranges the chipset registered for itself.
+ **/
+u64 CSystem::chipset_read(int index, u32 offset, int dsize,
+                          CSystemComponent *source) {
+  switch (index) {
+  case CHIPSET_CCHIP:
+    return cchip_csr_read(offset, source);
+  case CHIPSET_PCHIP0:
+    return pchip_csr_read(0, offset);
+  case CHIPSET_PCHIP1:
+    return pchip_csr_read(1, offset);
+  case CHIPSET_DCHIP:
+    return dchip_csr_read(offset) * U64(0x0101010101010101);
+  default:
+    return tig_read(offset);
+  }
+}
+
+/**
+ * \brief Write to one of the ranges the chipset registered for itself.
+ **/
+void CSystem::chipset_write(int index, u32 offset, u64 data,
+                            CSystemComponent *source) {
+  switch (index) {
+  case CHIPSET_CCHIP:
+    cchip_csr_write(offset, data, source);
+    break;
+  case CHIPSET_PCHIP0:
+    pchip_csr_write(0, offset, data);
+    break;
+  case CHIPSET_PCHIP1:
+    pchip_csr_write(1, offset, data);
+    break;
+  case CHIPSET_DCHIP:
+    dchip_csr_write(offset, (u8)data & 0xff);
+    break;
+  default:
+    tig_write(offset, (u8)data);
+  }
 }
 
 /**
@@ -449,36 +872,25 @@ void CSystem::cpu_break_lock(int cpuid, CSystemComponent *source) {
 void CSystem::WriteMem(u64 address, int dsize, u64 data,
                        CSystemComponent *source) {
   u64 a;
-  int i;
   u8 *p;
 #if defined(ALIGN_MEM_ACCESS)
   u64 t64;
   u32 t32;
   u16 t16;
 #endif // defined(ALIGN_MEM_ACCESS)
-  if (state.cpu_lock_flags) {
-    for (i = 0; i < iNumCPUs; i++) {
-      if ((state.cpu_lock_flags & (1 << i)) &&
-          (!((state.cpu_lock_address[i] ^ address) &
-             U64(0x00000807ffffff00))) &&
-          (source != acCPUs[i]))
-        cpu_break_lock(i, source);
-    }
-  }
-
   a = address & U64(0x00000807ffffffff);
 
   if (a >> iNumMemoryBits) // non-memory
   {
 
-    // check registered device memory ranges
-    for (i = 0; i < iNumMemories; i++) {
-      if ((a >= asMemories[i]->base) &&
-          (a < asMemories[i]->base + asMemories[i]->length)) {
-        asMemories[i]->component->WriteMem(
-            asMemories[i]->index, a - asMemories[i]->base, dsize, data);
-        return;
-      }
+    // check registered device and chipset memory ranges
+    struct SMemoryUser *m = find_memory(a);
+    if (m) {
+      if (m->component)
+        m->component->WriteMem(m->index, a - m->base, dsize, data);
+      else
+        chipset_write(m->index, (u32)(a - m->base), data, source);
+      return;
     }
 
     if ((a == U64(0x00000801FC000CF8)) && (dsize == 32)) {
@@ -507,31 +919,6 @@ void CSystem::WriteMem(u64 address, int dsize, u64 data,
       return;
     }
 
-    if (a >= U64(0x00000801A0000000) && a <= U64(0x00000801AFFFFFFF)) {
-      cchip_csr_write((u32)a & 0xFFFFFFF, data, source);
-      return;
-    }
-
-    if (a >= U64(0x0000080180000000) && a <= U64(0x000008018FFFFFFF)) {
-      pchip_csr_write(0, (u32)a & 0xFFFFFFF, data);
-      return;
-    }
-
-    if (a >= U64(0x0000080380000000) && a <= U64(0x000008038FFFFFFF)) {
-      pchip_csr_write(1, (u32)a & 0xFFFFFFF, data);
-      return;
-    }
-
-    if (a >= U64(0x00000801B0000000) && a <= U64(0x00000801BFFFFFFF)) {
-      dchip_csr_write((u32)a & 0xFFFFFFF, (u8)data & 0xff);
-      return;
-    }
-
-    if (a >= U64(0x0000080100000000) && a <= U64(0x000008013FFFFFFF)) {
-      tig_write((u32)a & 0x3FFFFFFF, (u8)data);
-      return;
-    }
-
     if (a >= U64(0x801fc000000) && a < U64(0x801fe000000)) {
 
       // Unused PCI I/O space
@@ -607,6 +994,8 @@ void CSystem::WriteMem(u64 address, int dsize, u64 data,
   default:
     *((u64 *)p) = endian_64((u64)data);
   }
+
+  cpu_stored(a, source);
 }
 
 /**
@@ -707,19 +1096,18 @@ void CSystem::WriteMem(u64 address, int dsize, u64 data,
  **/
 u64 CSystem::ReadMem(u64 address, int dsize, CSystemComponent *source) {
   u64 a;
-  int i;
   u8 *p;
 
   a = address & U64(0x00000807ffffffff);
   if (a >> iNumMemoryBits) // Non Memory
   {
 
-    // check registered device memory ranges
-    for (i = 0; i < iNumMemories; i++) {
-      if ((a >= asMemories[i]->base) &&
-          (a < asMemories[i]->base + asMemories[i]->length))
-        return asMemories[i]->component->ReadMem(
-            asMemories[i]->index, a - asMemories[i]->base, dsize);
+    // check registered device and chipset memory ranges
+    struct SMemoryUser *m = find_memory(a);
+    if (m) {
+      if (m->component)
+        return m->component->ReadMem(m->index, a - m->base, dsize);
+      return chipset_read(m->index, (u32)(a - m->base), dsize, source);
     }
 
     if ((a == U64(0x00000801FC000CFC)) && (dsize == 32)) {
@@ -736,21 +1124,6 @@ u64 CSystem::ReadMem(u64 address, int dsize, CSystemComponent *source) {
                      source);
     }
 
-    if (a >= U64(0x00000801A0000000) && a <= U64(0x00000801AFFFFFFF))
-      return cchip_csr_read((u32)a & 0xFFFFFFF, source);
-
-    if (a >= U64(0x0000080180000000) && a <= U64(0x000008018FFFFFFF))
-      return pchip_csr_read(0, (u32)a & 0xFFFFFFF);
-
-    if (a >= U64(0x0000080380000000) && a <= U64(0x000008038FFFFFFF))
-      return pchip_csr_read(1, (u32)a & 0xFFFFFFF);
-
-    if (a >= U64(0x00000801B0000000) && a <= U64(0x00000801BFFFFFFF))
-      return dchip_csr_read((u32)a & 0xFFFFFFF) * U64(0x0101010101010101);
-
-    if (a >= U64(0x0000080100000000) && a <= U64(0x000008013FFFFFFF))
-      return tig_read((u32)a & 0x3FFFFFFF);
-
     if ((a >= U64(0x801fe000000) && a < U64(0x801ff000000)) ||
         (a >= U64(0x803fe000000) && a < U64(0x803ff000000))) {
 
@@ -1277,10 +1650,12 @@ void CSystem::pchip_csr_write(int num, u32 a, u64 data) {
   case 0x040:
   case 0x080:
     state.pchip[num].wsba[(a >> 6) & 3] = data & U64(0x00000000fff00003);
+    pci_tlb_invalidate(num, 0, 0);
     return;
 
   case 0x0c0:
     state.pchip[num].wsba[3] = (data & U64(0x00000080fff00001)) | 2;
+    pci_tlb_invalidate(num, 0, 0);
     return;
 
   case 0x100:
@@ -1288,6 +1663,7 @@ void CSystem::pchip_csr_write(int num, u32 a, u64 data) {
   case 0x180:
   case 0x1c0:
     state.pchip[num].wsm[(a >> 6) & 3] = data & U64(0x00000000fff00000);
+    pci_tlb_invalidate(num, 0, 0);
     return;
 
   case 0x200:
@@ -1295,6 +1671,7 @@ void CSystem::pchip_csr_write(int num, u32 a, u64 data) {
   case 0x280:
   case 0x2c0:
     state.pchip[num].tba[(a >> 6) & 3] = data & U64(0x00000007fffffc00);
+    pci_tlb_invalidate(num, 0, 0);
     return;
 
   case 0x300:
@@ -1314,7 +1691,11 @@ void CSystem::pchip_csr_write(int num, u32 a, u64 data) {
     return;
 
   case 0x480: // TLBIV
+    pci_tlb_invalidate(num, (u32)(data << 12) & 0xffff0000, 8);
+    return;
+
   case 0x4c0: // TLBIA
+    pci_tlb_invalidate(num, 0, 0);
     return;
 
   case 0x800: // PCI reset
@@ -1342,16 +1723,19 @@ u64 CSystem::cchip_csr_read(u32 a, CSystemComponent *source) {
     return state.cchip.misc | cpu->get_cpuid();
 
   case 0x100:
-
-    // WE PUT ALL OUR MEMORY IN A SINGLE ARRAY FOR NOW...
-    return ((u64)(iNumMemoryBits - 23) << 12); // size
-
   case 0x140:
   case 0x180:
-  case 0x1c0:
+  case 0x1c0: {
 
-    // WE PUT ALL OUR MEMORY IN A SINGLE ARRAY FOR NOW...
-    return 0;
+    // Memory is split over as many arrays of the largest size the Typhoon
+    // supports (8 GB) as it takes; AARn holds array n's base and size.
+    unsigned int bits = iNumMemoryBits > 33 ? 33 : iNumMemoryBits;
+    u64 base = (u64)((a - 0x100) >> 6) << bits;
+
+    if (base >> iNumMemoryBits)
+      return 0;
+    return base | ((u64)(bits - 23) << 12);
+  }
 
   case 0x200:
   case 0x240:
@@ -1382,7 +1766,8 @@ void CSystem::cchip_csr_write(u32 a, u64 data, CSystemComponent *source) {
     state.cchip.csc |= (data & U64(0x0777777fff3f0000));
     return;
 
-  case 0x080:                                              // MISC
+  case 0x080: {                                            // MISC
+    std::lock_guard<std::mutex> lock(irq_mutex);
     state.cchip.misc |= (data & U64(0x00000f0000f00000));  // W1S
     state.cchip.misc &= ~(data & U64(0x0000000010000ff0)); // W1C
     if (data & U64(0x0000000001000000)) {
@@ -1439,6 +1824,7 @@ void CSystem::cchip_csr_write(u32 a, u64 data, CSystemComponent *source) {
     }
 
     return;
+  }
 
   case 0x200:
   case 0x240:
@@ -1758,6 +2144,7 @@ int CSystem::LoadROM() {
  *
  **/
 void CSystem::interrupt(int number, bool assert) {
+  std::lock_guard<std::mutex> lock(irq_mutex);
   int i;
 
   if (number == -1) {
@@ -1915,18 +2302,10 @@ u64 CSystem::PCI_Phys(int pcibus, u32 address) {
                ~state.pchip[pcibus].wsm[j])) // address in range...
       {
         if (state.pchip[pcibus].wsba[j] & 2) {
-          try {
-            a = PCI_Phys_scatter_gather(address, state.pchip[pcibus].wsm[j],
-                                        state.pchip[pcibus].tba[j]);
-          }
-
-          catch (char) {
-
-            // window disabled...
-            // not matched; treat as local PCI bus address
-            return U64(0x80000000000) | (pcibus * U64(0x200000000)) |
-                   (u64)address;
-          }
+          if (!PCI_Phys_scatter_gather(pcibus, address,
+                                       state.pchip[pcibus].wsm[j],
+                                       state.pchip[pcibus].tba[j], &a))
+            break; // invalid PTE; not matched
         } else
           a = PCI_Phys_direct_mapped(address, state.pchip[pcibus].wsm[j],
                                      state.pchip[pcibus].tba[j]);
@@ -1990,9 +2369,14 @@ u64 CSystem::PCI_Phys_direct_mapped(u32 address, u64 wsm, u64 tba) {
  * Translate a 32-bit address coming off the PCI bus into a 64-bit
  * system address using scatter-gather DMA address translation.
  *
- * If address can't be matched (PTE is invalid), an exception of type char
- * is thrown. The calling function should catch the exception, and do
- * The Right Thing(tm): treat the address as a local PCI-bus address.
+ * Returns false if address can't be matched (PTE is invalid). The calling
+ * function should then do The Right Thing(tm): treat the address as a local
+ * PCI-bus address.
+ *
+ * Valid translations are kept in the Pchip's scatter-gather TLB, so that
+ * repeated DMA to the same pages doesn't read the PTE from memory again.
+ * Like on the real Pchip, the operating system has to invalidate the TLB
+ * through TLBIA or TLBIV when it changes a PTE that may be cached.
  *
  * Source: HRM, 10.1.4.3:
  *
@@ -2057,12 +2441,25 @@ u64 CSystem::PCI_Phys_direct_mapped(u32 address, u64 wsm, u64 tba) {
  * +----------------------------+-------------------+
  * \endcode
  **/
-u64 CSystem::PCI_Phys_scatter_gather(u32 address, u64 wsm, u64 tba) {
+bool CSystem::PCI_Phys_scatter_gather(int pcibus, u32 address, u64 wsm,
+                                      u64 tba, u64 *a) {
   u64 pte_a;
 
   u64 pte;
 
-  u64 a;
+  struct SPci_tlb *tlb = &pci_tlb[pcibus];
+  std::atomic<u64> *e = &tlb->entry[(address >> 13) % PCI_TLB_SIZE];
+  u64 tag = (address & ~PCI_PTE_ADD2_MASK & 0xffffffff) | 1;
+  u64 v = e->load(std::memory_order_relaxed);
+
+  if ((v & 0xffffffff) == tag) {
+    tlb->hits.fetch_add(1, std::memory_order_relaxed);
+    *a = ((v >> 32) << 13) | (address & PCI_PTE_ADD2_MASK);
+    return true;
+  }
+
+  tlb->misses.fetch_add(1, std::memory_order_relaxed);
+  u32 epoch = tlb->epoch.load();
 
   wsm &= PCI_WSM_MASK;
 
@@ -2071,14 +2468,41 @@ u64 CSystem::PCI_Phys_scatter_gather(u32 address, u64 wsm, u64 tba) {
           | (tba & PCI_PTE_TBA_MASK &
              ~(wsm >> PCI_PTE_ADD_SHIFT)); // tba part of pte address
   pte = ReadMem(pte_a, 64, 0);
-  if (pte & 1) {
-    a = ((pte << PCI_PTE_SHIFT) & PCI_PTE_MASK) | (address & PCI_PTE_ADD2_MASK);
+  if (!(pte & 1))
+    return false;
 
-    if (pte & PCI_PTE_PEER_BIT) // peer-to-peer
-      a |= (PHYS_PIO_ACCESS);   // PIO access.
-    return a;
-  } else {
-    throw((char)'0');
+  *a = ((pte << PCI_PTE_SHIFT) & PCI_PTE_MASK) | (address & PCI_PTE_ADD2_MASK);
+
+  if (pte & PCI_PTE_PEER_BIT) // peer-to-peer
+    *a |= (PHYS_PIO_ACCESS);  // PIO access.
+
+  // If the TLB was invalidated while we read the PTE, the PTE may already be
+  // stale; don't leave it in the TLB then.
+  e->store(((*a >> 13) << 32) | tag);
+  if (tlb->epoch.load() != epoch)
+    e->store(0);
+  return true;
+}
+
+/**
+ * Invalidate entries in the scatter-gather TLB of Pchip num: those for the
+ * given number of PCI pages starting at address, or all of them if pages is
+ * 0.
+ **/
+void CSystem::pci_tlb_invalidate(int num, u32 address, int pages) {
+  struct SPci_tlb *tlb = &pci_tlb[num];
+
+  tlb->epoch++;
+  if (!pages) {
+    for (int i = 0; i < PCI_TLB_SIZE; i++)
+      tlb->entry[i].store(0);
+    return;
+  }
+
+  for (int i = 0; i < pages; i++, address += 0x2000) {
+    std::atomic<u64> *e = &tlb->entry[(address >> 13) % PCI_TLB_SIZE];
+    if ((e->load() & 0xffffe000) == address)
+      e->store(0);
   }
 }
 
@@ -2092,6 +2516,14 @@ void CSystem::init() {
 
 void CSystem::start_threads() {
   int i;
+  int n = iNumCPUThreads;
+
+  // Spread the CPUs over the host threads round-robin; CPU n runs on the
+  // thread of CPU (n % cpu_threads).
+  if (n <= 0 || n > iNumCPUs)
+    n = iNumCPUs;
+  for (i = 0; i < iNumCPUs; i++)
+    acCPUs[i]->set_thread(acCPUs[i % n]);
 
   printf("Start threads:");
   for (i = 0; i < iNumComponents; i++) {
@@ -2122,11 +2554,11 @@ void CSystem::stop_threads() {
 void CSystem::SaveState(const char *fn) {
   FILE *f;
   int i;
-  unsigned int m;
+  u64 m;
   unsigned int j;
   int *mem = (int *)memory;
   int int0 = 0;
-  unsigned int memints = (1 << iNumMemoryBits) / (unsigned int)sizeof(int);
+  u64 memints = memory_size / sizeof(int);
   u32 temp_32;
 
   f = fopen(fn, "wb");
@@ -2143,14 +2575,14 @@ void CSystem::SaveState(const char *fn) {
       } else {
         j = 0;
         m++;
-        while (!mem[m] && (m < memints)) {
+        while (m < memints && !mem[m]) {
           m++;
           j++;
           if ((int)j == -1)
             break;
         }
 
-        if (mem[m])
+        if (m < memints && mem[m])
           m--;
         fwrite(&int0, 1, sizeof(int), f);
         fwrite(&j, 1, sizeof(int), f);
@@ -2176,10 +2608,10 @@ void CSystem::SaveState(const char *fn) {
 void CSystem::RestoreState(const char *fn) {
   FILE *f;
   int i;
-  unsigned int m;
+  u64 m;
   unsigned int j;
   int *mem = (int *)memory;
-  unsigned int memints = (1 << iNumMemoryBits) / (unsigned int)sizeof(int);
+  u64 memints = memory_size / sizeof(int);
   u32 temp_32;
 
   f = fopen(fn, "rb");
@@ -2215,6 +2647,8 @@ void CSystem::RestoreState(const char *fn) {
   }
 
   (void)!fread(&state, sizeof(state), 1, f);
+  pci_tlb_invalidate(0, 0, 0);
+  pci_tlb_invalidate(1, 0, 0);
 
   // components
   //
@@ -2234,14 +2668,14 @@ void CSystem::RestoreState(const char *fn) {
  **/
 void CSystem::DumpMemory(unsigned int filenum) {
   char file[100];
-  int x;
+  u64 x;
   int *mem = (int *)memory;
   FILE *f;
 
   sprintf(file, "memory_%012d.dmp", filenum);
   f = fopen(file, "wb");
 
-  x = (1 << iNumMemoryBits) / (unsigned int)sizeof(int) / 2;
+  x = memory_size / sizeof(int) / 2;
 
   while (!mem[x - 1])
     x--;
@@ -2347,6 +2781,7 @@ void CSystem::panic(char *message, int flags) {
  *the interrupt.
  **/
 void CSystem::clear_clock_int(int ProcNum) {
+  std::lock_guard<std::mutex> lock(irq_mutex);
   state.cchip.misc &= ~(U64(0x10) << ProcNum);
   acCPUs[ProcNum]->irq_h(2, false, 0);
 }
@@ -30,11 +30,29 @@
 #include "SystemComponent.hpp"
 #include "TraceEngine.hpp"
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <vector>
+
 #if !defined(INCLUDED_SYSTEM_H)
 #define INCLUDED_SYSTEM_H
 
 #define MAX_COMPONENTS 100
 
+/// Address bits that select the reservation granule of LDx_L/STx_C
+#define CPU_LOCK_MASK U64(0x00000807ffffff00)
+
+/// Main memory is tracked for cached code in blocks of 2^CODE_LINE_BITS bytes,
+/// the size of a CPU instruction cache line.
+#define CODE_LINE_BITS 11
+
+/// Number of entries in the scatter-gather TLB of each Pchip. The real
+/// 21272 holds far fewer; a larger one keeps the translations of all buffers a
+/// device is using, such as a NIC's rings, at hand.
+#define PCI_TLB_SIZE 256
+
 #if defined(PROFILE)
 #define PROFILE_FROM U64(0x8000)
 #define PROFILE_TO U64(0x1a81c0)
@@ -63,9 +81,27 @@ extern bool profile_started;
 extern char *dbg_strptr;
 #endif
 
+/// Bit that is set in physical addresses in I/O space
+#define IO_SPACE U64(0x0000080000000000)
+/// Bits of the I/O space address that select the offset in an io_map page
+#define IO_PAGE_BITS 13
+/// Bits of the I/O space address that select the page within an io_map chunk
+#define IO_CHUNK_BITS 11
+/// Number of chunks in io_map, covering the 35-bit I/O space
+#define IO_CHUNKS (1 << (35 - IO_PAGE_BITS - IO_CHUNK_BITS))
+
+/// Ranges claimed by the chipset itself (SMemoryUser::index when component
+/// is null).
+#define CHIPSET_CCHIP 0
+#define CHIPSET_PCHIP0 1
+#define CHIPSET_PCHIP1 2
+#define CHIPSET_DCHIP 3
+#define CHIPSET_TIG 4
+
 /// Structure used for mapping memory ranges to devices.
 struct SMemoryUser {
-  CSystemComponent *component; /**< Device that occupies this range. */
+  CSystemComponent *component; /**< Device that occupies this range, or null
+                                    for the chipset. */
   int index; /**< Index within the device. Used by devices that occupy more than
                 one range. */
   u64 base;  /**< Address of first byte. */
@@ -110,7 +146,8 @@ public:
   void SaveState(const char *fn);
   u64 PCI_Phys(int pcibus, u32 address);
   u64 PCI_Phys_direct_mapped(u32 address, u64 wsm, u64 tba);
-  u64 PCI_Phys_scatter_gather(u32 address, u64 wsm, u64 tba);
+  bool PCI_Phys_scatter_gather(int pcibus, u32 address, u64 wsm, u64 tba,
+                               u64 *a);
   void interrupt(int number, bool assert);
   int LoadROM();
   u64 ReadMem(u64 address, int dsize, CSystemComponent *source);
@@ -151,7 +188,69 @@ public:
 
   void cpu_lock(int cpuid, u64 address);
   bool cpu_unlock(int cpuid);
-  void cpu_break_lock(int cpuid, CSystemComponent *source);
+  bool cpu_store_cond(int cpuid, u64 address, int dsize, u64 data,
+                      CSystemComponent *source);
+  void cpu_break_lock(u64 address, CSystemComponent *source);
+  bool cpu_locked() {
+    return cpu_lock_flags.load(std::memory_order_relaxed) != 0;
+  };
+
+  /**
+   * Remember the data a CPU's LDx_L read, for cpu_store_cond().
+   **/
+  void cpu_lock_data(int cpuid, u64 data) { cpu_lock_value[cpuid] = data; };
+
+  /**
+   * Account for a CPU store to main memory: break the other CPUs'
+   * reservations on it, invalidate cached code in it, and wake up CPUs
+   * that sleep in an idle loop reading it.
+   *
+   * code_lines is read without a fence. A CPU filling its icache from the
+   * line at the same time is only sure to see the store if the storing CPU
+   * does an MB before the code is run, as the architecture requires anyway
+   * (see code_fetched()). CPUs drop the lines when they next check for
+   * events, and the storing CPU right away, but a decoded or translated
+   * block that is already running is run to its end.
+   **/
+  void cpu_stored(u64 address, CSystemComponent *source) {
+    if (cpu_locked())
+      cpu_break_lock(address, source);
+    if (code_lines[address >> CODE_LINE_BITS].load(std::memory_order_relaxed))
+      code_stored(address, source);
+    if (idle_watchers.load(std::memory_order_relaxed))
+      idle_stored(address, 1, source);
+  };
+  void dma_stored(u64 address, size_t len, CSystemComponent *source);
+
+  /**
+   * Note that a CPU is about to fill an instruction cache line from main
+   * memory. The fence orders setting the bit before reading the line, and
+   * pairs with the one in an MB after a store to it (see cpu_stored()).
+   **/
+  void code_fetched(int cpuid, u64 address) {
+    std::atomic<u8> *l = &code_lines[address >> CODE_LINE_BITS];
+    if (!(l->load(std::memory_order_relaxed) & (1 << cpuid)))
+      l->fetch_or(1 << cpuid);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  };
+
+  /**
+   * Note that a CPU no longer has a line of main memory in its icache.
+   **/
+  void code_dropped(int cpuid, u64 address) {
+    code_lines[address >> CODE_LINE_BITS].fetch_and(~(1 << cpuid));
+  };
+
+  /**
+   * Return the physical address of a pointer into main memory.
+   **/
+  u64 MemToPhys(const void *p) {
+    return (u64)((const char *)p - (const char *)memory);
+  };
+
+  /// CPUs sleeping in an idle loop that reads main memory; lets stores skip
+  /// idle_stored() when there are none.
+  std::atomic<int> idle_watchers;
 
 private:
   u64 cchip_csr_read(u32 address, CSystemComponent *source);
@@ -162,16 +261,46 @@ private:
   void dchip_csr_write(u32 address, u8 data);
   u8 tig_read(u32 address);
   void tig_write(u32 address, u8 data);
+  void code_stored(u64 address, CSystemComponent *source);
+  void idle_stored(u64 address, size_t len, CSystemComponent *source);
+  void pci_tlb_invalidate(int num, u32 address, int pages);
+  void alloc_code_lines();
+  void alloc_memory();
+  void free_memory();
 
   int iNumCPUs;
-  CFastMutex *cpu_lock_mutex;
+  int iNumCPUThreads; /**< Host threads to run the CPUs on; 0 for one each */
+
+  /// Reservation of each CPU: the granule of its last LDx_L with bit 0 set,
+  /// or 0 if it holds no reservation.
+  std::atomic<u64> cpu_lock_address[4];
+  /// CPUs that may hold a reservation; lets stores skip looking at
+  /// cpu_lock_address when nobody does.
+  std::atomic<int> cpu_lock_flags;
+  u64 cpu_lock_value[4]; /**< Data read by each CPU's last LDx_L */
+
+  /// CPUs that may have each line of main memory in their instruction cache,
+  /// one bit per CPU. Stores to a line with bits set invalidate it there.
+  std::unique_ptr<std::atomic<u8>[]> code_lines;
+
+  /// Scatter-gather TLB of each Pchip, indexed by PCI page number. Each
+  /// entry holds the system page the PCI page maps to in bits <63:32>, the
+  /// PCI page in bits <31:13>, and a valid bit in bit <0>. Filled by
+  /// PCI_Phys_scatter_gather(), emptied through TLBIA and TLBIV.
+  struct SPci_tlb {
+    std::atomic<u64> entry[PCI_TLB_SIZE];
+    std::atomic<u32> epoch; /**< Incremented by each invalidation */
+    std::atomic<u64> hits;
+    std::atomic<u64> misses;
+  } pci_tlb[2];
+
+  /// Serializes interrupt(), which device threads call concurrently, and
+  /// every other read-modify-write of the CChip MISC register.
+  std::mutex irq_mutex;
 
   /// The state structure contains all elements that need to be saved to the
   /// statefile.
   struct SSys_state {
-    int cpu_lock_flags;
-    u64 cpu_lock_address[4];
-
     /**
      * TIGbus state data
      *
@@ -362,6 +491,8 @@ private:
     u32 cf8_address[2];
   } state;
   void *memory;
+  size_t memory_size; /**< Size of main memory in bytes */
+  int memory_fd;      /**< File main memory is mapped from, or -1 */
 
   //    void * memmap;
   int iNumComponents;
@@ -369,6 +500,22 @@ private:
   int iNumMemories;
   struct SMemoryUser *asMemories[MAX_COMPONENTS];
 
+  /**
+   * Page table of the I/O space, used by ReadMem() and WriteMem() to find
+   * the range an address belongs to. Each page points to the list of ranges
+   * that overlap it, devices first, in the order they were registered.
+   * RegisterMemory() keeps it up to date. The lists are shared between
+   * pages and never change; they are kept in io_lists.
+   **/
+  typedef std::vector<struct SMemoryUser *> SMemoryList;
+  std::atomic<std::atomic<const SMemoryList *> *> io_map[IO_CHUNKS];
+  std::set<SMemoryList> io_lists;
+  struct SMemoryUser *find_memory(u64 a);
+  void map_memory(u64 base, u64 length);
+  u64 chipset_read(int index, u32 offset, int dsize, CSystemComponent *source);
+  void chipset_write(int index, u32 offset, u64 data,
+                     CSystemComponent *source);
+
   class CAlphaCPU *acCPUs[4];
 
   CConfigurator *myCfg;
@@ -70,6 +70,17 @@
     }                                                                          \
   }
 
+#if defined(__GNUC__)
+#define DO_CTLZ                                                                \
+  temp_64_2 = RBV;                                                             \
+  RCV = temp_64_2 ? __builtin_clzll(temp_64_2) : 64;
+
+#define DO_CTPOP RCV = __builtin_popcountll(RBV);
+
+#define DO_CTTZ                                                                \
+  temp_64_2 = RBV;                                                             \
+  RCV = temp_64_2 ? __builtin_ctzll(temp_64_2) : 64;
+#else
 #define DO_CTLZ                                                                \
   temp_64 = 0;                                                                 \
   temp_64_2 = RBV;                                                             \
@@ -97,6 +108,7 @@
     else                                                                       \
       temp_64++;                                                               \
   RCV = temp_64;
+#endif
 
 #define DO_CMPULT RCV = ((u64)RAV < (u64)RBV) ? 1 : 0;
 #define DO_CMPULE RCV = ((u64)RAV <= (u64)RBV) ? 1 : 0;
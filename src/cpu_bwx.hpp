@@ -26,28 +26,43 @@
  * serve the general public.
  */
 
-#define DO_CMPBGE                                                              \
-  state.r[REG_3] =                                                             \
-      (((u8)(state.r[REG_1] & 0xff) >= (u8)(V_2 & 0xff)) ? 1 : 0) |            \
-      (((u8)((state.r[REG_1] >> 8) & 0xff) >= (u8)((V_2 >> 8) & 0xff)) ? 2     \
-                                                                       : 0) |  \
-      (((u8)((state.r[REG_1] >> 16) & 0xff) >= (u8)((V_2 >> 16) & 0xff))       \
-           ? 4                                                                 \
-           : 0) |                                                              \
-      (((u8)((state.r[REG_1] >> 24) & 0xff) >= (u8)((V_2 >> 24) & 0xff))       \
-           ? 8                                                                 \
-           : 0) |                                                              \
-      (((u8)((state.r[REG_1] >> 32) & 0xff) >= (u8)((V_2 >> 32) & 0xff))       \
-           ? 16                                                                \
-           : 0) |                                                              \
-      (((u8)((state.r[REG_1] >> 40) & 0xff) >= (u8)((V_2 >> 40) & 0xff))       \
-           ? 32                                                                \
-           : 0) |                                                              \
-      (((u8)((state.r[REG_1] >> 48) & 0xff) >= (u8)((V_2 >> 48) & 0xff))       \
-           ? 64                                                                \
-           : 0) |                                                              \
-      (((u8)((state.r[REG_1] >> 56) & 0xff) >= (u8)((V_2 >> 56) & 0xff)) ? 128 \
-                                                                         : 0);
+#if defined(__SSE2__) || defined(_M_X64) ||                                   \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define ES40_SSE2
+#include <emmintrin.h>
+#endif
+
+#define X64_HIGHBITS U64(0x8080808080808080)
+
+/**
+ * Compare the 8 bytes of a and b as unsigned values, and return a mask with
+ * bit n set if byte n of a is greater than or equal to byte n of b.
+ **/
+inline u64 cmpbge_u64(u64 a, u64 b) {
+#if defined(ES40_SSE2)
+  __m128i va = _mm_loadl_epi64((const __m128i *)&a);
+  __m128i vb = _mm_loadl_epi64((const __m128i *)&b);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(va, vb), va)) & 0xff;
+#else
+  // Bit 7 of each byte of t is set if the low 7 bits of a are >= those of b;
+  // the subtraction never borrows across bytes.
+  u64 t = (a | X64_HIGHBITS) - (b & ~X64_HIGHBITS);
+  u64 ge = ((a & ~b) | (~(a ^ b) & t)) & X64_HIGHBITS;
+  return ((ge >> 7) * U64(0x0102040810204080)) >> 56;
+#endif
+}
+
+/**
+ * Expand the low 8 bits of m to a mask with byte n set to 0xff if bit n of m
+ * is set.
+ **/
+inline u64 byte_mask_u64(u64 m) {
+  u64 t = ((m & 0xff) * U64(0x0101010101010101)) & U64(0x8040201008040201);
+  t = (((t & ~X64_HIGHBITS) + ~X64_HIGHBITS) | t) & X64_HIGHBITS;
+  return (t >> 7) * 0xff;
+}
+
+#define DO_CMPBGE state.r[REG_3] = cmpbge_u64(state.r[REG_1], V_2);
 
 #define DO_EXTBL                                                               \
   state.r[REG_3] = (state.r[REG_1] >> ((V_2 & 7) * 8)) & X64_BYTE;
@@ -113,22 +128,6 @@
 #define DO_SEXTB state.r[REG_3] = sext_u64_8(V_2);
 #define DO_SEXTW state.r[REG_3] = sext_u64_16(V_2);
 
-#define DO_ZAP                                                                 \
-  state.r[REG_3] =                                                             \
-      state.r[REG_1] &                                                         \
-      (((V_2 & 1) ? 0 : U64(0xff)) | ((V_2 & 2) ? 0 : U64(0xff00)) |           \
-       ((V_2 & 4) ? 0 : U64(0xff0000)) | ((V_2 & 8) ? 0 : U64(0xff000000)) |   \
-       ((V_2 & 16) ? 0 : U64(0xff00000000)) |                                  \
-       ((V_2 & 32) ? 0 : U64(0xff0000000000)) |                                \
-       ((V_2 & 64) ? 0 : U64(0xff000000000000)) |                              \
-       ((V_2 & 128) ? 0 : U64(0xff00000000000000)));
+#define DO_ZAP state.r[REG_3] = state.r[REG_1] & ~byte_mask_u64(V_2);
 
-#define DO_ZAPNOT                                                              \
-  state.r[REG_3] =                                                             \
-      state.r[REG_1] &                                                         \
-      (((V_2 & 1) ? U64(0xff) : 0) | ((V_2 & 2) ? U64(0xff00) : 0) |           \
-       ((V_2 & 4) ? U64(0xff0000) : 0) | ((V_2 & 8) ? U64(0xff000000) : 0) |   \
-       ((V_2 & 16) ? U64(0xff00000000) : 0) |                                  \
-       ((V_2 & 32) ? U64(0xff0000000000) : 0) |                                \
-       ((V_2 & 64) ? U64(0xff000000000000) : 0) |                              \
-       ((V_2 & 128) ? U64(0xff00000000000000) : 0));
+#define DO_ZAPNOT state.r[REG_3] = state.r[REG_1] & byte_mask_u64(V_2);
@@ -26,42 +26,50 @@
  * serve the general public.
  */
 
+/* Take a branch. A taken backward branch might close a guest idle loop. */
+#define TAKE_BRANCH                                                            \
+  {                                                                            \
+    add_pc(DISP_21 * 4);                                                       \
+    if (idle_enabled && (s64)DISP_21 < 0)                                      \
+      idle_check();                                                            \
+  }
+
 #define DO_BEQ                                                                 \
   if (!state.r[REG_1])                                                         \
-    add_pc(DISP_21 * 4);
+    TAKE_BRANCH
 
 #define DO_BGE                                                                 \
   if ((s64)state.r[REG_1] >= 0)                                                \
-    add_pc(DISP_21 * 4);
+    TAKE_BRANCH
 
 #define DO_BGT                                                                 \
   if ((s64)state.r[REG_1] > 0)                                                 \
-    add_pc(DISP_21 * 4);
+    TAKE_BRANCH
 
 #define DO_BLBC                                                                \
   if (!(state.r[REG_1] & 1))                                                   \
-    add_pc(DISP_21 * 4);
+    TAKE_BRANCH
 
 #define DO_BLBS                                                                \
   if (state.r[REG_1] & 1)                                                      \
-    add_pc(DISP_21 * 4);
+    TAKE_BRANCH
 
 #define DO_BLE                                                                 \
   if ((s64)state.r[REG_1] <= 0)                                                \
-    add_pc(DISP_21 * 4);
+    TAKE_BRANCH
 
 #define DO_BLT                                                                 \
   if ((s64)state.r[REG_1] < 0)                                                 \
-    add_pc(DISP_21 * 4);
+    TAKE_BRANCH
 
 #define DO_BNE                                                                 \
   if (state.r[REG_1])                                                          \
-    add_pc(DISP_21 * 4);
+    TAKE_BRANCH
 
 #define DO_BR                                                                  \
   {                                                                            \
     state.r[REG_1] = state.pc & ~U64(0x3);                                     \
-    add_pc(DISP_21 * 4);                                                       \
+    TAKE_BRANCH                                                                \
   }
 
 #define DO_BSR DO_BR
@@ -314,73 +314,45 @@ inline u64 ufdiv64(u64 dvd, u64 dvr, u32 prec, u32 *sticky) {
   return quo;                /* return quotient */
 }
 
-/* Fraction square root routine - code from SoftFloat */
+/* Fraction square root routine
+
+   asig is a normalized fraction (bit 63 set) and exp the exponent of the
+   operand; only the parity of exp is used. For an even exponent the result
+   is sqrt(asig), for an odd one sqrt(asig / 2), both as a normalized
+   fraction with a sticky bit in bit 0 when the root is not exact. The root
+   is developed two radicand bits at a time, 60 bits in all, which is more
+   than any of the formats needs for rounding. */
 inline u64 fsqrt64(u64 asig, s32 exp) {
-  static const u32 sqrtOdd[] = {0x0004, 0x0022, 0x005D, 0x00B1, 0x011D, 0x019F,
-                                0x0236, 0x02E0, 0x039C, 0x0468, 0x0545, 0x0631,
-                                0x072B, 0x0832, 0x0946, 0x0A67};
-  static const u32 sqrtEven[] = {0x0A2D, 0x08AF, 0x075A, 0x0629, 0x051A, 0x0429,
-                                 0x0356, 0x029E, 0x0200, 0x0179, 0x0109, 0x00AF,
-                                 0x0068, 0x0034, 0x0012, 0x0002};
-
-  u64 zsig;
-  u64 remh;
-  u64 reml;
+  u64 hi;   /* radicand, high half */
+  u64 lo;   /* radicand, low half */
+  u64 root; /* partial root */
+  u64 rem;  /* partial remainder */
   u64 t;
-  u32 index;
-  u32 z;
-  u32 a;
-  u32 sticky = 0;
-
-  /* Calculate an approximation to the square root of the 32-bit significand
-   given by 'a'.  Considered as an integer, 'a' must be at least 2^31.  If bit 0
-   of 'exp' (the least significant bit) is 1, the integer returned approximates
-   2^31*sqrt('a'/2^31), where 'a' is considered an integer.  If bit 0 of 'exp'
-   is 0, the integer returned approximates 2^31*sqrt('a'/2^30).  In either
-   case, the approximation returned lies strictly within +/-2 of the exact
-   value. */
-  a = (u32)(asig >> 32);                     /* high order frac */
-  index = (a >> 27) & 0xF;                   /* bits<30:27> */
-  if (exp & 1) {                             /* odd exp? */
-    z = 0x4000 + (a >> 17) - sqrtOdd[index]; /* initial guess */
-    z = ((a / z) << 14) + (z << 15);         /* Newton iteration */
-    a = a >> 1;
+  u32 i;
+
+  if (exp & 1) { /* odd exp? */
+    hi = asig >> 1;
+    lo = asig << 63;
   } else {
-    z = 0x8000 + (a >> 17) - sqrtEven[index]; /* initial guess */
-    z = (a / z) + z;                          /* Newton iteration */
-    z = (z >= 0x20000) ? 0xFFFF8000 : (z << 15);
-    if (z <= a)
-      z = (a >> 1) | 0x80000000;
+    hi = asig;
+    lo = 0;
   }
 
-  zsig = (((((u64)a) << 31) / ((u64)z)) + (z >> 1)) & X64_LONG;
-
-  /* Calculate the final answer in two steps.  First, do one iteration of
-   Newton's approximation.  The divide-by-2 is accomplished by clever
-   positioning of the operands.  Then, check the bits just below the
-   (double precision) rounding bit to see if they are close to zero
-   (that is, the rounding bits are close to midpoint).  If so, make
-   sure that the result^2 is <below> the input operand */
-  asig = asig >> ((exp & 1) ? 3 : 2); /* leave 2b guard */
-  zsig =
-      ufdiv64(asig, zsig << 32, 64, NULL) + (zsig << 30); /* Newton iteration */
-  if ((zsig & 0x1FF) <= 5) {                              /* close to even? */
-    remh = uemul64(zsig, zsig, &reml);                    /* result^2 */
-    remh = (asig - remh - (reml ? 1 : 0)) & X64_QUAD;     /* arg - result^2 */
-    reml = NEG_Q(reml);
-    while (Q_GETSIGN(remh) != 0) {      /* if arg < result^2 */
-      zsig = (zsig - 1) & X64_QUAD;     /* decr result */
-      t = ((zsig << 1) & X64_QUAD) | 1; /* incr result^2 */
-      reml = (reml + t) & X64_QUAD;     /* and retest */
-      remh = (remh + (zsig >> 63) + ((reml < t) ? 1 : 0)) & X64_QUAD;
+  root = 0;
+  rem = 0;
+  for (i = 0; i < 60; i++) { /* 2 bits per step */
+    rem = (rem << 2) | (hi >> 62);
+    hi = (hi << 2) | (lo >> 62);
+    lo = lo << 2;
+    t = (root << 2) | 1; /* trial subtrahend */
+    root = root << 1;
+    if (rem >= t) {
+      rem = rem - t;
+      root = root | 1;
     }
+  }
 
-    if ((remh | reml) != 0)
-      sticky = 1;
-  } /* not exact? */
-
-  zsig = (zsig << 1) | sticky; /* left justify result */
-  return zsig;
+  return (root << 4) | ((rem | hi | lo) ? 1 : 0); /* left justify, sticky */
 }
 
 // INTERRUPT VECTORS
@@ -411,8 +383,9 @@ inline u64 fsqrt64(u64 asig, s32 exp) {
 /** Implementation version [HRM p 2-38; ARM p D-5] */
 #define CPU_IMPLVER 2
 
-/** Architecture mask [HRM p 2-38; ARM p D-4]; FIX not implemented */
-#define CPU_AMASK U64(0x1305)
+/** Architecture mask [HRM p 2-38; ARM p D-4]; BWX, FIX, CIX, MVI, precise
+ * arithmetic traps and prefetch with modify intent */
+#define CPU_AMASK U64(0x1307)
 #define DISP_12 (sext_u64_12(ins))
 #define DISP_13 (sext_u64_13(ins))
 #define DISP_16 (sext_u64_16(ins))
@@ -432,25 +405,56 @@ inline u64 fsqrt64(u64 asig, s32 exp) {
    https://github.com/gdwnldsKSC/es40/commit/dad191fb2f279164122654aba6da53acc1040d97
 */
 
+#define UNALIGN_TRAP(addr, flags, align)                                       \
+  {                                                                            \
+    state.fault_va = addr;                                                     \
+    state.exc_sum = ((REG_1 &0x1f) << 8);                                      \
+    state.mm_stat = (I_GETOP(ins) << 4) | ((flags & ACCESS_WRITE) ? 1 : 0);    \
+    printf("unaligned addess %d, %d -> trap! ",flags,align);                   \
+    printf("exc_sum = 0x%04" PRId64 "x, fault_va = 0x%016" PRId64              \
+        "x, mm_stat = 0x%03" PRId64 "x.\n",state.exc_sum, state.fault_va,      \
+        state.mm_stat);                                                        \
+    GO_PAL(UNALIGN);                                                           \
+    return;                                                                    \
+  }
+
+/**
+ * Translate a data address, for an access that is split up into single
+ * bytes (pbc is set) when it crosses a page boundary and unaligned_fixup
+ * is enabled. Both pages are translated before anything is accessed, so a
+ * fault on either half is taken before the access is done, like it would be
+ * in the operating system's fixup handler. The access is counted by
+ * unalign_fixup() once all of its bytes have been transferred. Without
+ * unaligned_fixup such an access traps to the PALcode.
+ **/
 #define DATA_PHYS(addr, flags, align)                                          \
   if ((addr) & (align)) {                                                      \
     u64 a1 = (addr);                                                           \
     u64 a2 = (addr) + (align);                                                 \
     if ((a1 ^ a2) & ~U64(0x1fff)) /* 8K page boundary crossed*/                \
     {                                                                          \
-      state.fault_va = addr;                                                   \
-      state.exc_sum = ((REG_1 &0x1f) << 8);                                    \
-      state.mm_stat = (I_GETOP(ins) << 4) | ((flags & ACCESS_WRITE) ? 1 : 0);  \
-      printf("unaligned addess %d, %d -> trap! ",flags,align);                 \
-      printf("exc_sum = 0x%04" PRId64 "x, fault_va = 0x%016" PRId64            \
-          "x, mm_stat = 0x%03" PRId64 "x.\n",state.exc_sum, state.fault_va,    \
-          state.mm_stat);                                                      \
-      GO_PAL(UNALIGN);                                                         \
-      return;                                                                  \
+      if (!unalign_enabled)                                                    \
+        UNALIGN_TRAP(addr, flags, align)                                       \
+      DATA_PHYS_NT(a1, flags);                                                 \
+      DATA_PHYS_NT(a2, flags);                                                 \
+      pbc = true;                                                              \
     }                                                                          \
   }                                                                            \
   DATA_PHYS_NT(addr, flags) // use the define above instead of duplicating
 
+/**
+ * Variant of DATA_PHYS for LDx_L and STx_C, that always traps on an
+ * unaligned access across a page boundary.
+ **/
+#define DATA_PHYS_LOCK(addr, flags, align)                                     \
+  if ((addr) & (align)) {                                                      \
+    u64 a1 = (addr);                                                           \
+    u64 a2 = (addr) + (align);                                                 \
+    if ((a1 ^ a2) & ~U64(0x1fff)) /* 8K page boundary crossed*/                \
+      UNALIGN_TRAP(addr, flags, align)                                         \
+  }                                                                            \
+  DATA_PHYS_NT(addr, flags)
+
 /**
  * Normal variant of read action
  * In reality, these would generate an alignment trap, and the exception
@@ -469,23 +473,70 @@ inline u64 fsqrt64(u64 asig, s32 exp) {
   cSystem->ReadMem(phys_address, size, this);                                  \
   LLR
 
+/**
+ * Soft TLB fast path of READ_VIRT and WRITE_VIRT. An aligned access to a
+ * page in the soft TLB goes straight to host memory; anything else takes the
+ * normal path through virt2phys() and CSystem::ReadMem() or WriteMem(), after
+ * which the page is entered in the soft TLB if it is in main memory. Stores
+ * on the fast path break other CPUs' LDx_L reservations like WriteMem()
+ * does.
+ **/
+#if defined(IDB)
+#define STLB_HOST(va, size, flags) ((u8 *)nullptr)
+#define STLB_FILL(va, flags)
+#else
+#define STLB_HOST(va, size, flags) stlb_host(va, (size / 8) - 1, flags)
+#define STLB_FILL(va, flags) stlb_fill(va, phys_address, flags)
+#endif
+
+#define HOST_READ(p, size)                                                     \
+  ((size) == 8    ? (u64)(*(u8 *)(p))                                          \
+   : (size) == 16 ? (u64)endian_16(*(u16 *)(p))                                \
+   : (size) == 32 ? (u64)endian_32(*(u32 *)(p))                                \
+   : endian_64(*(u64 *)(p)))
+
+#define HOST_WRITE(p, size, data)                                              \
+  switch (size) {                                                              \
+  case 8:                                                                      \
+    *(u8 *)(p) = (u8)(data);                                                   \
+    break;                                                                     \
+  case 16:                                                                     \
+    *(u16 *)(p) = endian_16((u16)(data));                                      \
+    break;                                                                     \
+  case 32:                                                                     \
+    *(u32 *)(p) = endian_32((u32)(data));                                      \
+    break;                                                                     \
+  default:                                                                     \
+    *(u64 *)(p) = endian_64((u64)(data));                                      \
+  }
+
 #define READ_VIRT(va, size, dest)                                              \
-  pbc = false;                                                                 \
-  DATA_PHYS(va, ACCESS_READ, (size / 8) - 1);                                  \
-  LLR;                                                                         \
-  if (pbc) {                                                                   \
-    dest = 0;                                                                  \
-    for (int ii = 0; ii < (size / 8); ii++) {                                  \
-      DATA_PHYS(va + ii, ACCESS_READ, 0);                                      \
-      dest |= (cSystem->ReadMem(phys_address, 8, this) << (ii * 8));           \
+  {                                                                            \
+    u64 stlb_va = (va);                                                        \
+    u8 *stlb_p = STLB_HOST(stlb_va, size, ACCESS_READ);                        \
+    if (stlb_p) {                                                              \
+      dest = HOST_READ(stlb_p, size);                                          \
+    } else {                                                                   \
+      pbc = false;                                                             \
+      DATA_PHYS(stlb_va, ACCESS_READ, (size / 8) - 1);                         \
+      LLR;                                                                     \
+      STLB_FILL(stlb_va, ACCESS_READ);                                         \
+      if (pbc) {                                                               \
+        dest = 0;                                                              \
+        for (int ii = 0; ii < (size / 8); ii++) {                              \
+          DATA_PHYS(stlb_va + ii, ACCESS_READ, 0);                             \
+          dest |= (cSystem->ReadMem(phys_address, 8, this) << (ii * 8));       \
+        }                                                                      \
+        unalign_fixup();                                                       \
+      } else {                                                                 \
+        dest = cSystem->ReadMem(phys_address, size, this);                     \
+      }                                                                        \
     }                                                                          \
-  } else {                                                                     \
-    dest = cSystem->ReadMem(phys_address, size, this);                         \
   }
 
 #define READ_VIRT_LOCK(va, size, dest)                                         \
   pbc = false;                                                                 \
-  DATA_PHYS(va, ACCESS_READ, (size / 8) - 1);                                  \
+  DATA_PHYS_LOCK(va, ACCESS_READ, (size / 8) - 1);                             \
   LLR;                                                                         \
   cSystem->cpu_lock(state.iProcNum, phys_address);                             \
   if (pbc) {                                                                   \
@@ -496,26 +547,37 @@ inline u64 fsqrt64(u64 asig, s32 exp) {
     }                                                                          \
   } else {                                                                     \
     dest = cSystem->ReadMem(phys_address, size, this);                         \
-  }
+  }                                                                            \
+  cSystem->cpu_lock_data(state.iProcNum, dest);
 
 #define READ_VIRT_F(va, size, dest, f)                                         \
-  pbc = false;                                                                 \
-  DATA_PHYS(va, ACCESS_READ, (size / 8) - 1);                                  \
-  LLR;                                                                         \
-  if (pbc) {                                                                   \
-    u64 aa = 0;                                                                \
-    for (int ii = 0; ii < (size / 8); ii++) {                                  \
-      DATA_PHYS(va + ii, ACCESS_READ, 0);                                      \
-      aa |= (cSystem->ReadMem(phys_address, 8, this) << (ii * 8));             \
+  {                                                                            \
+    u64 stlb_va = (va);                                                        \
+    u8 *stlb_p = STLB_HOST(stlb_va, size, ACCESS_READ);                        \
+    if (stlb_p) {                                                              \
+      dest = f(HOST_READ(stlb_p, size));                                       \
+    } else {                                                                   \
+      pbc = false;                                                             \
+      DATA_PHYS(stlb_va, ACCESS_READ, (size / 8) - 1);                         \
+      LLR;                                                                     \
+      STLB_FILL(stlb_va, ACCESS_READ);                                         \
+      if (pbc) {                                                               \
+        u64 aa = 0;                                                            \
+        for (int ii = 0; ii < (size / 8); ii++) {                              \
+          DATA_PHYS(stlb_va + ii, ACCESS_READ, 0);                             \
+          aa |= (cSystem->ReadMem(phys_address, 8, this) << (ii * 8));         \
+        }                                                                      \
+        unalign_fixup();                                                       \
+        dest = f(aa);                                                          \
+      } else {                                                                 \
+        dest = f(cSystem->ReadMem(phys_address, size, this));                  \
+      }                                                                        \
     }                                                                          \
-    dest = f(aa);                                                              \
-  } else {                                                                     \
-    dest = f(cSystem->ReadMem(phys_address, size, this));                      \
   }
 
 #define READ_VIRT_LOCK_F(va, size, dest, f)                                    \
   pbc = false;                                                                 \
-  DATA_PHYS(va, ACCESS_READ, (size / 8) - 1);                                  \
+  DATA_PHYS_LOCK(va, ACCESS_READ, (size / 8) - 1);                             \
   LLR;                                                                         \
   cSystem->cpu_lock(state.iProcNum, phys_address);                             \
   if (pbc) {                                                                   \
@@ -527,7 +589,8 @@ inline u64 fsqrt64(u64 asig, s32 exp) {
     dest = f(aa);                                                              \
   } else {                                                                     \
     dest = f(cSystem->ReadMem(phys_address, size, this));                      \
-  }
+  }                                                                            \
+  cSystem->cpu_lock_data(state.iProcNum, dest);
 
 /**
  * Normal variant of write action
@@ -540,18 +603,29 @@ inline u64 fsqrt64(u64 asig, s32 exp) {
   LWR
 
 #define WRITE_VIRT(va, size, src)                                              \
-  pbc = false;                                                                 \
-  DATA_PHYS(va, ACCESS_WRITE, (size / 8) - 1);                                 \
-  LWR;                                                                         \
-  if (pbc) {                                                                   \
-    u64 aa = src;                                                              \
-    for (int ii = 0; ii < (size / 8); ii++) {                                  \
-      DATA_PHYS(va + ii, ACCESS_WRITE, 0);                                     \
-      cSystem->WriteMem(phys_address, 8, aa, this);                            \
-      aa >>= 8;                                                                \
+  {                                                                            \
+    u64 stlb_va = (va);                                                        \
+    u8 *stlb_p = STLB_HOST(stlb_va, size, ACCESS_WRITE);                       \
+    if (stlb_p) {                                                              \
+      HOST_WRITE(stlb_p, size, src);                                           \
+      cSystem->cpu_stored(cSystem->MemToPhys(stlb_p), this);                   \
+    } else {                                                                   \
+      pbc = false;                                                             \
+      DATA_PHYS(stlb_va, ACCESS_WRITE, (size / 8) - 1);                        \
+      LWR;                                                                     \
+      STLB_FILL(stlb_va, ACCESS_WRITE);                                        \
+      if (pbc) {                                                               \
+        u64 aa = src;                                                          \
+        for (int ii = 0; ii < (size / 8); ii++) {                              \
+          DATA_PHYS(stlb_va + ii, ACCESS_WRITE, 0);                            \
+          cSystem->WriteMem(phys_address, 8, aa, this);                        \
+          aa >>= 8;                                                            \
+        }                                                                      \
+        unalign_fixup();                                                       \
+      } else {                                                                 \
+        cSystem->WriteMem(phys_address, size, src, this);                      \
+      }                                                                        \
     }                                                                          \
-  } else {                                                                     \
-    cSystem->WriteMem(phys_address, size, src, this);                          \
   }
 
 /**
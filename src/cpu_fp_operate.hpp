@@ -155,10 +155,15 @@
 
 #define DO_CMPTUN                                                              \
   FPSTART;                                                                     \
-  state.f[FREG_3] = ((ieee_unpack(state.f[FREG_1], &ufp1, ins) == UFT_NAN) ||  \
-                     (ieee_unpack(state.f[FREG_2], &ufp2, ins) == UFT_NAN))    \
-                        ? FP_TRUE                                              \
-                        : 0;
+  {                                                                            \
+    UFP ufp1;                                                                  \
+    UFP ufp2;                                                                  \
+    state.f[FREG_3] =                                                          \
+        ((ieee_unpack(state.f[FREG_1], &ufp1, ins) == UFT_NAN) ||              \
+         (ieee_unpack(state.f[FREG_2], &ufp2, ins) == UFT_NAN))                \
+            ? FP_TRUE                                                          \
+            : 0;                                                               \
+  }
 
 /* format conversions */
 #define DO_CVTQL                                                               \
@@ -203,18 +208,27 @@
 
 #define DO_CVTGD                                                               \
   FPSTART;                                                                     \
-  vax_unpack(state.f[FREG_2], &ufp2, ins);                                     \
-  state.f[FREG_3] = vax_rpack_d(&ufp2, ins);
+  {                                                                            \
+    UFP ufp2;                                                                  \
+    vax_unpack(state.f[FREG_2], &ufp2, ins);                                   \
+    state.f[FREG_3] = vax_rpack_d(&ufp2, ins);                                 \
+  }
 
 #define DO_CVTDG                                                               \
   FPSTART;                                                                     \
-  vax_unpack_d(state.f[FREG_2], &ufp2, ins);                                   \
-  state.f[FREG_3] = vax_rpack(&ufp2, ins, DT_G);
+  {                                                                            \
+    UFP ufp2;                                                                  \
+    vax_unpack_d(state.f[FREG_2], &ufp2, ins);                                 \
+    state.f[FREG_3] = vax_rpack(&ufp2, ins, DT_G);                             \
+  }
 
 #define DO_CVTGF                                                               \
   FPSTART;                                                                     \
-  vax_unpack(state.f[FREG_2], &ufp2, ins);                                     \
-  state.f[FREG_3] = vax_rpack(&ufp2, ins, DT_F);
+  {                                                                            \
+    UFP ufp2;                                                                  \
+    vax_unpack(state.f[FREG_2], &ufp2, ins);                                   \
+    state.f[FREG_3] = vax_rpack(&ufp2, ins, DT_F);                             \
+  }
 
 #define DO_CVTST                                                               \
   FPSTART;                                                                     \
@@ -227,7 +241,7 @@
 /* float <-> integer register moves */
 #define DO_FTOIS                                                               \
   FPSTART;                                                                     \
-  state.r[REG_3] = ieee_sts(state.f[FREG_1]);
+  state.r[REG_3] = sext_u64_32(ieee_sts(state.f[FREG_1]));
 
 #define DO_FTOIT                                                               \
   FPSTART;                                                                     \
@@ -362,31 +376,33 @@
   FPSTART;                                                                     \
   state.fpcr = state.f[FREG_1];
 
+// Arithmetic goes through the new implementation, like the square roots
+// below; ieee_host and vax_host do the common case on the host FPU.
 #define DO_ADDG                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2g(g2host(state.f[FREG_1]) + g2host(state.f[FREG_2]));
+  state.f[FREG_3] = vax_fadd(state.f[FREG_1], state.f[FREG_2], ins, DT_G, 0);
 #define DO_ADDF                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2f(f2host(state.f[FREG_1]) + f2host(state.f[FREG_2]));
+  state.f[FREG_3] = vax_fadd(state.f[FREG_1], state.f[FREG_2], ins, DT_F, 0);
 #define DO_ADDT                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2t(t2host(state.f[FREG_1]) + t2host(state.f[FREG_2]));
+  state.f[FREG_3] = ieee_fadd(state.f[FREG_1], state.f[FREG_2], ins, DT_T, 0);
 #define DO_ADDS                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2s(s2host(state.f[FREG_1]) + s2host(state.f[FREG_2]));
+  state.f[FREG_3] = ieee_fadd(state.f[FREG_1], state.f[FREG_2], ins, DT_S, 0);
 
 #define DO_SUBG                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2g(g2host(state.f[FREG_1]) - g2host(state.f[FREG_2]));
+  state.f[FREG_3] = vax_fadd(state.f[FREG_1], state.f[FREG_2], ins, DT_G, 1);
 #define DO_SUBF                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2f(f2host(state.f[FREG_1]) - f2host(state.f[FREG_2]));
+  state.f[FREG_3] = vax_fadd(state.f[FREG_1], state.f[FREG_2], ins, DT_F, 1);
 #define DO_SUBT                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2t(t2host(state.f[FREG_1]) - t2host(state.f[FREG_2]));
+  state.f[FREG_3] = ieee_fadd(state.f[FREG_1], state.f[FREG_2], ins, DT_T, 1);
 #define DO_SUBS                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2s(s2host(state.f[FREG_1]) - s2host(state.f[FREG_2]));
+  state.f[FREG_3] = ieee_fadd(state.f[FREG_1], state.f[FREG_2], ins, DT_S, 1);
 
 #define DO_CMPGEQ                                                              \
   FPSTART;                                                                     \
@@ -456,11 +472,7 @@
 
 #define DO_FTOIS                                                               \
   FPSTART;                                                                     \
-  temp_64 = state.f[FREG_1];                                                   \
-  state.r[REG_3] =                                                             \
-      (temp_64 & U64(0x000000003fffffff)) |                                    \
-      ((temp_64 & U64(0xc000000000000000)) >> 32) |                            \
-      (((temp_64 & U64(0x8000000000000000)) >> 31) * U64(0xffffffff));
+  state.r[REG_3] = sext_u64_32(store_s(state.f[FREG_1]));
 
 #define DO_FTOIT                                                               \
   FPSTART;                                                                     \
@@ -477,42 +489,44 @@
 
 #define DO_MULG                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2g(g2host(state.f[FREG_1]) * g2host(state.f[FREG_2]));
+  state.f[FREG_3] = vax_fmul(state.f[FREG_1], state.f[FREG_2], ins, DT_G);
 #define DO_MULF                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2f(f2host(state.f[FREG_1]) * f2host(state.f[FREG_2]));
+  state.f[FREG_3] = vax_fmul(state.f[FREG_1], state.f[FREG_2], ins, DT_F);
 #define DO_MULT                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2t(t2host(state.f[FREG_1]) * t2host(state.f[FREG_2]));
+  state.f[FREG_3] = ieee_fmul(state.f[FREG_1], state.f[FREG_2], ins, DT_T);
 #define DO_MULS                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2s(s2host(state.f[FREG_1]) * s2host(state.f[FREG_2]));
+  state.f[FREG_3] = ieee_fmul(state.f[FREG_1], state.f[FREG_2], ins, DT_S);
 
 #define DO_DIVG                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2g(g2host(state.f[FREG_1]) / g2host(state.f[FREG_2]));
+  state.f[FREG_3] = vax_fdiv(state.f[FREG_1], state.f[FREG_2], ins, DT_G);
 #define DO_DIVF                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2f(f2host(state.f[FREG_1]) / f2host(state.f[FREG_2]));
+  state.f[FREG_3] = vax_fdiv(state.f[FREG_1], state.f[FREG_2], ins, DT_F);
 #define DO_DIVT                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2t(t2host(state.f[FREG_1]) / t2host(state.f[FREG_2]));
+  state.f[FREG_3] = ieee_fdiv(state.f[FREG_1], state.f[FREG_2], ins, DT_T);
 #define DO_DIVS                                                                \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2s(s2host(state.f[FREG_1]) / s2host(state.f[FREG_2]));
+  state.f[FREG_3] = ieee_fdiv(state.f[FREG_1], state.f[FREG_2], ins, DT_S);
 
+// Square roots always go through the new implementation, which honours the
+// rounding and trap qualifiers; SQRT of a negative number has to trap.
 #define DO_SQRTG                                                               \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2g(sqrt(g2host(state.f[FREG_2])));
+  state.f[FREG_3] = vax_sqrt(state.f[FREG_2], ins, DT_G);
 #define DO_SQRTF                                                               \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2f(sqrt(f2host(state.f[FREG_2])));
+  state.f[FREG_3] = vax_sqrt(state.f[FREG_2], ins, DT_F);
 #define DO_SQRTT                                                               \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2t(sqrt(t2host(state.f[FREG_2])));
+  state.f[FREG_3] = ieee_sqrt(state.f[FREG_2], ins, DT_T);
 #define DO_SQRTS                                                               \
   FPSTART;                                                                     \
-  state.f[FREG_3] = host2s(sqrt(s2host(state.f[FREG_2])));
+  state.f[FREG_3] = ieee_sqrt(state.f[FREG_2], ins, DT_S);
 
 #define DO_CVTST                                                               \
   FPSTART;                                                                     \
@@ -53,8 +53,10 @@
 
 #define DO_STL_C                                                               \
   if (cSystem->cpu_unlock(state.iProcNum)) {                                   \
-    WRITE_VIRT(state.r[REG_2] + DISP_16, 32, state.r[REG_1]);                  \
-    state.r[REG_1] = 1;                                                        \
+    DATA_PHYS_LOCK(state.r[REG_2] + DISP_16, ACCESS_WRITE, 3);                 \
+    LWR;                                                                       \
+    state.r[REG_1] = cSystem->cpu_store_cond(state.iProcNum, phys_address, 32,  \
+                                             state.r[REG_1], this);            \
   } else                                                                       \
     state.r[REG_1] = 0;
 
@@ -62,8 +64,10 @@
 
 #define DO_STQ_C                                                               \
   if (cSystem->cpu_unlock(state.iProcNum)) {                                   \
-    WRITE_VIRT(state.r[REG_2] + DISP_16, 64, state.r[REG_1]);                  \
-    state.r[REG_1] = 1;                                                        \
+    DATA_PHYS_LOCK(state.r[REG_2] + DISP_16, ACCESS_WRITE, 7);                 \
+    LWR;                                                                       \
+    state.r[REG_1] = cSystem->cpu_store_cond(state.iProcNum, phys_address, 64,  \
+                                             state.r[REG_1], this);            \
   } else                                                                       \
     state.r[REG_1] = 0;
 
@@ -33,6 +33,10 @@
       ((function > 0x3f) && (function < 0x80)) || (function > 0xbf)) {         \
     UNKNOWN2                                                                   \
   } else {                                                                     \
+    if (osfpal_enabled && (function == 0x30 || function == 0x0a))              \
+      osfpal_swap(function);                                                   \
+    if (idle_enabled && function == 0x3e && !state.pal_vms)                    \
+      idle_sleep(0); /* WTINT: the OS is idle, and waits for an interrupt */   \
     if (state.pal_vms) {                                                       \
       switch (function) {                                                      \
       case 0x01: /* CFLUSH */                                                  \
@@ -241,7 +245,7 @@
                ((function & 0x3f) << 6) | 1);                                  \
         TRC(true, false)                                                       \
       }                                                                        \
-    } else {                                                                   \
+    } else if (!osfpal_active || !osfpal_call(function)) {                     \
       state.r[32 + 23] = state.pc;                                             \
       set_pc(state.pal_base | (1 << 13) | ((function & 0x80) << 5) |           \
              ((function & 0x3f) << 6) | 1);                                    \
@@ -252,14 +256,24 @@
 #define DO_IMPLVER state.r[REG_3] = CPU_IMPLVER;
 
 #define DO_RPCC                                                                \
+  sync_clock();                                                                \
   state.r[REG_1] = ((u64)state.cc_offset) << 32 | (state.cc & U64(0xffffffff));
 
-// The following ops have no function right now (at least, not until multiple
-// CPU's are supported).
+// With more than one CPU, each runs in its own host thread, so MB and WMB
+// have to order the host memory accesses too. LDx_L/STx_C already use host
+// atomics (see CSystem::cpu_store_cond). With a single CPU there is nothing to
+// order against, and the fences are skipped.
+#define DO_MB                                                                  \
+  if (cSystem->get_cpu_num() > 1)                                              \
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+#define DO_WMB                                                                 \
+  if (cSystem->get_cpu_num() > 1)                                              \
+    std::atomic_thread_fence(std::memory_order_release);
+
+// The following ops have no function right now.
 #define DO_TRAPB ;
 #define DO_EXCB ;
-#define DO_MB ;
-#define DO_WMB ;
 #define DO_FETCH ;
 #define DO_FETCH_M ;
 #define DO_ECB ;
@@ -26,121 +26,99 @@
  * serve the general public.
  */
 
-#define DO_MINUB8                                                              \
-  temp_64 = 0;                                                                 \
-  temp_64_1 = state.r[REG_1];                                                  \
-  temp_64_2 = V_2;                                                             \
-  for (i = 0; i < 64; i += 8) {                                                \
-    if ((u8)((temp_64_1 >> i) & X64_BYTE) > (u8)((temp_64_2 >> i) & X64_BYTE)) \
-      temp_64 |= (((temp_64_2 >> i) & X64_BYTE) << i);                         \
-    else                                                                       \
-      temp_64 |= (((temp_64_1 >> i) & X64_BYTE) << i);                         \
-  }                                                                            \
-  state.r[REG_3] = temp_64;
+/**
+ * Scalar versions of the MVI byte and word minimum / maximum operations.
+ * Select, per element of the given width and signedness, the element of b
+ * if (a > b) == min, the element of a otherwise.
+ **/
+#define MVI_MINMAX(name, type, width, mask, min)                               \
+  inline u64 name(u64 a, u64 b) {                                              \
+    u64 r = 0;                                                                 \
+    for (int i = 0; i < 64; i += width) {                                      \
+      if (((type)((a >> i) & mask) > (type)((b >> i) & mask)) == min)          \
+        r |= ((b >> i) & mask) << i;                                           \
+      else                                                                     \
+        r |= ((a >> i) & mask) << i;                                           \
+    }                                                                          \
+    return r;                                                                  \
+  }
 
-#define DO_MINSB8                                                              \
-  temp_64 = 0;                                                                 \
-  temp_64_1 = state.r[REG_1];                                                  \
-  temp_64_2 = V_2;                                                             \
-  for (i = 0; i < 64; i += 8) {                                                \
-    if ((s8)((temp_64_1 >> i) & X64_BYTE) > (s8)((temp_64_2 >> i) & X64_BYTE)) \
-      temp_64 |= (((temp_64_2 >> i) & X64_BYTE) << i);                         \
-    else                                                                       \
-      temp_64 |= (((temp_64_1 >> i) & X64_BYTE) << i);                         \
-  }                                                                            \
-  state.r[REG_3] = temp_64;
+#if defined(ES40_SSE2)
 
-#define DO_MINUW4                                                              \
-  temp_64 = 0;                                                                 \
-  temp_64_1 = state.r[REG_1];                                                  \
-  temp_64_2 = V_2;                                                             \
-  for (i = 0; i < 64; i += 16) {                                               \
-    if ((u16)((temp_64_1 >> i) & X64_WORD) >                                   \
-        (u16)((temp_64_2 >> i) & X64_WORD))                                    \
-      temp_64 |= (((temp_64_2 >> i) & X64_WORD) << i);                         \
-    else                                                                       \
-      temp_64 |= (((temp_64_1 >> i) & X64_WORD) << i);                         \
-  }                                                                            \
-  state.r[REG_3] = temp_64;
+#define MVI_LOAD(x) _mm_loadl_epi64((const __m128i *)&(x))
 
-#define DO_MINSW4                                                              \
-  temp_64 = 0;                                                                 \
-  temp_64_1 = state.r[REG_1];                                                  \
-  temp_64_2 = V_2;                                                             \
-  for (i = 0; i < 64; i += 16) {                                               \
-    if ((s16)((temp_64_1 >> i) & X64_WORD) >                                   \
-        (s16)((temp_64_2 >> i) & X64_WORD))                                    \
-      temp_64 |= (((temp_64_2 >> i) & X64_WORD) << i);                         \
-    else                                                                       \
-      temp_64 |= (((temp_64_1 >> i) & X64_WORD) << i);                         \
-  }                                                                            \
-  state.r[REG_3] = temp_64;
+inline u64 mvi_store(__m128i v) {
+  u64 r;
+  _mm_storel_epi64((__m128i *)&r, v);
+  return r;
+}
 
-#define DO_MAXUB8                                                              \
-  temp_64 = 0;                                                                 \
-  temp_64_1 = state.r[REG_1];                                                  \
-  temp_64_2 = V_2;                                                             \
-  for (i = 0; i < 64; i += 8) {                                                \
-    if ((u8)((temp_64_1 >> i) & X64_BYTE) > (u8)((temp_64_2 >> i) & X64_BYTE)) \
-      temp_64 |= (((temp_64_1 >> i) & X64_BYTE) << i);                         \
-    else                                                                       \
-      temp_64 |= (((temp_64_2 >> i) & X64_BYTE) << i);                         \
-  }                                                                            \
-  state.r[REG_3] = temp_64;
+// SSE2 only has unsigned byte and signed word minimum / maximum; the other
+// two are done by flipping the sign bits.
+inline u64 mvi_minub8(u64 a, u64 b) {
+  return mvi_store(_mm_min_epu8(MVI_LOAD(a), MVI_LOAD(b)));
+}
+inline u64 mvi_maxub8(u64 a, u64 b) {
+  return mvi_store(_mm_max_epu8(MVI_LOAD(a), MVI_LOAD(b)));
+}
+inline u64 mvi_minsb8(u64 a, u64 b) {
+  return mvi_minub8(a ^ X64_HIGHBITS, b ^ X64_HIGHBITS) ^ X64_HIGHBITS;
+}
+inline u64 mvi_maxsb8(u64 a, u64 b) {
+  return mvi_maxub8(a ^ X64_HIGHBITS, b ^ X64_HIGHBITS) ^ X64_HIGHBITS;
+}
+inline u64 mvi_minsw4(u64 a, u64 b) {
+  return mvi_store(_mm_min_epi16(MVI_LOAD(a), MVI_LOAD(b)));
+}
+inline u64 mvi_maxsw4(u64 a, u64 b) {
+  return mvi_store(_mm_max_epi16(MVI_LOAD(a), MVI_LOAD(b)));
+}
+inline u64 mvi_minuw4(u64 a, u64 b) {
+  const u64 s = U64(0x8000800080008000);
+  return mvi_minsw4(a ^ s, b ^ s) ^ s;
+}
+inline u64 mvi_maxuw4(u64 a, u64 b) {
+  const u64 s = U64(0x8000800080008000);
+  return mvi_maxsw4(a ^ s, b ^ s) ^ s;
+}
+inline u64 mvi_perr(u64 a, u64 b) {
+  return mvi_store(_mm_sad_epu8(MVI_LOAD(a), MVI_LOAD(b)));
+}
 
-#define DO_MAXSB8                                                              \
-  temp_64 = 0;                                                                 \
-  temp_64_1 = state.r[REG_1];                                                  \
-  temp_64_2 = V_2;                                                             \
-  for (i = 0; i < 64; i += 8) {                                                \
-    if ((s8)((temp_64_1 >> i) & X64_BYTE) > (s8)((temp_64_2 >> i) & X64_BYTE)) \
-      temp_64 |= (((temp_64_1 >> i) & X64_BYTE) << i);                         \
-    else                                                                       \
-      temp_64 |= (((temp_64_2 >> i) & X64_BYTE) << i);                         \
-  }                                                                            \
-  state.r[REG_3] = temp_64;
+#else // defined(ES40_SSE2)
 
-#define DO_MAXUW4                                                              \
-  temp_64 = 0;                                                                 \
-  temp_64_1 = state.r[REG_1];                                                  \
-  temp_64_2 = V_2;                                                             \
-  for (i = 0; i < 64; i += 16) {                                               \
-    if ((u16)((temp_64_1 >> i) & X64_WORD) >                                   \
-        (u16)((temp_64_2 >> i) & X64_WORD))                                    \
-      temp_64 |= (((temp_64_1 >> i) & X64_WORD) << i);                         \
-    else                                                                       \
-      temp_64 |= (((temp_64_2 >> i) & X64_WORD) << i);                         \
-  }                                                                            \
-  state.r[REG_3] = temp_64;
+MVI_MINMAX(mvi_minub8, u8, 8, X64_BYTE, true)
+MVI_MINMAX(mvi_minsb8, s8, 8, X64_BYTE, true)
+MVI_MINMAX(mvi_minuw4, u16, 16, X64_WORD, true)
+MVI_MINMAX(mvi_minsw4, s16, 16, X64_WORD, true)
+MVI_MINMAX(mvi_maxub8, u8, 8, X64_BYTE, false)
+MVI_MINMAX(mvi_maxsb8, s8, 8, X64_BYTE, false)
+MVI_MINMAX(mvi_maxuw4, u16, 16, X64_WORD, false)
+MVI_MINMAX(mvi_maxsw4, s16, 16, X64_WORD, false)
 
-#define DO_MAXSW4                                                              \
-  temp_64 = 0;                                                                 \
-  temp_64_1 = state.r[REG_1];                                                  \
-  temp_64_2 = V_2;                                                             \
-  for (i = 0; i < 64; i += 16) {                                               \
-    if ((s16)((temp_64_1 >> i) & X64_WORD) >                                   \
-        (s16)((temp_64_2 >> i) & X64_WORD))                                    \
-      temp_64 |= (((temp_64_1 >> i) & X64_WORD) << i);                         \
-    else                                                                       \
-      temp_64 |= (((temp_64_2 >> i) & X64_WORD) << i);                         \
-  }                                                                            \
-  state.r[REG_3] = temp_64;
+inline u64 mvi_perr(u64 a, u64 b) {
+  u64 r = 0;
+  for (int i = 0; i < 64; i += 8) {
+    u8 x = (u8)(a >> i);
+    u8 y = (u8)(b >> i);
+    r += (x > y) ? (x - y) : (y - x);
+  }
+  return r;
+}
 
-#define DO_PERR                                                                \
-  temp_64 = 0;                                                                 \
-  temp_64_1 = state.r[REG_1];                                                  \
-  temp_64_2 = V_2;                                                             \
-  for (i = 0; i < 64; i += 8) {                                                \
-    if ((s8)((temp_64_1 >> i) & X64_BYTE) > (s8)((temp_64_2 >> i) & X64_BYTE)) \
-      temp_64 |= ((u64)((s8)((temp_64_1 >> i) & X64_BYTE) -                    \
-                        (s8)((temp_64_2 >> i) & X64_BYTE))                     \
-                  << i);                                                       \
-    else                                                                       \
-      temp_64 |= ((u64)((s8)((temp_64_2 >> i) & X64_BYTE) -                    \
-                        (s8)((temp_64_1 >> i) & X64_BYTE))                     \
-                  << i);                                                       \
-  }                                                                            \
-  state.r[REG_3] = temp_64;
+#endif // defined(ES40_SSE2)
+
+#define DO_MINUB8 state.r[REG_3] = mvi_minub8(state.r[REG_1], V_2);
+#define DO_MINSB8 state.r[REG_3] = mvi_minsb8(state.r[REG_1], V_2);
+#define DO_MINUW4 state.r[REG_3] = mvi_minuw4(state.r[REG_1], V_2);
+#define DO_MINSW4 state.r[REG_3] = mvi_minsw4(state.r[REG_1], V_2);
+#define DO_MAXUB8 state.r[REG_3] = mvi_maxub8(state.r[REG_1], V_2);
+#define DO_MAXSB8 state.r[REG_3] = mvi_maxsb8(state.r[REG_1], V_2);
+#define DO_MAXUW4 state.r[REG_3] = mvi_maxuw4(state.r[REG_1], V_2);
+#define DO_MAXSW4 state.r[REG_3] = mvi_maxsw4(state.r[REG_1], V_2);
+
+/* PERR: sum of the absolute differences of the unsigned bytes. */
+#define DO_PERR state.r[REG_3] = mvi_perr(state.r[REG_1], V_2);
 
 #define DO_PKLB                                                                \
   temp_64_2 = V_2;                                                             \
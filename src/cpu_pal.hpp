@@ -112,6 +112,7 @@
       break;                                                                   \
                                                                                \
     case 0xc0: /* CC */                                                        \
+      sync_clock();                                                            \
       state.r[REG_1] =                                                         \
           (((u64)state.cc_offset) << 32) | (state.cc & U64(0xffffffff));       \
       break;                                                                   \
@@ -130,16 +131,18 @@
   }
 
 #define DO_HW_MTPR                                                             \
+  if (osfpal_pending >= 0)                                                     \
+    osfpal_effect(function, state.r[REG_2]);                                   \
   if ((function & 0xc0) == 0x40) {                                             \
     if (function & 1)                                                          \
       state.asn = (int)(state.r[REG_2] >> 39) & 0xff;                          \
     if (function & 2) {                                                        \
       state.aster = (int)(state.r[REG_2] >> 5) & 0xf;                          \
-      state.check_int = true;                                                  \
+      set_check_int();                                                         \
     }                                                                          \
     if (function & 4) {                                                        \
       state.astrr = (int)(state.r[REG_2] >> 9) & 0xf;                          \
-      state.check_int = true;                                                  \
+      set_check_int();                                                         \
     }                                                                          \
     if (function & 8)                                                          \
       state.ppcen = (int)(state.r[REG_2] >> 1) & 1;                            \
@@ -169,12 +172,14 @@
                                                                                \
     case 0x09: /* CM */                                                        \
       state.cm = (int)(state.r[REG_2] >> 3) & 3;                               \
-      state.check_int = true;                                                  \
+      set_check_int();                                                         \
+      stlb_flush();                                                            \
       break;                                                                   \
                                                                                \
     case 0x0b: /* IER_CM */                                                    \
       state.cm = (int)(state.r[REG_2] >> 3) & 3;                               \
-      state.check_int = true;                                                  \
+      set_check_int();                                                         \
+      stlb_flush();                                                            \
                                                                                \
     case 0x0a: /* IER */                                                       \
       state.asten = (int)(state.r[REG_2] >> 13) & 1;                           \
@@ -183,12 +188,12 @@
       state.cren = (int)(state.r[REG_2] >> 31) & 1;                            \
       state.slen = (int)(state.r[REG_2] >> 32) & 1;                            \
       state.eien = (int)(state.r[REG_2] >> 33) & 0x3f;                         \
-      state.check_int = true;                                                  \
+      set_check_int();                                                         \
       break;                                                                   \
                                                                                \
     case 0x0c: /* SIRR */                                                      \
       state.sir = (int)(state.r[REG_2] >> 13) & 0xfffe;                        \
-      state.check_int = true;                                                  \
+      set_check_int();                                                         \
       break;                                                                   \
                                                                                \
     case 0x0e: /* HW_INT_CLR */                                                \
@@ -249,6 +254,7 @@
                                                                                \
     case 0x25: /* DTB_ASN0 */                                                  \
       state.asn0 = (int)(state.r[REG_2] >> 56);                                \
+      stlb_flush();                                                            \
       break;                                                                   \
                                                                                \
     case 0x26: /* DTB_ALTMODE */                                               \
@@ -258,6 +264,7 @@
     case 0x28: /* M_CTL */                                                     \
       state.smc = (int)(state.r[REG_2] >> 4) & 3;                              \
       state.m_ctl_spe = (int)(state.r[REG_2] >> 1) & 7;                        \
+      stlb_flush();                                                            \
       break;                                                                   \
                                                                                \
     case 0x29: /* DC_CTL */                                                    \
@@ -297,6 +304,7 @@
       break;                                                                   \
                                                                                \
     case 0xc1: /* CC_CTL */                                                    \
+      sync_clock();                                                            \
       state.cc_ena = (state.r[REG_2] >> 32) & 1;                               \
       state.cc = (u32)(state.r[REG_2] & U64(0xfffffff0));                      \
       break;                                                                   \
@@ -312,7 +320,12 @@
     }                                                                          \
   }
 
-#define DO_HW_RET set_pc(state.r[REG_2])
+#define DO_HW_RET                                                              \
+  {                                                                            \
+    set_pc(state.r[REG_2]);                                                    \
+    if (osfpal_pending >= 0)                                                   \
+      osfpal_returned();                                                       \
+  }
 #define DO_HW_LDL                                                              \
   switch (function) {                                                          \
   case 0: /* longword physical */                                              \
@@ -324,6 +337,7 @@
     phys_address = state.r[REG_2] + DISP_12;                                   \
     cSystem->cpu_lock(state.iProcNum, phys_address);                           \
     state.r[REG_1] = READ_PHYS_NT(32);                                         \
+    cSystem->cpu_lock_data(state.iProcNum, state.r[REG_1]);                    \
     break;                                                                     \
                                                                                \
   case 4: /* longword virtual vpte                 chk   alt    vpte */        \
@@ -366,6 +380,7 @@
     phys_address = state.r[REG_2] + DISP_12;                                   \
     cSystem->cpu_lock(state.iProcNum, phys_address);                           \
     state.r[REG_1] = READ_PHYS_NT(64);                                         \
+    cSystem->cpu_lock_data(state.iProcNum, state.r[REG_1]);                    \
     break;                                                                     \
                                                                                \
   case 5: /* quadword virtual vpte                 chk   alt    vpte */        \
@@ -398,6 +413,8 @@
   }
 
 #define DO_HW_STL                                                              \
+  if (osfpal_pending >= 0)                                                     \
+    osfpal_effect(-1, 0);                                                      \
   switch (function) {                                                          \
   case 0: /* longword physical */                                              \
     phys_address = state.r[REG_2] + DISP_12;                                   \
@@ -407,8 +424,9 @@
   case 2: /* longword physical conditional */                                  \
     if (cSystem->cpu_unlock(state.iProcNum)) {                                 \
       phys_address = state.r[REG_2] + DISP_12;                                 \
-      WRITE_PHYS_NT(state.r[REG_1], 32);                                       \
-      state.r[REG_1] = 1;                                                      \
+      state.r[REG_1] = cSystem->cpu_store_cond(                                \
+          state.iProcNum, ALIGN_PHYS(4), 32, state.r[REG_1], this);            \
+      LWR;                                                                     \
     } else                                                                     \
       state.r[REG_1] = 0;                                                      \
     break;                                                                     \
@@ -428,6 +446,8 @@
   }
 
 #define DO_HW_STQ                                                              \
+  if (osfpal_pending >= 0)                                                     \
+    osfpal_effect(-1, 0);                                                      \
   switch (function) {                                                          \
   case 1: /* quadword physical */                                              \
     phys_address = state.r[REG_2] + DISP_12;                                   \
@@ -437,8 +457,9 @@
   case 3: /* quadword physical conditional */                                  \
     if (cSystem->cpu_unlock(state.iProcNum)) {                                 \
       phys_address = state.r[REG_2] + DISP_12;                                 \
-      WRITE_PHYS_NT(state.r[REG_1], 64);                                       \
-      state.r[REG_1] = 1;                                                      \
+      state.r[REG_1] = cSystem->cpu_store_cond(                                \
+          state.iProcNum, ALIGN_PHYS(8), 64, state.r[REG_1], this);            \
+      LWR;                                                                     \
     } else                                                                     \
       state.r[REG_1] = 0;                                                      \
     break;                                                                     \
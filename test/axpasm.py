@@ -0,0 +1,170 @@
+#
+# A small Alpha assembler for the test ROMs. Programs are laid out with
+# org() and label(), and written as a decompressed ROM image: a header with
+# the start PC and PAL base, followed by the first 2 MB of memory.
+#
+
+import struct
+
+KSEG = 0xFFFFFFFF80000000
+UART = 0x801FC0003F8    # serial0 transmit holding register
+
+# Words CSystem::LoadROM overwrites to skip the SRM memory tests; a test ROM
+# must not put anything there.
+PATCHED = (0x14248, 0x14288, 0x142c8, 0x68320, 0x8bb78, 0x8bc0c, 0x8bc94)
+
+
+class Asm:
+    def __init__(self):
+        self.mem = {}
+        self.pc = 0
+        self.labels = {}
+        self.fixups = []
+
+    def org(self, a):
+        self.pc = a
+
+    def label(self, name):
+        self.labels[name] = self.pc
+
+    def w(self, v):
+        self.mem[self.pc] = v & 0xffffffff
+        self.pc += 4
+
+    def quad(self, v):
+        self.w(v)
+        self.w(v >> 32)
+
+    def mem_op(self, op, ra, disp, rb):
+        assert -0x8000 <= disp < 0x8000
+        self.w((op << 26) | (ra << 21) | (rb << 16) | (disp & 0xffff))
+
+    def lda(self, ra, disp, rb): self.mem_op(0x08, ra, disp, rb)
+    def ldah(self, ra, disp, rb): self.mem_op(0x09, ra, disp, rb)
+    def ldq(self, ra, disp, rb): self.mem_op(0x29, ra, disp, rb)
+    def ldq_u(self, ra, disp, rb): self.mem_op(0x0b, ra, disp, rb)
+    def stq_u(self, ra, disp, rb): self.mem_op(0x0f, ra, disp, rb)
+    def ldq_l(self, ra, disp, rb): self.mem_op(0x2b, ra, disp, rb)
+    def stq(self, ra, disp, rb): self.mem_op(0x2d, ra, disp, rb)
+    def stq_c(self, ra, disp, rb): self.mem_op(0x2f, ra, disp, rb)
+
+    def opr(self, op, fn, ra, rb, rc, lit=False):
+        if lit:
+            self.w((op << 26) | (ra << 21) | ((rb & 0xff) << 13) | (1 << 12) |
+                   (fn << 5) | rc)
+        else:
+            self.w((op << 26) | (ra << 21) | (rb << 16) | (fn << 5) | rc)
+
+    def addq(self, ra, rb, rc, lit=False): self.opr(0x10, 0x20, ra, rb, rc, lit)
+    def subq(self, ra, rb, rc, lit=False): self.opr(0x10, 0x29, ra, rb, rc, lit)
+    def mulq(self, ra, rb, rc, lit=False): self.opr(0x13, 0x20, ra, rb, rc, lit)
+    def cmpult(self, ra, rb, rc, lit=False): self.opr(0x10, 0x1d, ra, rb, rc, lit)
+    def cmpeq(self, ra, rb, rc, lit=False): self.opr(0x10, 0x2d, ra, rb, rc, lit)
+    def and_(self, ra, rb, rc, lit=False): self.opr(0x11, 0x00, ra, rb, rc, lit)
+    def bis(self, ra, rb, rc, lit=False): self.opr(0x11, 0x20, ra, rb, rc, lit)
+    def xor(self, ra, rb, rc, lit=False): self.opr(0x11, 0x40, ra, rb, rc, lit)
+    def sll(self, ra, rb, rc, lit=False): self.opr(0x12, 0x39, ra, rb, rc, lit)
+    def srl(self, ra, rb, rc, lit=False): self.opr(0x12, 0x34, ra, rb, rc, lit)
+
+    def mskwl(self, ra, rb, rc, lit=False): self.opr(0x12, 0x12, ra, rb, rc, lit)
+    def inswl(self, ra, rb, rc, lit=False): self.opr(0x12, 0x1b, ra, rb, rc, lit)
+    def mskql(self, ra, rb, rc, lit=False): self.opr(0x12, 0x32, ra, rb, rc, lit)
+    def extql(self, ra, rb, rc, lit=False): self.opr(0x12, 0x36, ra, rb, rc, lit)
+    def insql(self, ra, rb, rc, lit=False): self.opr(0x12, 0x3b, ra, rb, rc, lit)
+    def mskqh(self, ra, rb, rc, lit=False): self.opr(0x12, 0x72, ra, rb, rc, lit)
+    def insqh(self, ra, rb, rc, lit=False): self.opr(0x12, 0x77, ra, rb, rc, lit)
+    def extqh(self, ra, rb, rc, lit=False): self.opr(0x12, 0x7a, ra, rb, rc, lit)
+
+    def fpop(self, op, fn, fa, fb, fc):
+        self.w((op << 26) | (fa << 21) | (fb << 16) | (fn << 5) | fc)
+
+    def itoft(self, ra, fc): self.fpop(0x14, 0x024, ra, 31, fc)
+    def ftoit(self, fa, rc): self.fpop(0x1c, 0x070, fa, 31, rc)
+    def mt_fpcr(self, fa): self.fpop(0x17, 0x024, fa, fa, fa)
+
+    def branch(self, op, ra, name):
+        self.fixups.append((self.pc, name))
+        self.w((op << 26) | (ra << 21))
+
+    def br(self, name): self.branch(0x30, 31, name)
+    def beq(self, ra, name): self.branch(0x39, ra, name)
+    def bne(self, ra, name): self.branch(0x3d, ra, name)
+    def blt(self, ra, name): self.branch(0x3a, ra, name)
+    def ble(self, ra, name): self.branch(0x3b, ra, name)
+    def bge(self, ra, name): self.branch(0x3e, ra, name)
+    def bgt(self, ra, name): self.branch(0x3f, ra, name)
+
+    def mb(self): self.w((0x18 << 26) | 0x4000)
+    def wmb(self): self.w((0x18 << 26) | 0x4400)
+
+    def mtpr(self, ipr, rb):
+        self.w((0x1d << 26) | (31 << 21) | (rb << 16) | (ipr << 8))
+
+    def hw_stl_phys(self, ra, rb):
+        self.w((0x1f << 26) | (ra << 21) | (rb << 16))
+
+    def hw_ret(self, rb):
+        self.w((0x1e << 26) | (31 << 21) | (rb << 16))
+
+    def mov32(self, v, rc):
+        lo = ((v & 0xffff) ^ 0x8000) - 0x8000
+        hi = (((v - lo) >> 16) & 0xffff ^ 0x8000) - 0x8000
+        self.ldah(rc, hi, 31)
+        self.lda(rc, lo, rc)
+
+    def mov(self, v, rc):
+        v &= (1 << 64) - 1
+        if v >= 1 << 63:
+            v -= 1 << 64
+        lo = ((v & 0xffffffff) ^ 0x80000000) - 0x80000000
+        if lo == v:
+            self.mov32(v, rc)
+            return
+        self.mov32((v - lo) >> 32, rc)
+        self.sll(rc, 32, rc, True)
+        lo16 = ((lo & 0xffff) ^ 0x8000) - 0x8000
+        self.lda(rc, lo16, rc)
+        self.ldah(rc, (lo - lo16) >> 16, rc)
+
+    def start(self, code):
+        """PALmode entry: enable the KSEG superpage, go to kernel mode."""
+        self.mov(0x88, 1)       # I_CTL: 43-bit superpage enable
+        self.mtpr(0x11, 1)
+        self.mov(2, 1)          # M_CTL: superpage enable
+        self.mtpr(0x28, 1)
+        self.mov(KSEG + code, 2)
+        self.hw_ret(2)
+
+    def puts(self, s, ruart=7):
+        """Print s on serial port 0; ruart holds UART. Uses r2."""
+        for c in s:
+            self.lda(2, ord(c), 31)
+            self.hw_stl_phys(2, ruart)
+
+    def puthex(self, r, ruart=7):
+        """Print r as 16 hex digits; ruart holds UART. Uses r2 to r5."""
+        n = len(self.labels)
+        self.bis(31, r, 5)
+        self.lda(3, 16, 31)
+        self.label('puthex_%d' % n)
+        self.srl(5, 60, 2, True)
+        self.cmpult(2, 10, 4, True)
+        self.lda(2, ord('0'), 2)
+        self.bne(4, 'puthex_digit_%d' % n)
+        self.lda(2, ord('a') - ord('0') - 10, 2)
+        self.label('puthex_digit_%d' % n)
+        self.hw_stl_phys(2, ruart)
+        self.sll(5, 4, 5, True)
+        self.subq(3, 1, 3, True)
+        self.bne(3, 'puthex_%d' % n)
+
+    def write(self, fn, pc, pal_base):
+        for a, name in self.fixups:
+            self.mem[a] |= ((self.labels[name] - a - 4) >> 2) & 0x1fffff
+        assert not set(PATCHED) & set(self.mem), 'code at an SRM patch address'
+        buf = bytearray(0x200000)
+        for a, v in self.mem.items():
+            struct.pack_into('<I', buf, a, v)
+        with open(fn, 'wb') as f:
+            f.write(struct.pack('<QQ', pc, pal_base))
+            f.write(buf)
@@ -0,0 +1,285 @@
+#!/usr/bin/env python3
+#
+# Build fp.rom, a decompressed ROM image that checks the square root
+# instructions, IEEE and VAX, against results computed here with exact
+# rational arithmetic.
+#
+# Every case moves its operands in with ITOFT, executes one instruction,
+# moves the result out with FTOIT and compares it with the expected register
+# value. Operands are random, with both exponent parities, mixed with short
+# fractions that hit rounding ties; all results are normal numbers and no
+# case may trap. The errors are counted per instruction group and reported
+# on serial port 0, ending with PASS or FAIL.
+#
+#   fp.py [--arith] [--rounds N] [rom]
+#
+# --arith adds ADD, SUB, MUL and DIV in every format and rounding mode.
+# With N > 1 all cases are run N times, which makes the ROM a benchmark for
+# the software routines and their host fast paths.
+
+import argparse
+import math
+import os
+import random
+import sys
+from fractions import Fraction
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from axpasm import Asm, KSEG, UART  # noqa: E402
+
+N_CASES = 200           # per group
+CODE = 0x90000          # the cases, above the SRM patch addresses
+DATA = 0x140000         # case table
+ERRS = 0x1f0000         # error count per group
+
+# Rounding modes, as in the instruction's function field bits <7:6>; the
+# VAX instructions only have CHOP and NORMAL, which rounds ties away from
+# zero. The dynamic mode tests are run with the FPCR set to round to plus
+# infinity. The FPCR exception status bits are set up front, so that the
+# inexact results do not trap to the PALcode to have them set.
+CHOP, MINUS, NORMAL, DYN = 0, 1, 2, 3
+PLUS, AWAY = 4, 5
+FPCR = (3 << 58) | (0x3f << 52)
+
+# Formats: precision, smallest and largest exponent k of 2^k <= |x| < 2^k+1
+# that we generate results in, and the exponent bias of the register format.
+# F and G both use the 11-bit register exponent, with a hidden bit worth 1/2.
+FMT = {
+    'S': (24, -120, 120, 1023),
+    'T': (53, -1000, 1000, 1023),
+    'F': (24, -120, 120, 1025),
+    'G': (53, -1000, 1000, 1025),
+}
+
+
+def encode(sign, m, k, fmt):
+    """Register value of (-1)^sign * m * 2^(k + 1 - prec), m normalized."""
+    prec, _, _, bias = FMT[fmt]
+    assert m >> (prec - 1) == 1
+    frac = (m - (1 << (prec - 1))) << (53 - prec)
+    return (sign << 63) | ((k + bias) << 52) | frac
+
+
+def decode(v, fmt):
+    """Exact value of register value v."""
+    bias = FMT[fmt][3]
+    e = (v >> 52) & 0x7ff
+    m = (v & ((1 << 52) - 1)) | (1 << 52)
+    x = Fraction(m) * Fraction(2) ** (e - bias - 52)
+    return -x if v >> 63 else x
+
+
+def ilog2(q):
+    """floor(log2(q)) for a positive Fraction."""
+    k = q.numerator.bit_length() - q.denominator.bit_length()
+    if Fraction(2) ** k > q:
+        k -= 1
+    return k
+
+
+def round_result(sign, m, cmp_half, inexact, mode):
+    """Round the truncated fraction m; cmp_half compares the rest with 1/2."""
+    if mode == NORMAL:
+        return m + (cmp_half > 0 or (cmp_half == 0 and m & 1))
+    if mode == AWAY:
+        return m + (cmp_half >= 0)
+    if mode == MINUS:
+        return m + (inexact and sign)
+    if mode == PLUS:
+        return m + (inexact and not sign)
+    return m
+
+
+def round_value(x, fmt, mode):
+    """Round the nonzero Fraction x; None if it is not a normal number."""
+    prec, kmin, kmax, _ = FMT[fmt]
+    sign = int(x < 0)
+    q = abs(x)
+    k = ilog2(q)
+    scaled = q * Fraction(2) ** (prec - 1 - k)
+    m = scaled.numerator // scaled.denominator
+    rest = scaled - m
+    m = round_result(sign, m, (rest > Fraction(1, 2)) - (rest < Fraction(1, 2)),
+                     rest != 0, mode)
+    if m >> prec:
+        m >>= 1
+        k += 1
+    if not kmin <= k <= kmax:
+        return None
+    return encode(sign, m, k, fmt)
+
+
+def round_sqrt(x, fmt, mode):
+    """Round the square root of the positive Fraction x."""
+    prec, kmin, kmax, _ = FMT[fmt]
+    k = ilog2(x) // 2
+    sq = x * Fraction(2) ** (2 * (prec - 1 - k))     # root scaled, squared
+    m = math.isqrt(sq.numerator // sq.denominator)
+    half = Fraction(4 * m * m + 4 * m + 1, 4)       # (m + 1/2)^2
+    m = round_result(0, m, (sq > half) - (sq < half), sq != m * m, mode)
+    if m >> prec:
+        m >>= 1
+        k += 1
+    if not kmin <= k <= kmax:
+        return None
+    return encode(0, m, k, fmt)
+
+
+def operand(fmt, rng, short, k):
+    prec = FMT[fmt][0]
+    if short:
+        m = (1 << (prec - 1)) | (rng.getrandbits(4) << (prec - 5))
+    else:
+        m = (1 << (prec - 1)) | rng.getrandbits(prec - 1)
+    return encode(rng.getrandbits(1), m, k, fmt)
+
+
+def cases(op, fmt, mode, rng):
+    """Yield (a, b, expected) for one instruction group."""
+    prec, kmin, kmax, _ = FMT[fmt]
+    n = 0
+    while n < N_CASES:
+        short = rng.random() < 0.3
+        if op == 'sqrt':
+            a = operand(fmt, rng, short, rng.randint(kmin, kmax))
+            a &= (1 << 63) - 1
+            b = 0
+            r = round_sqrt(decode(a, fmt), fmt, mode)
+        else:
+            ka = rng.randint(kmin // 2, kmax // 2)
+            if op in ('add', 'sub'):
+                kb = ka - rng.randint(0, prec + 3)
+            else:
+                kb = rng.randint(kmin // 4, kmax // 4)
+            a = operand(fmt, rng, short, ka)
+            b = operand(fmt, rng, short, kb)
+            if rng.getrandbits(1):
+                a, b = b, a
+            x, y = decode(a, fmt), decode(b, fmt)
+            v = {'add': x + y, 'sub': x - y, 'mul': x * y, 'div': x / y}[op]
+            r = round_value(v, fmt, mode) if v else None
+        if r is not None:
+            n += 1
+            yield a, b, r
+
+
+# Operate instructions: opcode, function <5:0> for S (T is 0x20 higher) and
+# for F (G is 0x20 higher). The rounding mode goes in function <7:6>.
+OPS = {
+    'add': (0x16, 0x00, 0x15, 0x00), 'sub': (0x16, 0x01, 0x15, 0x01),
+    'mul': (0x16, 0x02, 0x15, 0x02), 'div': (0x16, 0x03, 0x15, 0x03),
+    'sqrt': (0x14, 0x0b, 0x14, 0x0a),
+}
+MODES = {
+    'S': (NORMAL, CHOP, MINUS, DYN), 'T': (NORMAL, CHOP, MINUS, DYN),
+    'F': (NORMAL, CHOP), 'G': (NORMAL, CHOP),
+}
+MODE_NAMES = {CHOP: '/c', MINUS: '/m', NORMAL: '', DYN: '/d'}
+
+
+def groups(arith):
+    """Yield (name, op, opcode, function, fmt, rounding) for each group."""
+    ops = ('add', 'sub', 'mul', 'div', 'sqrt') if arith else ('sqrt',)
+    for op in ops:
+        for fmt in ('S', 'T', 'F', 'G'):
+            vax = fmt in 'FG'
+            opc, fn = OPS[op][2:] if vax else OPS[op][:2]
+            for mode in MODES[fmt]:
+                rnd = {DYN: PLUS, NORMAL: AWAY if vax else NORMAL}.get(mode, mode)
+                yield ('%s%s%s' % (op, fmt.lower(), MODE_NAMES[mode]), op, opc,
+                       fn | (0x20 if fmt in 'TG' else 0) | (mode << 6), fmt, rnd)
+
+
+def build(fn, rounds, arith):
+    rng = random.Random(1)
+    a = Asm()
+    table = []
+    glist = list(groups(arith))
+
+    # Any exception is a failure.
+    for vec in range(0x100, 0x800, 0x80):
+        a.org(0x20000 + vec)
+        a.lda(9, vec, 31)
+        a.br('trap')
+    a.org(0x20800)
+    a.label('trap')
+    a.mov(UART, 7)
+    a.puts('TRAP\r\nFAIL\r\n')
+    a.label('trap_halt')
+    a.br('trap_halt')
+
+    a.org(0x10000)
+    a.start(CODE)
+
+    # START marks the beginning of the timed part for benchmarks.
+    a.org(CODE)
+    a.mov(UART, 7)
+    a.puts('START\r\n')
+    a.mov(FPCR, 1)
+    a.itoft(1, 1)
+    a.mt_fpcr(1)
+    a.mov(KSEG + ERRS, 11)
+    a.mov(rounds, 12)
+    a.label('round')
+    a.mov(KSEG + DATA, 10)
+    for g, (_, op, opc, f, fmt, rnd) in enumerate(glist):
+        a.bis(31, 31, 20)
+        for x, y, r in cases(op, fmt, rnd, rng):
+            table += [x, y, r]
+            a.ldq(1, 0, 10)
+            a.ldq(3, 16, 10)
+            a.itoft(1, 1)
+            if op == 'sqrt':
+                a.fpop(opc, f, 31, 1, 3)
+            else:
+                a.ldq(2, 8, 10)
+                a.itoft(2, 2)
+                a.fpop(opc, f, 1, 2, 3)
+            a.ftoit(3, 4)
+            a.cmpeq(4, 3, 4)
+            a.xor(4, 1, 4, True)
+            a.addq(20, 4, 20)
+            a.lda(10, 24, 10)
+        a.ldq(5, 8 * g, 11)
+        a.addq(5, 20, 5)
+        a.stq(5, 8 * g, 11)
+    a.subq(12, 1, 12, True)
+    a.bne(12, 'round')
+
+    a.mov(UART, 7)
+    a.bis(31, 31, 22)
+    a.puts('FP:')
+    for g, (name, _, _, _, _, _) in enumerate(glist):
+        a.ldq(5, 8 * g, 11)
+        a.puts(' %s ' % name)
+        a.beq(5, 'ok_%d' % g)
+        a.puts('FAIL')
+        a.bis(31, 1, 22, True)
+        a.br('next_%d' % g)
+        a.label('ok_%d' % g)
+        a.puts('ok')
+        a.label('next_%d' % g)
+    a.puts('\r\n')
+    a.bne(22, 'fail')
+    a.puts('PASS\r\n')
+    a.br('halt')
+    a.label('fail')
+    a.puts('FAIL\r\n')
+    a.label('halt')
+    a.br('halt')
+
+    assert a.pc <= DATA
+    a.org(DATA)
+    for v in table:
+        a.quad(v)
+    assert a.pc <= ERRS
+    a.write(fn, 0x10001, 0x20000)
+
+
+if __name__ == '__main__':
+    ap = argparse.ArgumentParser()
+    ap.add_argument('--arith', action='store_true')
+    ap.add_argument('--rounds', type=int, default=1)
+    ap.add_argument('rom', nargs='?', default='fp.rom')
+    args = ap.parse_args()
+    build(args.rom, args.rounds, args.arith)
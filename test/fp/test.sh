@@ -0,0 +1,32 @@
+#!/bin/bash
+# ./test.sh          check the square root instructions
+# ./test.sh bench    check all arithmetic, and time it with host_fp enabled
+#                    and disabled. ROUNDS sets the number of times the cases
+#                    are run.
+
+. ../romtest.sh fp
+
+if [ "$1" == "bench" ]
+then
+  python3 fp.py --arith --rounds ${ROUNDS:-100} fp.rom || exit 1
+  rom_config es40.cfg
+  rom_config soft.cfg "host_fp = false;"
+
+  run_rom es40.cfg
+  host_result=$result
+  host_ms=$ms
+  run_rom soft.cfg
+  soft_result=$result
+  soft_ms=$ms
+
+  echo "host_fp = true:  ${host_ms} ms"
+  echo "host_fp = false: ${soft_ms} ms"
+  result=$(($host_result | $soft_result))
+else
+  # Build the floating-point test ROM
+  python3 fp.py fp.rom || exit 1
+  rom_config es40.cfg
+  run_rom es40.cfg
+fi
+
+rom_exit $result
@@ -0,0 +1,313 @@
+#!/usr/bin/env python3
+#
+# Build memloop.rom, a decompressed ROM image that runs the kinds of block
+# copy and fill loops CAlphaCPU::memloop_run() handles: quadword fills,
+# aligned copies up and down, an overlapping move, and the unaligned copy
+# loops built from LDQ_U, STQ_U and the EXT, INS and MSK instructions, plus
+# a loop that only loads, which it has to leave alone. Each copies several
+# pages' worth, so the loops cross page boundaries.
+#
+# The loops are run through a small model of the instructions here as well.
+# After each loop the ROM hashes the destination area, with the guard
+# quadwords around it, and the loop registers, and compares the hash with
+# the model's. The results are reported on serial port 0, ending with PASS
+# or FAIL; test.sh runs the ROM with copy_loops enabled and disabled.
+#
+#   memloop.py [--rounds N] [rom]
+#
+# With N > 1 all loops are run N times, and only the last round is checked.
+# The number of bytes the loops move in all is printed.
+
+import argparse
+import os
+import random
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from axpasm import Asm, KSEG, UART  # noqa: E402
+
+CODE = 0x90000          # the loops, above the SRM patch addresses
+SRC = 0x100000          # random bytes, never written
+DST = 0x140000          # destination area
+SIZE = 0x6000           # bytes in the destination area
+GUARD = 64              # bytes checked on either side of it
+EXPECT = 0x1e0000       # expected hash per loop
+
+M64 = (1 << 64) - 1
+K = 0x100000001b3       # hash multiplier
+
+
+def zapnot(v, mask):
+    return sum(((v >> 8 * i) & 0xff) << 8 * i for i in range(8) if mask >> i & 1)
+
+
+def ins_mask(width, b):
+    return width << (b & 7)
+
+
+# The byte manipulation instructions the loops use: reference results as in
+# the Architecture Reference Manual.
+BYTE_OPS = {
+    'extql': lambda a, b: a >> 8 * (b & 7),
+    'extqh': lambda a, b: zapnot((a << ((64 - 8 * (b & 7)) & 63)) & M64, 0xff),
+    'insql': lambda a, b: zapnot((a << 8 * (b & 7)) & M64, 0xff),
+    'insqh': lambda a, b: zapnot(a >> ((64 - 8 * (b & 7)) & 63),
+                                 ins_mask(0xff, b) >> 8),
+    'mskql': lambda a, b: zapnot(a, ~ins_mask(0xff, b) & 0xff),
+    'mskqh': lambda a, b: zapnot(a, ~(ins_mask(0xff, b) >> 8) & 0xff),
+    'inswl': lambda a, b: zapnot((a << 8 * (b & 7)) & M64,
+                                 ins_mask(0x03, b) & 0xff),
+    'mskwl': lambda a, b: zapnot(a, ~ins_mask(0x03, b) & 0xff),
+}
+
+BRANCHES = {
+    'bne': lambda v: v != 0, 'bgt': lambda v: 0 < v < 1 << 63,
+    'bge': lambda v: v < 1 << 63,
+}
+
+
+class Model:
+    """Registers and memory, running the instructions the loops use."""
+
+    def __init__(self, mem):
+        self.r = [0] * 32
+        self.mem = mem
+
+    def phys(self, a):
+        assert a >= KSEG
+        return a - KSEG
+
+    def load(self, a):
+        p = self.phys(a)
+        return int.from_bytes(self.mem[p:p + 8], 'little')
+
+    def store(self, a, v):
+        p = self.phys(a)
+        self.mem[p:p + 8] = v.to_bytes(8, 'little')
+
+    def run(self, code):
+        labels = {c[1]: i for i, c in enumerate(code) if c[0] == 'label'}
+        r = self.r
+        pc = 0
+        while pc < len(code):
+            op, *args = code[pc]
+            pc += 1
+            if op in ('ldq', 'ldq_u'):
+                ra, disp, rb = args
+                a = (r[rb] + disp) & M64
+                r[ra] = self.load(a & ~7 if op == 'ldq_u' else a)
+            elif op in ('stq', 'stq_u'):
+                ra, disp, rb = args
+                a = (r[rb] + disp) & M64
+                self.store(a & ~7 if op == 'stq_u' else a, r[ra])
+            elif op == 'lda':
+                ra, disp, rb = args
+                r[ra] = (r[rb] + disp) & M64
+            elif op in ('addq', 'subq'):
+                ra, lit, rc, _ = args
+                r[rc] = (r[ra] + (lit if op == 'addq' else -lit)) & M64
+            elif op == 'bis':
+                ra, rb, rc = args
+                r[rc] = r[ra] | r[rb]
+            elif op in BYTE_OPS:
+                ra, rb, rc = args
+                r[rc] = BYTE_OPS[op](r[ra], r[rb])
+            elif op in BRANCHES:
+                if BRANCHES[op](r[args[0]]):
+                    pc = labels[args[1]]
+            else:
+                assert op == 'label'
+            r[31] = 0
+
+
+def loops():
+    """Yield (name, registers, code, bytes moved) for each loop."""
+    dst = KSEG + DST
+    src = KSEG + SRC
+    n = SIZE - 0x400
+
+    # Restore the destination area and the guards, so that every round
+    # starts out the same.
+    yield 'fill', {16: dst - GUARD, 17: SIZE + 2 * GUARD,
+                   18: 0xa5a5a5a5a5a5a5a5}, [
+        ('label', 'loop'),
+        ('stq', 18, 0, 16), ('stq', 18, 8, 16),
+        ('subq', 17, 16, 17, True), ('lda', 16, 16, 16),
+        ('bgt', 17, 'loop')], SIZE + 2 * GUARD
+    yield 'zero', {16: dst + 0x200, 17: n}, [
+        ('label', 'loop'),
+        ('stq', 31, 0, 16), ('stq', 31, 8, 16), ('stq', 31, 16, 16),
+        ('stq', 31, 24, 16), ('lda', 16, 32, 16), ('subq', 17, 32, 17, True),
+        ('bne', 17, 'loop')], n
+    yield 'copy', {16: dst, 17: src + 0x18, 18: n}, [
+        ('label', 'loop'),
+        ('ldq', 19, 0, 17), ('ldq', 20, 8, 17), ('lda', 17, 16, 17),
+        ('stq', 19, 0, 16), ('stq', 20, 8, 16), ('subq', 18, 16, 18, True),
+        ('lda', 16, 16, 16), ('bne', 18, 'loop')], n
+    yield 'copy down', {16: dst + n + 0x100, 17: src + n + 0x400, 18: n}, [
+        ('label', 'loop'),
+        ('lda', 17, -8, 17), ('lda', 16, -8, 16), ('ldq', 19, 0, 17),
+        ('stq', 19, 0, 16), ('subq', 18, 8, 18, True), ('bgt', 18, 'loop')], n
+    # The stores overwrite what is loaded two iterations on.
+    yield 'overlap', {16: dst + 0x110, 17: dst + 0x100, 18: n - 0x100}, [
+        ('label', 'loop'),
+        ('ldq', 19, 0, 17), ('stq', 19, 0, 16), ('lda', 17, 8, 17),
+        ('lda', 16, 8, 16), ('subq', 18, 8, 18, True), ('bne', 18, 'loop')
+    ], n - 0x100
+    # Only loads: neither a copy nor a fill, so it runs as it is.
+    yield 'loads only', {17: src, 18: n}, [
+        ('label', 'loop'),
+        ('ldq', 19, 0, 17), ('lda', 17, 8, 17), ('subq', 18, 8, 18, True),
+        ('bgt', 18, 'loop')], 0
+
+    # Unaligned source, like __memcpy_unaligned_up in Linux
+    for mis in (3, 6):
+        yield 'unaligned src %d' % mis, {16: dst + 8, 17: src + 0x40 + mis,
+                                         18: n - 8}, [
+            ('ldq_u', 19, 0, 17),
+            ('label', 'loop'),
+            ('ldq_u', 20, 8, 17), ('subq', 18, 8, 18, True),
+            ('extql', 19, 17, 19), ('extqh', 20, 17, 21), ('lda', 17, 8, 17),
+            ('bis', 19, 21, 19), ('stq', 19, 0, 16), ('lda', 16, 8, 16),
+            ('bis', 20, 20, 19), ('bge', 18, 'loop')], n
+
+    # Unaligned destination: the partial quadwords at either end are merged
+    # with what is there.
+    for mis in (1, 5):
+        yield 'unaligned dst %d' % mis, {16: dst + 0x20 + mis, 17: src,
+                                         18: n}, [
+            ('ldq_u', 22, 0, 16), ('mskql', 22, 16, 22),
+            ('label', 'loop'),
+            ('ldq', 19, 0, 17), ('insql', 19, 16, 20), ('insqh', 19, 16, 21),
+            ('bis', 20, 22, 20), ('stq_u', 20, 0, 16), ('bis', 21, 21, 22),
+            ('lda', 17, 8, 17), ('lda', 16, 8, 16), ('subq', 18, 8, 18, True),
+            ('bgt', 18, 'loop'),
+            ('ldq_u', 23, 0, 16), ('mskqh', 23, 16, 23), ('bis', 23, 22, 23),
+            ('stq_u', 23, 0, 16)], n
+
+    # A word stored into every quadword
+    yield 'words', {16: dst + 0x403, 18: n // 16, 24: 0x1234}, [
+        ('label', 'loop'),
+        ('ldq_u', 19, 0, 16), ('mskwl', 19, 16, 19), ('inswl', 24, 16, 21),
+        ('bis', 19, 21, 19), ('stq_u', 19, 0, 16), ('lda', 16, 8, 16),
+        ('subq', 18, 1, 18, True), ('bne', 18, 'loop')], n // 8
+
+
+def emit(a, code, t):
+    """Assemble one loop; loops start on a 64-byte boundary."""
+    for op, *args in code:
+        if op == 'label':
+            while a.pc & 0x3f:
+                a.bis(31, 31, 31)
+            a.label('%s_%d' % (args[0], t))
+        elif op in BRANCHES:
+            getattr(a, op)(args[0], '%s_%d' % (args[1], t))
+        else:
+            getattr(a, op)(*args)
+
+
+def build(fn, rounds):
+    rng = random.Random(1)
+    a = Asm()
+    tests = list(loops())
+
+    mem = bytearray(0x200000)
+    mem[SRC:SRC + SIZE] = bytes(rng.getrandbits(8) for _ in range(SIZE))
+    model = Model(mem)
+    expect = []
+    for _, regs, code, _ in tests:
+        for i in range(16, 28):
+            model.r[i] = regs.get(i, 0)
+        model.run(code)
+        h = 0
+        for p in range(DST - GUARD, DST + SIZE + GUARD, 8):
+            h = (h * K + int.from_bytes(mem[p:p + 8], 'little')) & M64
+        for i in range(16, 28):
+            h = (h * K + model.r[i]) & M64
+        expect.append(h)
+
+    # Any exception is a failure.
+    for vec in range(0x100, 0x800, 0x80):
+        a.org(0x20000 + vec)
+        a.lda(9, vec, 31)
+        a.br('trap')
+    a.org(0x20800)
+    a.label('trap')
+    a.mov(UART, 7)
+    a.puts('TRAP\r\nFAIL\r\n')
+    a.label('trap_halt')
+    a.br('trap_halt')
+
+    a.org(0x10000)
+    a.start(CODE)
+
+    # START marks the beginning of the timed part for benchmarks.
+    a.org(CODE)
+    a.mov(UART, 7)
+    a.puts('START\r\n')
+    a.bis(31, 31, 13)
+    a.mov(KSEG + EXPECT, 11)
+    a.mov(rounds, 12)
+    a.label('round')
+    for t, (name, regs, code, _) in enumerate(tests):
+        for i in range(16, 28):
+            a.mov(regs.get(i, 0), i)
+        emit(a, code, t)
+
+        # Check in the last round: hash the area and the registers.
+        a.subq(12, 1, 1, True)
+        a.bne(1, 'next_%d' % t)
+        a.mov(KSEG + DST - GUARD, 8)
+        a.mov((SIZE + 2 * GUARD) // 8, 9)
+        a.mov(K, 10)
+        a.bis(31, 31, 6)
+        a.label('hash_%d' % t)
+        a.ldq(1, 0, 8)
+        a.mulq(6, 10, 6)
+        a.addq(6, 1, 6)
+        a.lda(8, 8, 8)
+        a.subq(9, 1, 9, True)
+        a.bne(9, 'hash_%d' % t)
+        for i in range(16, 28):
+            a.mulq(6, 10, 6)
+            a.addq(6, i, 6)
+        a.puts('%s: ' % name)
+        a.ldq(1, 8 * t, 11)
+        a.cmpeq(1, 6, 1)
+        a.beq(1, 'bad_%d' % t)
+        a.puts('ok\r\n')
+        a.br('next_%d' % t)
+        a.label('bad_%d' % t)
+        a.puts('FAIL ')
+        a.puthex(6)
+        a.puts('\r\n')
+        a.bis(31, 1, 13, True)
+        a.label('next_%d' % t)
+    a.subq(12, 1, 12, True)
+    a.bne(12, 'round')
+
+    a.bne(13, 'fail')
+    a.puts('PASS\r\n')
+    a.br('halt')
+    a.label('fail')
+    a.puts('FAIL\r\n')
+    a.label('halt')
+    a.br('halt')
+
+    assert a.pc <= SRC
+    for p in range(SRC, SRC + SIZE, 4):
+        a.org(p)
+        a.w(int.from_bytes(mem[p:p + 4], 'little'))
+    a.org(EXPECT)
+    for h in expect:
+        a.quad(h)
+    a.write(fn, 0x10001, 0x20000)
+    print(rounds * sum(t[3] for t in tests))
+
+
+if __name__ == '__main__':
+    ap = argparse.ArgumentParser()
+    ap.add_argument('--rounds', type=int, default=1)
+    ap.add_argument('rom', nargs='?', default='memloop.rom')
+    args = ap.parse_args()
+    build(args.rom, args.rounds)
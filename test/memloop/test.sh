@@ -0,0 +1,34 @@
+#!/bin/bash
+# ./test.sh          check the copy and fill loops with copy_loops enabled
+#                    and disabled
+# ./test.sh bench    time them both ways; ROUNDS sets the number of times
+#                    the loops are run.
+
+. ../romtest.sh memloop
+
+# Build the test ROM
+if [ "$1" == "bench" ]
+then
+  rounds=${ROUNDS:-200}
+else
+  rounds=1
+fi
+bytes=$(python3 memloop.py --rounds $rounds memloop.rom) || exit 1
+rom_config es40.cfg
+rom_config off.cfg "copy_loops = false;"
+
+run_rom es40.cfg
+on_result=$result
+on_ms=$ms
+run_rom off.cfg
+off_result=$result
+off_ms=$ms
+
+if [ "$1" == "bench" ]
+then
+  echo "copy_loops = true:  ${on_ms} ms, $(($bytes / (${on_ms} + 1))) kB/s"
+  echo "copy_loops = false: ${off_ms} ms, $(($bytes / (${off_ms} + 1))) kB/s"
+fi
+result=$(($on_result | $off_result))
+
+rom_exit $result
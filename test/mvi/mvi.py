@@ -0,0 +1,280 @@
+#!/usr/bin/env python3
+#
+# Build mvi.rom, a decompressed ROM image that checks the byte manipulation
+# (CMPBGE, ZAP, ZAPNOT, EXT, INS, MSK) and MVI instructions against reference
+# results computed here, element by element, as the Architecture Reference
+# Manual defines them.
+#
+# Every case loads its operands and the expected result from a table,
+# executes one instruction and compares. Operands are random, mixed with
+# bytes and words at the signed and unsigned limits and equal elements. The
+# errors are counted per instruction and reported on serial port 0, ending
+# with PASS or FAIL.
+#
+#   mvi.py [--only NAME] [--rounds N] [--list] [rom]
+#
+# --only builds a ROM for a single instruction, and with N > 1 all cases are
+# run N times; test.sh uses both to time each instruction.
+
+import argparse
+import os
+import random
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from axpasm import Asm, KSEG, UART  # noqa: E402
+
+N_CASES = 200           # per instruction
+CODE = 0x90000          # the cases, above the SRM patch addresses
+DATA = 0x140000         # case table
+ERRS = 0x1f0000         # error count per instruction
+
+M64 = (1 << 64) - 1
+
+
+def elems(v, size):
+    return [(v >> (size * i)) & ((1 << size) - 1) for i in range(64 // size)]
+
+
+def join(es, size):
+    return sum(e << (size * i) for i, e in enumerate(es))
+
+
+def signed(e, size):
+    return e - (1 << size) if e >> (size - 1) else e
+
+
+def zapnot(v, mask):
+    return join([b if mask >> i & 1 else 0 for i, b in enumerate(elems(v, 8))], 8)
+
+
+def cmpbge(a, b):
+    return sum(1 << i for i, (x, y) in enumerate(zip(elems(a, 8), elems(b, 8)))
+               if x >= y)
+
+
+def minmax(fn, size, sign):
+    def op(a, b):
+        ea, eb = elems(a, size), elems(b, size)
+        if sign:
+            return join([fn(x, y, key=lambda e: signed(e, size))
+                         for x, y in zip(ea, eb)], size)
+        return join([fn(x, y) for x, y in zip(ea, eb)], size)
+    return op
+
+
+def perr(a, b):
+    return sum(abs(x - y) for x, y in zip(elems(a, 8), elems(b, 8)))
+
+
+def pklb(_, b):
+    e = elems(b, 8)
+    return e[0] | e[4] << 8
+
+
+def pkwb(_, b):
+    e = elems(b, 8)
+    return e[0] | e[2] << 8 | e[4] << 16 | e[6] << 24
+
+
+def unpkbl(_, b):
+    e = elems(b, 8)
+    return e[0] | e[1] << 32
+
+
+def unpkbw(_, b):
+    e = elems(b, 8)
+    return e[0] | e[1] << 16 | e[2] << 32 | e[3] << 48
+
+
+# Byte masks of the EXT, INS and MSK variants
+WIDTH = {'b': 0x01, 'w': 0x03, 'l': 0x0f, 'q': 0xff}
+
+
+def ext(width, high):
+    def op(a, b):
+        n = b & 7
+        if high:
+            return zapnot((a << ((64 - 8 * n) & 63)) & M64, WIDTH[width])
+        return zapnot(a >> (8 * n), WIDTH[width])
+    return op
+
+
+def ins(width, high):
+    def op(a, b):
+        n = b & 7
+        mask = WIDTH[width] << n
+        if high:
+            return zapnot(a >> ((64 - 8 * n) & 63), mask >> 8)
+        return zapnot((a << (8 * n)) & M64, mask & 0xff)
+    return op
+
+
+def msk(width, high):
+    def op(a, b):
+        mask = WIDTH[width] << (b & 7)
+        if high:
+            return zapnot(a, ~(mask >> 8) & 0xff)
+        return zapnot(a, ~mask & 0xff)
+    return op
+
+
+# name: (opcode, function, reference, Ra used)
+INSNS = {
+    'cmpbge': (0x10, 0x0f, cmpbge, True),
+    'zap': (0x12, 0x30, lambda a, b: zapnot(a, ~b & 0xff), True),
+    'zapnot': (0x12, 0x31, lambda a, b: zapnot(a, b & 0xff), True),
+    'minub8': (0x1c, 0x3a, minmax(min, 8, False), True),
+    'minsb8': (0x1c, 0x38, minmax(min, 8, True), True),
+    'minuw4': (0x1c, 0x3b, minmax(min, 16, False), True),
+    'minsw4': (0x1c, 0x39, minmax(min, 16, True), True),
+    'maxub8': (0x1c, 0x3c, minmax(max, 8, False), True),
+    'maxsb8': (0x1c, 0x3e, minmax(max, 8, True), True),
+    'maxuw4': (0x1c, 0x3d, minmax(max, 16, False), True),
+    'maxsw4': (0x1c, 0x3f, minmax(max, 16, True), True),
+    'perr': (0x1c, 0x31, perr, True),
+    'pklb': (0x1c, 0x37, pklb, False),
+    'pkwb': (0x1c, 0x36, pkwb, False),
+    'unpkbl': (0x1c, 0x35, unpkbl, False),
+    'unpkbw': (0x1c, 0x34, unpkbw, False),
+}
+for w, fn in (('b', 0x00), ('w', 0x10), ('l', 0x20), ('q', 0x30)):
+    INSNS['msk%sl' % w] = (0x12, fn + 0x02, msk(w, False), True)
+    INSNS['ext%sl' % w] = (0x12, fn + 0x06, ext(w, False), True)
+    INSNS['ins%sl' % w] = (0x12, fn + 0x0b, ins(w, False), True)
+    if w != 'b':
+        INSNS['msk%sh' % w] = (0x12, fn + 0x42, msk(w, True), True)
+        INSNS['ins%sh' % w] = (0x12, fn + 0x47, ins(w, True), True)
+        INSNS['ext%sh' % w] = (0x12, fn + 0x4a, ext(w, True), True)
+
+# Instructions that are also checked with a literal operand; guest code
+# mostly uses these in that form.
+LITERAL = ('cmpbge', 'zapnot', 'extbl', 'insbl', 'mskbl')
+
+
+def value(rng):
+    """A random operand, often made of extreme or repeated elements."""
+    k = rng.randrange(4)
+    if k == 0:
+        return rng.getrandbits(64)
+    if k == 1:
+        return join([rng.choice((0x00, 0x01, 0x7f, 0x80, 0xfe, 0xff))
+                     for _ in range(8)], 8)
+    if k == 2:
+        return join([rng.choice((0x0000, 0x7fff, 0x8000, 0xffff,
+                                 rng.getrandbits(16))) for _ in range(4)], 16)
+    return join([rng.getrandbits(8)] * 8, 8)
+
+
+def groups():
+    """Yield (name, opcode, function, reference, Ra used, literal)."""
+    for name, (opc, fn, ref, ra) in INSNS.items():
+        yield name, opc, fn, ref, ra, False
+        if name in LITERAL:
+            yield name + '#', opc, fn, ref, ra, True
+
+
+def cases(ref, literal, rng):
+    for n in range(N_CASES):
+        a = value(rng)
+        if literal:
+            b = rng.getrandbits(8)
+        elif rng.getrandbits(1):
+            b = value(rng)
+        else:
+            b = a ^ (rng.getrandbits(8) << 8 * rng.randrange(8))
+        yield a, b, ref(a, b)
+
+
+def build(fn, rounds, only):
+    rng = random.Random(1)
+    a = Asm()
+    table = []
+    glist = [g for g in groups() if only in (None, g[0])]
+    assert glist, 'no instruction %s' % only
+
+    # Any exception is a failure.
+    for vec in range(0x100, 0x800, 0x80):
+        a.org(0x20000 + vec)
+        a.lda(9, vec, 31)
+        a.br('trap')
+    a.org(0x20800)
+    a.label('trap')
+    a.mov(UART, 7)
+    a.puts('TRAP\r\nFAIL\r\n')
+    a.label('trap_halt')
+    a.br('trap_halt')
+
+    a.org(0x10000)
+    a.start(CODE)
+
+    # START marks the beginning of the timed part for benchmarks.
+    a.org(CODE)
+    a.mov(UART, 7)
+    a.puts('START\r\n')
+    a.mov(KSEG + ERRS, 11)
+    a.mov(rounds, 12)
+    a.label('round')
+    a.mov(KSEG + DATA, 10)
+    for g, (_, opc, f, ref, ra, literal) in enumerate(glist):
+        a.bis(31, 31, 20)
+        for x, y, r in cases(ref, literal, rng):
+            table += [x, y, r]
+            a.ldq(1, 0, 10)
+            a.ldq(2, 8, 10)
+            a.ldq(3, 16, 10)
+            if literal:
+                a.opr(opc, f, 1 if ra else 31, y, 4, True)
+            else:
+                a.opr(opc, f, 1 if ra else 31, 2, 4)
+            a.cmpeq(4, 3, 4)
+            a.xor(4, 1, 4, True)
+            a.addq(20, 4, 20)
+            a.lda(10, 24, 10)
+        a.ldq(5, 8 * g, 11)
+        a.addq(5, 20, 5)
+        a.stq(5, 8 * g, 11)
+    a.subq(12, 1, 12, True)
+    a.bne(12, 'round')
+
+    a.mov(UART, 7)
+    a.bis(31, 31, 22)
+    a.puts('MVI:')
+    for g, (name, _, _, _, _, _) in enumerate(glist):
+        a.ldq(5, 8 * g, 11)
+        a.puts(' %s ' % name)
+        a.beq(5, 'ok_%d' % g)
+        a.puts('FAIL')
+        a.bis(31, 1, 22, True)
+        a.br('next_%d' % g)
+        a.label('ok_%d' % g)
+        a.puts('ok')
+        a.label('next_%d' % g)
+    a.puts('\r\n')
+    a.bne(22, 'fail')
+    a.puts('PASS\r\n')
+    a.br('halt')
+    a.label('fail')
+    a.puts('FAIL\r\n')
+    a.label('halt')
+    a.br('halt')
+
+    assert a.pc <= DATA
+    a.org(DATA)
+    for v in table:
+        a.quad(v)
+    assert a.pc <= ERRS
+    a.write(fn, 0x10001, 0x20000)
+
+
+if __name__ == '__main__':
+    ap = argparse.ArgumentParser()
+    ap.add_argument('--only')
+    ap.add_argument('--rounds', type=int, default=1)
+    ap.add_argument('--list', action='store_true')
+    ap.add_argument('rom', nargs='?', default='mvi.rom')
+    args = ap.parse_args()
+    if args.list:
+        print(' '.join(g[0] for g in groups()))
+    else:
+        build(args.rom, args.rounds, args.only)
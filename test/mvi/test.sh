@@ -0,0 +1,29 @@
+#!/bin/bash
+# ./test.sh          check the byte manipulation and MVI instructions
+# ./test.sh bench    time each instruction on its own; ROUNDS sets the
+#                    number of times its cases are run, INSNS limits the
+#                    instructions timed (see mvi.py --list).
+
+. ../romtest.sh mvi
+
+if [ "$1" == "bench" ]
+then
+  rom_config es40.cfg
+  failed=0
+  for insn in ${INSNS:-$(python3 mvi.py --list)}
+  do
+    python3 mvi.py --only $insn --rounds ${ROUNDS:-20000} mvi.rom || exit 1
+    run_rom es40.cfg
+    failed=$(($failed | $result))
+    times="$times$insn: $ms ms\n"
+  done
+  echo -e "$times"
+  result=$failed
+else
+  # Build the MVI test ROM
+  python3 mvi.py mvi.rom || exit 1
+  rom_config es40.cfg
+  run_rom es40.cfg
+fi
+
+rom_exit $result
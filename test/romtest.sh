@@ -0,0 +1,118 @@
+#!/bin/bash
+#
+# Common part of the tests that run a ROM image built by the test's own
+# script. The ROM reports START when the timed part begins, and ends with a
+# line that starts with PASS or FAIL, on serial port 0.
+#
+#   . ../romtest.sh <name>
+#
+# <name>.rom is the ROM image and <name> is used in the messages.
+#
+# rom_config <config> [cpu option]...
+#   write a configuration that runs <name>.rom on one CPU, with the given
+#   extra options in its section
+# run_rom <config>
+#   run it; set result (0 for PASS) and ms, the time from START in ms
+# rom_exit <result>
+#   report the result, remove the files the test made, and exit
+
+export LC_CTYPE=C
+export LANG=C
+export LC_ALL=C
+
+ROM_NAME=$1
+
+if [[ -f ../../../build/axpbox ]]; then
+  AXPBOX=../../../build/axpbox
+else # Travis
+  AXPBOX=../../build/axpbox
+fi
+
+function rom_config() {
+  local config=$1
+  shift
+
+  {
+    echo "sys0 = tsunami"
+    echo "{"
+    echo "  memory.bits = 26;"
+    echo "  rom.decompressed = \"$ROM_NAME.rom\";"
+    echo "  rom.flash = \"flash.rom\";"
+    echo "  rom.dpr = \"dpr.rom\";"
+    echo
+    echo "  cpu0 = ev68cb"
+    echo "  {"
+    echo "    speed = 800M;"
+    for option in "$@"
+    do
+      echo "    $option"
+    done
+    echo "  }"
+    echo
+    echo "  serial0 = serial"
+    echo "  {"
+    echo "    address = \"127.0.0.1\";"
+    echo "    port = 21000;"
+    echo "  }"
+    echo "}"
+  } > $config
+  ROM_CONFIGS="$ROM_CONFIGS $config"
+}
+
+function run_rom() {
+  $AXPBOX run $1 &
+  AXPBOX_PID=$!
+
+  # Wait for AXPbox to start
+  sleep 5
+
+  # Connect to terminal
+  nc -t 127.0.0.1 21000 | tee axp.log &
+  NETCAT_PID=$!
+
+  # Wait for the test to report PASS or FAIL
+  timeout=3000
+  start=
+  while true
+  do
+    if [ $timeout -eq 0 ]
+    then
+      echo "waiting for $ROM_NAME test result timed out" >&2
+      result=1
+      break
+    fi
+
+    # remove null bytes from the log
+    if [ -z "$start" ] && LC_ALL=C sed 's/\x00//g' axp.log | grep -q 'START'
+    then
+      start=$(date +%s%N)
+    fi
+    if LC_ALL=C sed 's/\x00//g' axp.log | grep -q -E '^(PASS|FAIL)'
+    then
+      echo
+      ms=$(( ($(date +%s%N) - ${start:-0}) / 1000000 ))
+      LC_ALL=C sed 's/\x00//g' axp.log | grep -q '^PASS'
+      result=$?
+      break
+    fi
+
+    sleep 0.1
+    timeout=$(($timeout - 1))
+  done
+
+  kill $NETCAT_PID
+  kill $AXPBOX_PID
+  wait $AXPBOX_PID 2>/dev/null
+}
+
+function rom_exit() {
+  if [ $1 -eq 0 ]
+  then
+    echo -e "\033[1;32m$ROM_NAME test passed\033[0m"
+  else
+    echo -e "\033[1;31m$ROM_NAME test failed\033[0m"
+  fi
+
+  rm -f axp.log *.rom $ROM_CONFIGS
+  exit $1
+}
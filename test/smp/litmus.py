@@ -0,0 +1,175 @@
+#!/usr/bin/env python3
+#
+# Build litmus.rom, a decompressed ROM image with a small SMP memory ordering
+# test for a two-CPU ES40. Both CPUs run the same three tests against each
+# other in kernel mode, through the 32-bit KSEG superpage:
+#
+#   llsc  Both CPUs increment a shared counter with LDQ_L/STQ_C; no increment
+#         may be lost.
+#   mp    Message passing: CPU 0 writes data, WMB, then a flag; CPU 1 reads
+#         the flag, MB, then the data, which must be at least as new.
+#   sb    Store buffering: in each round both CPUs store to their own
+#         variable, MB, and load the other one; they must not both read the
+#         value from the previous round.
+#
+# CPU 0 then reports on serial port 0, and ends with PASS or FAIL.
+
+import os
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..'))
+from axpasm import Asm, KSEG, UART  # noqa: E402
+
+DATA = 0x100000         # shared variables, one 64-byte line each
+DPR_START_CPU1 = 0x80110000000 + (0x3428 << 6)
+
+CNT, X0, X1, A0, A1, B0, B1, MPD, MPF, ERR1 = [0x40 * i for i in range(10)]
+
+N_LLSC = 100000
+N_MP = 100000
+N_SB = 2000
+
+
+a = Asm()
+
+
+def barrier(me, other):
+    """Wait until the other CPU has reached the same barrier (r10)."""
+    spin = 'barrier_%x' % a.pc
+    a.addq(10, 1, 10, True)
+    a.stq(10, me, 1)
+    a.mb()
+    a.label(spin)
+    a.ldq(2, other, 1)
+    a.cmpult(2, 10, 2)
+    a.bne(2, spin)
+    a.mb()
+
+
+def tests(cpu):
+    """
+    Code both CPUs run. r1 points to the shared data; r10 counts barriers.
+    CPU 0 keeps its error counts in r20 (mp comes from CPU 1) and r21 (sb).
+    """
+    me, other = (X0, X1) if cpu == 0 else (X1, X0)
+    a_me, a_other = (A0, A1) if cpu == 0 else (A1, A0)
+    b_me, b_other = (B0, B1) if cpu == 0 else (B1, B0)
+    p = 'c%d_' % cpu
+
+    a.mov(KSEG + DATA, 1)
+    a.bis(31, 31, 10)
+    a.bis(31, 31, 21)
+    barrier(a_me, a_other)
+
+    # llsc
+    a.mov(N_LLSC, 3)
+    a.label(p + 'llsc')
+    a.ldq_l(2, CNT, 1)
+    a.addq(2, 1, 2, True)
+    a.stq_c(2, CNT, 1)
+    a.beq(2, p + 'llsc')
+    a.subq(3, 1, 3, True)
+    a.bne(3, p + 'llsc')
+    barrier(a_me, a_other)
+
+    # mp
+    a.mov(N_MP, 3)
+    if cpu == 0:
+        a.bis(31, 31, 4)
+        a.label(p + 'mp')
+        a.addq(4, 1, 4, True)
+        a.stq(4, MPD, 1)
+        a.wmb()
+        a.stq(4, MPF, 1)
+        a.cmpeq(4, 3, 2)
+        a.beq(2, p + 'mp')
+    else:
+        a.bis(31, 31, 5)
+        a.label(p + 'mp')
+        a.ldq(4, MPF, 1)
+        a.mb()
+        a.ldq(6, MPD, 1)
+        a.cmpult(6, 4, 2)
+        a.addq(5, 2, 5)
+        a.cmpeq(4, 3, 2)
+        a.beq(2, p + 'mp')
+        a.stq(5, ERR1, 1)
+    barrier(a_me, a_other)
+
+    # sb
+    a.bis(31, 31, 3)
+    a.label(p + 'sb')
+    a.addq(3, 1, 3, True)
+    barrier(a_me, a_other)
+    a.stq(3, me, 1)
+    a.mb()
+    a.ldq(2, other, 1)
+    a.cmpult(2, 3, 4)           # r4: missed the other's store
+    a.addq(3, 3, 2)
+    a.addq(2, 4, 2)
+    a.stq(2, b_me, 1)
+    a.mb()
+    a.addq(3, 3, 6)
+    a.label(p + 'sbwait')
+    a.ldq(2, b_other, 1)
+    a.cmpult(2, 6, 5)
+    a.bne(5, p + 'sbwait')
+    a.mb()
+    a.and_(2, 1, 2, True)
+    a.and_(2, 4, 2)
+    a.addq(21, 2, 21)
+    a.mov(N_SB, 2)
+    a.cmpult(3, 2, 2)
+    a.bne(2, p + 'sb')
+    barrier(a_me, a_other)
+
+
+def report(name, fail_reg):
+    a.puts(' %s ' % name)
+    a.beq(fail_reg, 'ok_' + name)
+    a.puts('FAIL')
+    a.bis(31, 1, 22, True)
+    a.br('next_' + name)
+    a.label('ok_' + name)
+    a.puts('ok')
+    a.label('next_' + name)
+
+
+# CPU 0 starts at 0x10000 in PALmode, and starts CPU 1 through the DPR.
+a.org(0x10000)
+a.start(0x11000)
+
+a.org(0x11000)
+a.mov(DPR_START_CPU1, 2)
+a.hw_stl_phys(31, 2)
+tests(0)
+a.ldq(20, ERR1, 1)
+a.ldq(3, CNT, 1)
+a.mov(2 * N_LLSC, 2)
+a.cmpeq(3, 2, 3)
+a.cmpeq(3, 0, 3, True)      # r3: llsc failed
+a.bis(31, 31, 22)
+a.mov(UART, 7)
+a.puts('SMP litmus:')
+report('llsc', 3)
+report('mp', 20)
+report('sb', 21)
+a.puts('\r\n')
+a.bne(22, 'fail')
+a.puts('PASS\r\n')
+a.br('halt')
+a.label('fail')
+a.puts('FAIL\r\n')
+a.label('halt')
+a.br('halt')
+
+# CPU 1 is started at 0x8000 in PALmode.
+a.org(0x8000)
+a.start(0x12000)
+
+a.org(0x12000)
+tests(1)
+a.label('halt1')
+a.br('halt1')
+
+a.write(sys.argv[1] if len(sys.argv) > 1 else 'litmus.rom', 0x10001, 0x20000)
@@ -0,0 +1,60 @@
+#!/bin/bash
+export LC_CTYPE=C
+export LANG=C
+export LC_ALL=C
+
+# Build the litmus test ROM
+python3 litmus.py litmus.rom || exit 1
+
+# Start AXPbox
+if [[ -f ../../../build/axpbox ]]; then
+  ../../../build/axpbox run &
+  AXPBOX_PID=$!
+else # Travis
+  ../../build/axpbox run &
+  AXPBOX_PID=$!
+fi
+
+# Wait for AXPbox to start
+sleep 5
+
+# Connect to terminal
+nc -t 127.0.0.1 21000 | tee axp.log &
+NETCAT_PID=$!
+
+# Wait for the test to report PASS or FAIL
+timeout=300
+while true
+do
+  if [ $timeout -eq 0 ]
+  then
+    echo "waiting for litmus test result timed out" >&2
+    result=1
+    break
+  fi
+
+  # remove null bytes from the log
+  if LC_ALL=C sed 's/\x00//g' axp.log | grep -q -E '^(PASS|FAIL)'
+  then
+    echo
+    LC_ALL=C sed 's/\x00//g' axp.log | grep -q '^PASS'
+    result=$?
+    break
+  fi
+
+  sleep 1
+  timeout=$(($timeout - 1))
+done
+
+kill $NETCAT_PID
+kill $AXPBOX_PID
+
+if [ $result -eq 0 ]
+then
+  echo -e '\033[1;32mlitmus test passed\033[0m'
+else
+  echo -e '\033[1;31mlitmus test failed\033[0m'
+fi
+
+rm -f axp.log *.rom
+exit $result